@@ -0,0 +1,126 @@
+// nufs-apply: bring a copy of an image up to date with a delta written by
+// nufs-delta.
+//
+// usage: nufs-apply image < delta
+//
+// A full delta makes the image from scratch (replacing what the file
+// held). An incremental one needs the copy to be of the same volume and
+// at the epoch the delta starts from; each is applied in the order they
+// were made. The superblock, which says which epoch the copy is at, is
+// written last, so a delta that was cut short or interrupted can just be
+// applied again.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "delta.h"
+
+static const char *usage = "usage: %s image < delta\n";
+
+static void die(const char *what) {
+  fprintf(stderr, "nufs-apply: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static void fail(const char *what) {
+  fprintf(stderr, "nufs-apply: %s\n", what);
+  exit(1);
+}
+
+static void read_all(void *data, size_t size) {
+  if (fread(data, 1, size, stdin) != size) {
+    fail(ferror(stdin) ? strerror(errno) : "the delta is cut short");
+  }
+}
+
+static void write_block(int fd, int bnum, const char *data) {
+  if (pwrite(fd, data, BLOCK_SIZE, (off_t)bnum * BLOCK_SIZE) != BLOCK_SIZE) {
+    die("write");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, usage, argv[0]);
+    return 1;
+  }
+  const char *image = argv[1];
+
+  delta_header_t hdr;
+  read_all(&hdr, sizeof(hdr));
+  if (memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.block_size != BLOCK_SIZE) {
+    fail("stdin isn't a delta");
+  }
+
+  int fd;
+  if (hdr.since == 0) {
+    fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)hdr.block_count * BLOCK_SIZE) != 0) {
+      die(image);
+    }
+  } else {
+    fd = open(image, O_RDWR);
+    if (fd < 0) {
+      die(image);
+    }
+    superblock_t sb;
+    if (!blocks_probe(image) || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+        sb.volume_id != hdr.volume_id ||
+        sb.block_count != hdr.block_count) {
+      fprintf(stderr, "nufs-apply: %s: not a copy of this volume\n", image);
+      return 1;
+    }
+    if (sb.epoch != hdr.since) {
+      fprintf(stderr,
+              "nufs-apply: %s: the copy is at epoch %d, the delta is from "
+              "epoch %d\n",
+              image, sb.epoch, hdr.since);
+      return 1;
+    }
+  }
+
+  char block[BLOCK_SIZE];
+  char super[BLOCK_SIZE];
+  int have_super = 0;
+  long blocks = 0;
+  for (;;) {
+    delta_record_t rec;
+    read_all(&rec, sizeof(rec));
+    if (rec.count == 0) {
+      break;
+    }
+    if (rec.bnum < 0 || rec.count < 0 ||
+        rec.bnum + rec.count > hdr.block_count) {
+      fail("the delta is damaged");
+    }
+    for (int i = 0; i < rec.count; ++i) {
+      int bnum = rec.bnum + i;
+      read_all(bnum == 0 ? super : block, BLOCK_SIZE);
+      if (bnum == 0) {
+        have_super = 1;
+      } else {
+        write_block(fd, bnum, block);
+      }
+    }
+    blocks += rec.count;
+  }
+
+  if (have_super) {
+    if (fsync(fd) != 0) {
+      die("fsync");
+    }
+    write_block(fd, 0, super);
+  }
+  if (fsync(fd) != 0 || close(fd) != 0) {
+    die(image);
+  }
+  fprintf(stderr, "%ld blocks applied; the copy is now at epoch %d\n", blocks,
+          hdr.epoch);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file backend.h
+ *
+ * Storage engines behind blocks_get_block().
+ *
+ * blocks.c owns the image files and their geometry; a backend only
+ * decides how block contents get from the files into memory and back,
+ * finding each block with blocks_locate():
+ *
+ * - mmap:  the image is mapped window by window, blocks are pointers into
+ *          the mappings
+ * - pread: blocks are read into an in-process LRU cache with pread() and
+ *          written back with pwrite() when evicted or synced
+ * - uring: the same cache, but misses read ahead asynchronously and
+ *          write-back is submitted in batches through io_uring
+ *
+ * Pointers handed out by a backend stay valid until the outermost
+ * operation ends (see blocks_op_begin()), which is the only time a cached
+ * block can be evicted.
+ */
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdio.h>
+
+typedef struct blocks_backend {
+  const char *name;
+
+  // attach to the (already sized) images; returns 0 or a negative errno
+  int (*open)(int block_count);
+  void (*close)();
+
+  // pointer to a block that the caller may modify
+  void *(*get_block)(int bnum);
+  // pointer to a block that the caller will only read
+  const void *(*peek_block)(int bnum);
+  // how many of the `count` blocks from bnum on follow each other in
+  // memory, so one pointer reaches them all (NULL: one at a time)
+  int (*contiguous)(int bnum, int count);
+
+  // the image file is about to be read (or written, if `writing`) directly
+  // at these blocks: make it current and drop copies that would go stale
+  // (NULL: the file always matches what get_block returns)
+  void (*file_io)(int bnum, int count, int writing);
+
+  // these blocks are about to be read: start loading them all at once
+  // (NULL: they're loaded as they are asked for)
+  void (*prefetch)(int bnum, int count);
+
+  // the outermost operation finished; blocks may be recycled now
+  void (*op_end)();
+  // write every modified block back to the image
+  void (*sync)();
+
+  void (*print_stats)(FILE *out);
+} blocks_backend_t;
+
+extern const blocks_backend_t mmap_backend;
+
+/**
+ * Blocks per window the mmap engine maps at a time.
+ */
+extern int map_window;
+
+/**
+ * Number of windows the mmap engine keeps mapped between operations.
+ */
+extern int map_budget;
+extern const blocks_backend_t pread_backend;
+extern const blocks_backend_t uring_backend;
+
+/**
+ * I/O hooks used by the block cache shared by the pread and uring engines.
+ */
+struct cache_entry;
+
+typedef struct cache_io {
+  int (*setup)();
+  void (*teardown)();
+  // fill one entry; returns when its data is valid
+  void (*read)(struct cache_entry *ce);
+  // start filling entries that aren't needed yet (may be NULL)
+  void (*read_ahead)(struct cache_entry **ces, int count);
+  // wait until an entry started by read_ahead has its data
+  void (*wait)(struct cache_entry *ce);
+  // write entries back; returns when all of them are on the image
+  void (*write)(struct cache_entry **ces, int count);
+} cache_io_t;
+
+typedef struct cache_entry {
+  int bnum;
+  int dirty;
+  int loading; // a read_ahead is still in flight
+  char *data;
+  struct cache_entry *prev; // LRU list, most recently used first
+  struct cache_entry *next;
+  struct cache_entry *hnext; // hash chain
+} cache_entry_t;
+
+/**
+ * Shared cache implementation; the engines fill in their I/O hooks.
+ */
+int cache_open(const cache_io_t *io, int block_count);
+void cache_close();
+void *cache_get_block(int bnum);
+const void *cache_peek_block(int bnum);
+void cache_file_io(int bnum, int count, int writing);
+void cache_prefetch(int bnum, int count);
+void cache_op_end();
+void cache_sync();
+void cache_print_stats(FILE *out);
+
+/**
+ * Number of blocks the pread/uring cache keeps between operations.
+ */
+extern int cache_capacity;
+
+/**
+ * Number of blocks the uring engine reads ahead on a sequential miss.
+ */
+extern int cache_readahead;
+
+#endif
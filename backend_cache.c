@@ -0,0 +1,336 @@
+/**
+ * @file backend_cache.c
+ *
+ * In-process block cache shared by the pread and uring engines.
+ *
+ * Blocks live in an LRU list plus a hash table keyed by block number.
+ * Modified blocks are written back when they are evicted or on sync.
+ * Eviction only happens in cache_op_end(), so pointers handed out during
+ * an operation stay valid until it finishes; the cache may grow past its
+ * capacity in the meantime.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "blocks.h"
+
+int cache_capacity = 1024;
+int cache_readahead = 16;
+
+static const cache_io_t *cache_io = 0;
+static int cache_block_count = 0;
+
+static cache_entry_t **buckets = 0;
+static int nbuckets = 0; // power of two
+static cache_entry_t *lru_head = 0;
+static cache_entry_t *lru_tail = 0;
+static cache_entry_t *spare = 0; // evicted entries, ready for reuse
+static int cached = 0;
+
+// sequential access detection for read-ahead
+static int last_access = -2;
+static int ra_end = 0;
+
+static long stat_hits = 0;
+static long stat_misses = 0;
+static long stat_readaheads = 0;
+static long stat_writebacks = 0;
+static long stat_evictions = 0;
+
+static cache_entry_t **bucket_of(int bnum) {
+  return &buckets[(unsigned)bnum * 2654435761u & (nbuckets - 1)];
+}
+
+static cache_entry_t *cache_find(int bnum) {
+  for (cache_entry_t *ce = *bucket_of(bnum); ce; ce = ce->hnext) {
+    if (ce->bnum == bnum) {
+      return ce;
+    }
+  }
+  return 0;
+}
+
+static void lru_unlink(cache_entry_t *ce) {
+  if (ce->prev) {
+    ce->prev->next = ce->next;
+  } else {
+    lru_head = ce->next;
+  }
+  if (ce->next) {
+    ce->next->prev = ce->prev;
+  } else {
+    lru_tail = ce->prev;
+  }
+  ce->prev = ce->next = 0;
+}
+
+static void lru_push_front(cache_entry_t *ce) {
+  ce->prev = 0;
+  ce->next = lru_head;
+  if (lru_head) {
+    lru_head->prev = ce;
+  } else {
+    lru_tail = ce;
+  }
+  lru_head = ce;
+}
+
+// add an (unfilled) entry for the block
+static cache_entry_t *cache_new(int bnum) {
+  cache_entry_t *ce = spare;
+  if (ce) {
+    spare = ce->hnext;
+  } else {
+    ce = malloc(sizeof(cache_entry_t));
+    // block-aligned buffers keep the door open for O_DIRECT
+    if (posix_memalign((void **)&ce->data, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+      abort();
+    }
+  }
+
+  ce->bnum = bnum;
+  ce->dirty = 0;
+  ce->loading = 0;
+  cache_entry_t **bucket = bucket_of(bnum);
+  ce->hnext = *bucket;
+  *bucket = ce;
+  lru_push_front(ce);
+  cached++;
+  return ce;
+}
+
+// forget an entry (it must be clean and not loading)
+static void cache_drop(cache_entry_t *ce) {
+  cache_entry_t **pp = bucket_of(ce->bnum);
+  while (*pp != ce) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = ce->hnext;
+  lru_unlink(ce);
+  ce->hnext = spare;
+  spare = ce;
+  cached--;
+}
+
+// start reading the blocks in [from, to) that aren't cached yet, all at
+// once; returns how many that was
+static int cache_read_ahead(int from, int to) {
+  cache_entry_t *batch[to > from ? to - from : 1];
+  int count = 0;
+  for (int b = from; b < to; ++b) {
+    if (!cache_find(b)) {
+      batch[count] = cache_new(b);
+      batch[count]->loading = 1;
+      count++;
+    }
+  }
+  if (count > 0) {
+    cache_io->read_ahead(batch, count);
+    stat_readaheads += count;
+  }
+  return count;
+}
+
+// start reading ahead if the access pattern looks sequential
+static void cache_maybe_read_ahead(int bnum) {
+  int sequential = bnum == last_access + 1;
+  last_access = bnum;
+  if (!cache_io->read_ahead || !sequential || cache_readahead <= 0 ||
+      ra_end - bnum > cache_readahead / 2) {
+    return;
+  }
+
+  int from = ra_end > bnum + 1 ? ra_end : bnum + 1;
+  int to = bnum + 1 + cache_readahead;
+  if (to > cache_block_count) {
+    to = cache_block_count;
+  }
+
+  cache_read_ahead(from, to);
+  ra_end = to;
+}
+
+static cache_entry_t *cache_lookup(int bnum) {
+  cache_entry_t *ce = cache_find(bnum);
+  if (ce) {
+    stat_hits++;
+    if (ce->loading) {
+      cache_io->wait(ce);
+    }
+    lru_unlink(ce);
+    lru_push_front(ce);
+  } else {
+    stat_misses++;
+    ce = cache_new(bnum);
+    cache_io->read(ce);
+  }
+
+  cache_maybe_read_ahead(bnum);
+  return ce;
+}
+
+int cache_open(const cache_io_t *io, int block_count) {
+  cache_io = io;
+  cache_block_count = block_count;
+  last_access = -2;
+  ra_end = 0;
+  stat_hits = stat_misses = stat_readaheads = 0;
+  stat_writebacks = stat_evictions = 0;
+
+  nbuckets = 1;
+  while (nbuckets < 2 * cache_capacity) {
+    nbuckets *= 2;
+  }
+  buckets = calloc(nbuckets, sizeof(cache_entry_t *));
+
+  int rv = cache_io->setup();
+  if (rv < 0) {
+    free(buckets);
+    buckets = 0;
+  }
+  return rv;
+}
+
+void cache_close() {
+  cache_sync();
+  while (lru_head) {
+    cache_drop(lru_head);
+  }
+  while (spare) {
+    cache_entry_t *ce = spare;
+    spare = ce->hnext;
+    free(ce->data);
+    free(ce);
+  }
+  free(buckets);
+  buckets = 0;
+  cache_io->teardown();
+}
+
+void *cache_get_block(int bnum) {
+  cache_entry_t *ce = cache_lookup(bnum);
+  ce->dirty = 1;
+  return ce->data;
+}
+
+const void *cache_peek_block(int bnum) { return cache_lookup(bnum)->data; }
+
+// blocks are about to be read: load the missing ones in one batch, up to
+// half the cache so they don't push each other out
+void cache_prefetch(int bnum, int count) {
+  if (!cache_io->read_ahead) {
+    return;
+  }
+  if (count > cache_capacity / 2) {
+    count = cache_capacity / 2;
+  }
+  if (bnum + count > cache_block_count) {
+    count = cache_block_count - bnum;
+  }
+  cache_read_ahead(bnum, bnum + count);
+}
+
+// the image file is going to be accessed directly: write back modified
+// blocks in the range, and forget them if the file is about to change
+void cache_file_io(int bnum, int count, int writing) {
+  cache_entry_t **found = malloc(count * sizeof(cache_entry_t *));
+  cache_entry_t **dirty = malloc(count * sizeof(cache_entry_t *));
+  int nfound = 0;
+  int ndirty = 0;
+  for (int b = bnum; b < bnum + count; ++b) {
+    cache_entry_t *ce = cache_find(b);
+    if (!ce) {
+      continue;
+    }
+    if (ce->loading) {
+      cache_io->wait(ce);
+    }
+    found[nfound++] = ce;
+    if (ce->dirty) {
+      dirty[ndirty++] = ce;
+    }
+  }
+
+  if (ndirty > 0) {
+    cache_io->write(dirty, ndirty);
+    stat_writebacks += ndirty;
+  }
+  for (int i = 0; i < nfound; ++i) {
+    found[i]->dirty = 0;
+    if (writing) {
+      cache_drop(found[i]);
+    }
+  }
+
+  free(found);
+  free(dirty);
+}
+
+// evict least recently used blocks until the cache is back to capacity,
+// writing the modified ones back in one batch
+void cache_op_end() {
+  int excess = cached - cache_capacity;
+  if (excess <= 0) {
+    return;
+  }
+
+  cache_entry_t **victims = malloc(excess * sizeof(cache_entry_t *));
+  cache_entry_t **dirty = malloc(excess * sizeof(cache_entry_t *));
+  int ndirty = 0;
+  cache_entry_t *ce = lru_tail;
+  for (int i = 0; i < excess; ++i, ce = ce->prev) {
+    if (ce->loading) {
+      cache_io->wait(ce);
+    }
+    victims[i] = ce;
+    if (ce->dirty) {
+      dirty[ndirty++] = ce;
+    }
+  }
+
+  if (ndirty > 0) {
+    cache_io->write(dirty, ndirty);
+    stat_writebacks += ndirty;
+  }
+  for (int i = 0; i < excess; ++i) {
+    cache_drop(victims[i]);
+  }
+  stat_evictions += excess;
+
+  free(victims);
+  free(dirty);
+}
+
+// write every modified block back
+void cache_sync() {
+  cache_entry_t **dirty = malloc((cached + 1) * sizeof(cache_entry_t *));
+  int ndirty = 0;
+  for (cache_entry_t *ce = lru_head; ce; ce = ce->next) {
+    if (ce->loading) {
+      cache_io->wait(ce);
+    }
+    if (ce->dirty) {
+      dirty[ndirty++] = ce;
+    }
+  }
+
+  if (ndirty > 0) {
+    cache_io->write(dirty, ndirty);
+    stat_writebacks += ndirty;
+  }
+  for (int i = 0; i < ndirty; ++i) {
+    dirty[i]->dirty = 0;
+  }
+  free(dirty);
+}
+
+void cache_print_stats(FILE *out) {
+  long lookups = stat_hits + stat_misses;
+  fprintf(out,
+          "cache: %d/%d blocks, %ld hits, %ld misses (%.1f%% hit rate), "
+          "%ld read ahead, %ld written back, %ld evicted\n",
+          cached, cache_capacity, stat_hits, stat_misses,
+          lookups ? 100.0 * stat_hits / lookups : 0.0, stat_readaheads,
+          stat_writebacks, stat_evictions);
+}
@@ -0,0 +1,191 @@
+/**
+ * @file backend_mmap.c
+ *
+ * The mmap engine: blocks are pointers into a mapping of the image.
+ *
+ * The image is mapped in fixed-size windows of map_window blocks, each
+ * mapped the first time one of its blocks is used. Windows are kept in
+ * LRU order and unmapped once more than map_budget of them are mapped;
+ * like the block cache, that only happens when an operation ends, so the
+ * windows an operation uses stay pinned until then. A budget that covers
+ * the whole image maps everything and never unmaps.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "backend.h"
+#include "blocks.h"
+
+int map_window = 256;
+int map_budget = 1024;
+
+typedef struct window {
+  char *base; // NULL while unmapped
+  int prev;   // LRU list, most recently used first; -1 ends it
+  int next;
+} window_t;
+
+static int image_blocks = 0;
+
+static window_t *windows = 0;
+static int nwindows = 0;
+static int lru_head = -1;
+static int lru_tail = -1;
+static int mapped = 0;
+
+static long stat_maps = 0;
+static long stat_unmaps = 0;
+
+static void lru_unlink(int w) {
+  window_t *win = &windows[w];
+  if (win->prev >= 0) {
+    windows[win->prev].next = win->next;
+  } else {
+    lru_head = win->next;
+  }
+  if (win->next >= 0) {
+    windows[win->next].prev = win->prev;
+  } else {
+    lru_tail = win->prev;
+  }
+}
+
+static void lru_push_front(int w) {
+  windows[w].prev = -1;
+  windows[w].next = lru_head;
+  if (lru_head >= 0) {
+    windows[lru_head].prev = w;
+  } else {
+    lru_tail = w;
+  }
+  lru_head = w;
+}
+
+// blocks covered by window w (the last one may be short)
+static int window_blocks(int w) {
+  int left = image_blocks - w * map_window;
+  return left < map_window ? left : map_window;
+}
+
+static void window_unmap(int w) {
+  lru_unlink(w);
+  munmap(windows[w].base, (long)BLOCK_SIZE * window_blocks(w));
+  windows[w].base = 0;
+  mapped--;
+  stat_unmaps++;
+}
+
+static char *window_get(int w) {
+  window_t *win = &windows[w];
+  if (win->base) {
+    if (lru_head != w) {
+      lru_unlink(w);
+      lru_push_front(w);
+    }
+    return win->base;
+  }
+
+  // NORESERVE: a window of a sparse image shouldn't need swap up front
+  int prot = blocks_options.read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+  int first = w * map_window;
+  int count = window_blocks(w);
+  int run = blocks_file_run(first, count);
+  off_t pos;
+  int fd = blocks_locate(first, &pos);
+  void *base;
+  if (run == count) {
+    base = mmap(0, (long)BLOCK_SIZE * count, prot, MAP_SHARED | MAP_NORESERVE,
+                fd, pos);
+  } else {
+    // the window spans image files: reserve the address range, then map
+    // each file's piece over its part
+    base = mmap(0, (long)BLOCK_SIZE * count, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    for (int done = 0; base != MAP_FAILED && done < count; done += run) {
+      run = blocks_file_run(first + done, count - done);
+      fd = blocks_locate(first + done, &pos);
+      if (mmap((char *)base + (long)BLOCK_SIZE * done, (long)BLOCK_SIZE * run,
+               prot, MAP_SHARED | MAP_NORESERVE | MAP_FIXED, fd,
+               pos) == MAP_FAILED) {
+        base = MAP_FAILED;
+      }
+    }
+  }
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    abort();
+  }
+  if (blocks_options.hugepages) {
+    // only a hint; whether it's taken depends on the kernel's THP settings
+    madvise(base, (long)BLOCK_SIZE * window_blocks(w), MADV_HUGEPAGE);
+  }
+  win->base = base;
+  lru_push_front(w);
+  mapped++;
+  stat_maps++;
+  return win->base;
+}
+
+static int mmap_open(int block_count) {
+  image_blocks = block_count;
+  nwindows = (block_count + map_window - 1) / map_window;
+  windows = calloc(nwindows, sizeof(window_t));
+  lru_head = lru_tail = -1;
+  mapped = 0;
+  stat_maps = stat_unmaps = 0;
+  return windows ? 0 : -ENOMEM;
+}
+
+static void mmap_close() {
+  while (lru_head >= 0) {
+    window_unmap(lru_head);
+  }
+  free(windows);
+  windows = 0;
+}
+
+static void *mmap_get_block(int bnum) {
+  int w = bnum / map_window;
+  return window_get(w) + (long)BLOCK_SIZE * (bnum - w * map_window);
+}
+
+static const void *mmap_peek_block(int bnum) { return mmap_get_block(bnum); }
+
+// a pointer reaches to the end of its window
+static int mmap_contiguous(int bnum, int count) {
+  int left = map_window - bnum % map_window;
+  return count < left ? count : left;
+}
+
+// unmap the least recently used windows until we're within budget
+static void mmap_op_end() {
+  while (mapped > map_budget && mapped > 1) {
+    window_unmap(lru_tail);
+  }
+}
+
+static void mmap_sync() {
+  for (int w = lru_head; w >= 0; w = windows[w].next) {
+    msync(windows[w].base, (long)BLOCK_SIZE * window_blocks(w), MS_SYNC);
+  }
+}
+
+static void mmap_print_stats(FILE *out) {
+  fprintf(out,
+          "mmap: %d/%d windows of %d blocks mapped (budget %d), %ld maps, "
+          "%ld unmaps\n",
+          mapped, nwindows, map_window, map_budget, stat_maps, stat_unmaps);
+}
+
+const blocks_backend_t mmap_backend = {
+    .name = "mmap",
+    .open = mmap_open,
+    .close = mmap_close,
+    .get_block = mmap_get_block,
+    .peek_block = mmap_peek_block,
+    .contiguous = mmap_contiguous,
+    .op_end = mmap_op_end,
+    .sync = mmap_sync,
+    .print_stats = mmap_print_stats,
+};
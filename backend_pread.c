@@ -0,0 +1,85 @@
+/**
+ * @file backend_pread.c
+ *
+ * The pread engine: a block cache filled with pread() and written back
+ * with pwritev(), one call per run of contiguous blocks.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "blocks.h"
+
+// blocks per pwritev() call (well below IOV_MAX)
+#define WRITE_BATCH 256
+
+// nothing to set up: every block is found with blocks_locate()
+static int pread_setup() { return 0; }
+
+static void pread_teardown() {}
+
+static void pread_read(cache_entry_t *ce) {
+  off_t pos;
+  int fd = blocks_locate(ce->bnum, &pos);
+  ssize_t got = pread(fd, ce->data, BLOCK_SIZE, pos);
+  if (got < BLOCK_SIZE) {
+    memset(ce->data + (got > 0 ? got : 0), 0, BLOCK_SIZE - (got > 0 ? got : 0));
+  }
+}
+
+static int by_bnum(const void *a, const void *b) {
+  return (*(cache_entry_t **)a)->bnum - (*(cache_entry_t **)b)->bnum;
+}
+
+static void pread_write(cache_entry_t **ces, int count) {
+  qsort(ces, count, sizeof(cache_entry_t *), by_bnum);
+
+  struct iovec iov[WRITE_BATCH];
+  int i = 0;
+  while (i < count) {
+    int n = 0;
+    do {
+      iov[n].iov_base = ces[i + n]->data;
+      iov[n].iov_len = BLOCK_SIZE;
+      n++;
+    } while (i + n < count && n < WRITE_BATCH &&
+             ces[i + n]->bnum == ces[i]->bnum + n &&
+             blocks_file_run(ces[i]->bnum, n + 1) == n + 1);
+
+    off_t pos;
+    int fd = blocks_locate(ces[i]->bnum, &pos);
+    ssize_t rv = pwritev(fd, iov, n, pos);
+    if (rv != (ssize_t)n * BLOCK_SIZE) {
+      perror("pwritev");
+    }
+    i += n;
+  }
+}
+
+static const cache_io_t pread_io = {
+    .setup = pread_setup,
+    .teardown = pread_teardown,
+    .read = pread_read,
+    .read_ahead = 0,
+    .wait = 0,
+    .write = pread_write,
+};
+
+static int pread_open(int block_count) {
+  return cache_open(&pread_io, block_count);
+}
+
+const blocks_backend_t pread_backend = {
+    .name = "pread",
+    .open = pread_open,
+    .close = cache_close,
+    .get_block = cache_get_block,
+    .peek_block = cache_peek_block,
+    .file_io = cache_file_io,
+    .prefetch = cache_prefetch,
+    .op_end = cache_op_end,
+    .sync = cache_sync,
+    .print_stats = cache_print_stats,
+};
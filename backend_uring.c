@@ -0,0 +1,242 @@
+/**
+ * @file backend_uring.c
+ *
+ * The io_uring engine: the same block cache as the pread engine, but
+ * sequential misses read ahead asynchronously and write-back is submitted
+ * as one batch per eviction or sync.
+ *
+ * Talks to the kernel through the raw io_uring syscalls, so it needs no
+ * library beyond the kernel headers.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "blocks.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// <linux/fs.h>, pulled in above, has a BLOCK_SIZE macro of its own
+#undef BLOCK_SIZE
+
+#define URING_ENTRIES 256
+
+static int uring_fd = -1;
+
+// submission ring
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static struct io_uring_sqe *sqes;
+// completion ring
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+
+static unsigned pending = 0;  // SQEs queued but not submitted yet
+static unsigned inflight = 0; // submitted but not completed
+
+// user_data for a write; reads carry their cache entry instead
+#define URING_WRITE 1
+
+static int uring_enter(unsigned submit, unsigned wait) {
+  int rv;
+  do {
+    rv = syscall(__NR_io_uring_enter, uring_fd, submit, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rv < 0 && errno == EINTR);
+  return rv;
+}
+
+static struct io_uring_sqe *uring_get_sqe() {
+  unsigned tail = *sq_tail;
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + pending >= URING_ENTRIES) {
+    return 0;
+  }
+  unsigned idx = (tail + pending) & *sq_mask;
+  pending++;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[idx] = idx;
+  return sqe;
+}
+
+static void uring_reap(unsigned wait);
+
+// publish queued SQEs to the kernel, waiting for `wait` completions
+static void uring_submit(unsigned wait) {
+  __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+  unsigned submit = pending;
+  pending = 0;
+  inflight += submit;
+  int rv = uring_enter(submit, 0);
+  if (rv < 0) {
+    perror("io_uring_enter");
+  }
+  uring_reap(wait);
+}
+
+// consume completions, blocking until at least `wait` have arrived
+static void uring_reap(unsigned wait) {
+  unsigned seen = 0;
+  for (;;) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      if (cqe->user_data != URING_WRITE) {
+        cache_entry_t *ce = (cache_entry_t *)(uintptr_t)cqe->user_data;
+        if (cqe->res < BLOCK_SIZE) {
+          int got = cqe->res > 0 ? cqe->res : 0;
+          memset(ce->data + got, 0, BLOCK_SIZE - got);
+        }
+        ce->loading = 0;
+      } else if (cqe->res != BLOCK_SIZE) {
+        fprintf(stderr, "io_uring write failed: %d\n", cqe->res);
+      }
+      head++;
+      seen++;
+      inflight--;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    if (seen >= wait || inflight == 0) {
+      return;
+    }
+    uring_enter(0, 1);
+  }
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, int op, cache_entry_t *ce,
+                       unsigned long long user_data) {
+  off_t pos;
+  sqe->opcode = op;
+  sqe->fd = blocks_locate(ce->bnum, &pos);
+  sqe->addr = (unsigned long)ce->data;
+  sqe->len = BLOCK_SIZE;
+  sqe->off = pos;
+  sqe->user_data = user_data;
+}
+
+static struct io_uring_sqe *uring_must_get_sqe() {
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  while (!sqe) {
+    uring_submit(1); // ring full: make room
+    sqe = uring_get_sqe();
+  }
+  return sqe;
+}
+
+static int uring_setup() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (uring_fd < 0) {
+    return -errno;
+  }
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+  sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              uring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    close(uring_fd);
+    uring_fd = -1;
+    return -ENOMEM;
+  }
+
+  sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+  sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+  sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+  cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+  cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_teardown() {
+  if (uring_fd < 0) {
+    return;
+  }
+  uring_reap(inflight);
+  munmap(sqes, sqes_size);
+  munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  close(uring_fd);
+  uring_fd = -1;
+}
+
+static void uring_read(cache_entry_t *ce) {
+  ce->loading = 1;
+  uring_prep(uring_must_get_sqe(), IORING_OP_READ, ce, (uintptr_t)ce);
+  uring_submit(0);
+  while (ce->loading) {
+    uring_reap(1);
+  }
+}
+
+static void uring_read_ahead(cache_entry_t **ces, int count) {
+  for (int i = 0; i < count; ++i) {
+    uring_prep(uring_must_get_sqe(), IORING_OP_READ, ces[i], (uintptr_t)ces[i]);
+  }
+  uring_submit(0); // don't wait: the data is only needed later
+}
+
+static void uring_wait(cache_entry_t *ce) {
+  while (ce->loading) {
+    uring_reap(1);
+  }
+}
+
+static void uring_write(cache_entry_t **ces, int count) {
+  for (int i = 0; i < count; ++i) {
+    uring_prep(uring_must_get_sqe(), IORING_OP_WRITE, ces[i], URING_WRITE);
+  }
+  uring_submit(inflight + pending);
+}
+
+static const cache_io_t uring_io = {
+    .setup = uring_setup,
+    .teardown = uring_teardown,
+    .read = uring_read,
+    .read_ahead = uring_read_ahead,
+    .wait = uring_wait,
+    .write = uring_write,
+};
+
+static int uring_open(int block_count) {
+  return cache_open(&uring_io, block_count);
+}
+
+#else
+
+static int uring_open(int block_count) { return -ENOSYS; }
+
+#endif
+
+const blocks_backend_t uring_backend = {
+    .name = "uring",
+    .open = uring_open,
+    .close = cache_close,
+    .get_block = cache_get_block,
+    .peek_block = cache_peek_block,
+    .file_io = cache_file_io,
+    .prefetch = cache_prefetch,
+    .op_end = cache_op_end,
+    .sync = cache_sync,
+    .print_stats = cache_print_stats,
+};
@@ -0,0 +1,197 @@
+// nufs-batchbench: time creating, stat'ing and unlinking many small files
+// on a mounted nufs volume, once with a system call per file and once
+// with NUFS_IOC_BATCH, and report files per second for each.
+//
+// usage: nufs-batchbench [-n files] [-s size] dir
+//
+// dir must be on a nufs mount and not exist yet; it is created, filled
+// and emptied again. Files are size bytes (default 1024) and spread over
+// subdirectories of 100, since a directory only holds one block of
+// entries. The kernel caches attributes for a while (see the Caching
+// section of the README), so the per-file stats may not reach nufs.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_batch.h"
+
+#define PER_DIR 100
+
+enum phase { CREATE, STAT, UNLINK, PHASES };
+
+static const char *phase_names[PHASES] = {"create", "stat", "unlink"};
+
+static int files = 2000;
+static int size = 1024;
+static char *data;
+
+static void die(const char *what) {
+  fprintf(stderr, "nufs-batchbench: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// make root/dN for every PER_DIR files and return them open
+static int *make_dirs(const char *root) {
+  int dirs = (files + PER_DIR - 1) / PER_DIR;
+  int *fds = calloc(dirs, sizeof(int));
+  if (mkdir(root, 0755) != 0) {
+    die(root);
+  }
+  for (int d = 0; d < dirs; ++d) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/d%d", root, d);
+    if (mkdir(path, 0755) != 0 ||
+        (fds[d] = open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+      die(path);
+    }
+  }
+  return fds;
+}
+
+static void remove_dirs(const char *root, int *fds) {
+  int dirs = (files + PER_DIR - 1) / PER_DIR;
+  for (int d = 0; d < dirs; ++d) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/d%d", root, d);
+    close(fds[d]);
+    if (rmdir(path) != 0) {
+      die(path);
+    }
+  }
+  if (rmdir(root) != 0) {
+    die(root);
+  }
+  free(fds);
+}
+
+static void one_file(int dirfd, const char *name, enum phase phase) {
+  struct stat st;
+  switch (phase) {
+  case CREATE: {
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || write(fd, data, size) != size || close(fd) != 0) {
+      die(name);
+    }
+    break;
+  }
+  case STAT:
+    if (fstatat(dirfd, name, &st, 0) != 0 || st.st_size != size) {
+      die(name);
+    }
+    break;
+  default:
+    if (unlinkat(dirfd, name, 0) != 0) {
+      die(name);
+    }
+  }
+}
+
+static struct nufs_batch_op *batch_add(struct nufs_batch *batch,
+                                       const char *name, enum phase phase) {
+  switch (phase) {
+  case CREATE:
+    return nufs_batch_create(batch, name, 0644, data, size);
+  case STAT:
+    return nufs_batch_stat(batch, name);
+  default:
+    return nufs_batch_unlink(batch, name);
+  }
+}
+
+// run a batch and check that every operation in it worked
+static void batch_run(int dirfd, struct nufs_batch *batch) {
+  int count = batch->count;
+  if (nufs_batch_run(dirfd, batch) != 0) {
+    die("NUFS_IOC_BATCH");
+  }
+  size_t at = 0;
+  for (int i = 0; i < count; ++i) {
+    struct nufs_batch_op *op = (void *)(batch->ops + at);
+    if (op->result < 0 || (op->op == NUFS_BATCH_STAT && op->size != size)) {
+      errno = op->result < 0 ? -op->result : EIO;
+      die("batched operation");
+    }
+    at += NUFS_BATCH_OP_SIZE(op->name_len, op->data_len);
+  }
+}
+
+// time one phase over every file, per file or batched; returns seconds
+static double run_phase(int *fds, enum phase phase, int batched) {
+  static struct nufs_batch batch;
+  double start = now();
+  for (int d = 0; d * PER_DIR < files; ++d) {
+    nufs_batch_init(&batch);
+    for (int k = d * PER_DIR; k < files && k < (d + 1) * PER_DIR; ++k) {
+      char name[32];
+      snprintf(name, sizeof(name), "f%d", k);
+      if (!batched) {
+        one_file(fds[d], name, phase);
+      } else if (!batch_add(&batch, name, phase)) {
+        batch_run(fds[d], &batch); // full
+        if (!batch_add(&batch, name, phase)) {
+          die(name);
+        }
+      }
+    }
+    if (batched) {
+      batch_run(fds[d], &batch);
+    }
+  }
+  return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      files = atoi(optarg);
+      break;
+    case 's':
+      size = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n files] [-s size] dir\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || files < 1 || size < 0 ||
+      NUFS_BATCH_OP_SIZE(16, size) > NUFS_BATCH_BYTES) {
+    fprintf(stderr, "usage: %s [-n files] [-s size] dir\n", argv[0]);
+    return 1;
+  }
+  const char *root = argv[optind];
+  data = malloc(size + 1);
+  memset(data, 'b', size);
+
+  printf("%d files of %d bytes; files per second:\n", files, size);
+  printf("%-10s", "");
+  for (int p = 0; p < PHASES; ++p) {
+    printf(" %10s", phase_names[p]);
+  }
+  printf("\n");
+  for (int batched = 0; batched <= 1; ++batched) {
+    int *fds = make_dirs(root);
+    printf("%-10s", batched ? "batched" : "per file");
+    for (int p = 0; p < PHASES; ++p) {
+      double secs = run_phase(fds, p, batched);
+      printf(" %10.0f", files / secs);
+      fflush(stdout);
+    }
+    printf("\n");
+    remove_dirs(root, fds);
+  }
+  return 0;
+}
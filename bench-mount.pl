@@ -0,0 +1,354 @@
+#!/usr/bin/perl
+# Mount nufs and time workloads going through the kernel, at several
+# client thread counts; results go to stdout as JSON.
+#
+# usage: perl bench-mount.pl [--threads 1,2,4,8] [--seq-mb 1024]
+#                            [--files 2000] [--random-ops 20000]
+#                            [--options OPTS] [--blocks N]
+#
+# Every workload runs on a freshly built empty image (nufs-mkimage), and
+# the volume is remounted between writing and reading so reads start with
+# nothing in the kernel's caches. Files can't grow past about 4MB (two
+# direct pointers and one indirect block), so the sequential workload is
+# spread over 4MB files.
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Fcntl qw(O_RDWR O_WRONLY O_CREAT SEEK_SET);
+use Getopt::Long;
+use JSON::PP;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep);
+
+my $MNT = "mnt";
+my $IMAGE = "bench.nufs";
+my $LOG = "bench-mount.log";
+my $FILE_MAX = 4 * 1024 * 1024;
+
+my %opt = (
+    threads      => "1,2,4,8",
+    "seq-mb"     => 1024,
+    files        => 2000,
+    "random-ops" => 20000,
+    options      => "",
+    blocks       => 0,
+);
+GetOptions(\%opt, "threads=s", "seq-mb=i", "files=i", "random-ops=i",
+           "options=s", "blocks=i")
+    or die "usage: $0 [--threads list] [--seq-mb N] [--files N] "
+         . "[--random-ops N] [--options OPTS] [--blocks N]\n";
+my @threads = split /,/, $opt{threads};
+
+# room for the sequential files plus a third for everything else
+my $blocks = $opt{blocks} || int($opt{"seq-mb"} * 256 * 4 / 3) + 65536;
+
+my $nufs_pid;
+
+sub log_say {
+    print STDERR "# @_\n";
+}
+
+sub mounted {
+    my @mnt = stat($MNT);
+    my @here = stat(".");
+    return @mnt && $mnt[0] != $here[0];
+}
+
+# Start nufs and wait until the mount point really is a different file
+# system, instead of sleeping and hoping.
+sub mount {
+    mkdir $MNT;
+    my @cmd = ("./nufs", "-s", "-f");
+    push @cmd, "-o", $opt{options} if $opt{options};
+    push @cmd, $MNT, $IMAGE;
+
+    $nufs_pid = fork() // die "fork: $!";
+    if ($nufs_pid == 0) {
+        # nufs logs every call on stdout; keep that off the measurements
+        open STDOUT, ">", "/dev/null";
+        open STDERR, ">>", $LOG;
+        exec @cmd or die "exec: $!";
+    }
+
+    my $deadline = time() + 10;
+    until (mounted()) {
+        if (waitpid($nufs_pid, WNOHANG) == $nufs_pid) {
+            die "nufs exited before mounting (see $LOG)\n";
+        }
+        die "nufs didn't mount within 10 seconds\n" if time() > $deadline;
+        sleep 0.01;
+    }
+}
+
+sub unmount {
+    system("fusermount", "-u", $MNT) == 0 or die "fusermount failed\n";
+    waitpid($nufs_pid, 0);
+}
+
+sub remount {
+    unmount();
+    mount();
+}
+
+sub fresh_image {
+    unlink $IMAGE;
+    mkdir "bench-empty";
+    system("./nufs-mkimage -n $blocks $IMAGE bench-empty 2>>$LOG") == 0
+        or die "nufs-mkimage failed\n";
+    rmdir "bench-empty";
+}
+
+# Run $work->($i) in $n processes at once; returns the wall time.
+sub parallel {
+    my ($n, $work) = @_;
+    my $start = time();
+    my @pids;
+    for my $i (0 .. $n - 1) {
+        my $pid = fork() // die "fork: $!";
+        if ($pid == 0) {
+            # a die must not unwind into the parent's code in the child
+            eval { $work->($i); 1 } or do { print STDERR $@; POSIX::_exit(1) };
+            POSIX::_exit(0);
+        }
+        push @pids, $pid;
+    }
+    my $failed = 0;
+    for my $pid (@pids) {
+        waitpid($pid, 0);
+        $failed++ if $? != 0;
+    }
+    die "$failed workers failed\n" if $failed;
+    return time() - $start;
+}
+
+sub write_file {
+    my ($path, $size, $chunk) = @_;
+    my $buf = "x" x $chunk;
+    sysopen(my $fh, $path, O_WRONLY | O_CREAT) or die "$path: $!";
+    for (my $done = 0; $done < $size; $done += $chunk) {
+        my $n = $size - $done < $chunk ? $size - $done : $chunk;
+        syswrite($fh, $buf, $n) == $n or die "write $path: $!";
+    }
+    close $fh;
+}
+
+sub read_file {
+    my ($path, $chunk) = @_;
+    open(my $fh, "<", $path) or die "$path: $!";
+    my $buf;
+    while (sysread($fh, $buf, $chunk)) {
+    }
+    close $fh;
+}
+
+# the share of $total that worker $i of $n gets
+sub share {
+    my ($total, $i, $n) = @_;
+    return int($total / $n) + ($i < $total % $n ? 1 : 0);
+}
+
+my @results;
+
+sub result {
+    my (%r) = @_;
+    $r{ops_per_sec} = $r{ops} / $r{seconds} if $r{ops};
+    $r{mb_per_sec} = $r{bytes} / $r{seconds} / (1024 * 1024) if $r{bytes};
+    for my $key (qw(seconds ops_per_sec mb_per_sec)) {
+        $r{$key} = 0 + sprintf("%.3f", $r{$key}) if defined $r{$key};
+    }
+    push @results, \%r;
+    log_say(sprintf("%-14s %-8s %2d threads %9.3f s", $r{workload},
+                    $r{phase}, $r{threads}, $r{seconds}));
+}
+
+# Create, stat and delete many small files; directories hold one block of
+# entries, so the files are spread over subdirectories of 100.
+sub small_files {
+    my ($n) = @_;
+    my $per = sub { share($opt{files}, $_[0], $n) };
+    my $path = sub {
+        my ($i, $k) = @_;
+        return sprintf("%s/w%d/d%d/f%d", $MNT, $i, int($k / 100), $k);
+    };
+    my $buf = "s" x 1024;
+
+    my $secs = parallel($n, sub {
+        my ($i) = @_;
+        mkdir "$MNT/w$i" or die "mkdir: $!";
+        for my $k (0 .. $per->($i) - 1) {
+            mkdir "$MNT/w$i/d" . int($k / 100) if $k % 100 == 0;
+            open(my $fh, ">", $path->($i, $k)) or die "create: $!";
+            print $fh $buf;
+            close $fh;
+        }
+    });
+    result(workload => "small-files", phase => "create", threads => $n,
+           seconds => $secs, ops => $opt{files});
+
+    $secs = parallel($n, sub {
+        my ($i) = @_;
+        for my $k (0 .. $per->($i) - 1) {
+            stat($path->($i, $k)) or die "stat: $!";
+        }
+    });
+    result(workload => "small-files", phase => "stat", threads => $n,
+           seconds => $secs, ops => $opt{files});
+
+    $secs = parallel($n, sub {
+        my ($i) = @_;
+        for my $k (0 .. $per->($i) - 1) {
+            unlink($path->($i, $k)) or die "unlink: $!";
+        }
+    });
+    result(workload => "small-files", phase => "unlink", threads => $n,
+           seconds => $secs, ops => $opt{files});
+}
+
+# Write $opt{seq-mb} in 128K requests, remount, read it back.
+sub sequential {
+    my ($n) = @_;
+    my $bytes = $opt{"seq-mb"} * 1024 * 1024;
+    my $files = int(($bytes + $FILE_MAX - 1) / $FILE_MAX);
+    my $chunk = 128 * 1024;
+    my $path = sub { sprintf("%s/seq/d%d/f%d", $MNT, int($_[0] / 100), $_[0]) };
+    mkdir "$MNT/seq";
+    mkdir "$MNT/seq/d$_" for 0 .. int(($files - 1) / 100);
+
+    my $secs = parallel($n, sub {
+        my ($i) = @_;
+        for (my $f = $i; $f < $files; $f += $n) {
+            write_file($path->($f), $FILE_MAX, $chunk);
+        }
+    });
+    result(workload => "sequential", phase => "write", threads => $n,
+           seconds => $secs, bytes => $files * $FILE_MAX);
+
+    remount();
+    $secs = parallel($n, sub {
+        my ($i) = @_;
+        for (my $f = $i; $f < $files; $f += $n) {
+            read_file($path->($f), $chunk);
+        }
+    });
+    result(workload => "sequential", phase => "read", threads => $n,
+           seconds => $secs, bytes => $files * $FILE_MAX);
+}
+
+# 4K reads and writes (half each) at random places in 16 files per worker.
+sub random_io {
+    my ($n) = @_;
+    my $files = 16;
+    parallel($n, sub {
+        my ($i) = @_;
+        for my $f (0 .. $files - 1) {
+            write_file("$MNT/r$i-$f", $FILE_MAX, 128 * 1024);
+        }
+    });
+    remount();
+
+    my $secs = parallel($n, sub {
+        my ($i) = @_;
+        srand(3650 + $i);
+        my @fhs;
+        for my $f (0 .. $files - 1) {
+            sysopen($fhs[$f], "$MNT/r$i-$f", O_RDWR) or die "open: $!";
+        }
+        my $buf = "r" x 4096;
+        my $in;
+        for (1 .. share($opt{"random-ops"}, $i, $n)) {
+            my $fh = $fhs[int(rand($files))];
+            sysseek($fh, 4096 * int(rand($FILE_MAX / 4096)), SEEK_SET);
+            if (rand() < 0.5) {
+                sysread($fh, $in, 4096) == 4096 or die "read: $!";
+            } else {
+                syswrite($fh, $buf) == 4096 or die "write: $!";
+            }
+        }
+        close $_ for @fhs;
+    });
+    result(workload => "random-4k", phase => "mixed", threads => $n,
+           seconds => $secs, ops => $opt{"random-ops"},
+           bytes => $opt{"random-ops"} * 4096);
+}
+
+# What extracting an archive does: directories three deep, files of
+# assorted sizes, each followed by chmod and utime. Then remount and walk
+# the tree with find and ls -lR at the same time.
+sub tree {
+    my ($n) = @_;
+    my @sizes = (0, 100, 1024, 3000, 4096, 10000, 40000, 130000, 700000);
+    my $entries = 0;
+    my $bytes = 0;
+    my $build = sub {
+        my ($i, $count) = @_;
+        my $k = 0;
+        for my $a (0 .. 3) {
+            for my $b (0 .. 3) {
+                for my $c (0 .. 3) {
+                    my $dir = "$MNT/tree/w$i/a$a/b$b/c$c";
+                    for my $f (0 .. 9) {
+                        my $size = $sizes[$k++ % @sizes];
+                        if ($count) {
+                            $entries++;
+                            $bytes += $size;
+                            next;
+                        }
+                        write_file("$dir/f$f", $size, 64 * 1024);
+                        chmod 0644, "$dir/f$f";
+                        utime 1000000000, 1000000000, "$dir/f$f";
+                    }
+                }
+            }
+        }
+    };
+    $build->(0, 1);
+    mkdir "$MNT/tree";
+
+    my $secs = parallel($n, sub {
+        my ($i) = @_;
+        mkdir "$MNT/tree/w$i" or die "mkdir: $!";
+        for my $a (0 .. 3) {
+            mkdir "$MNT/tree/w$i/a$a" or die "mkdir: $!";
+            for my $b (0 .. 3) {
+                mkdir "$MNT/tree/w$i/a$a/b$b" or die "mkdir: $!";
+                for my $c (0 .. 3) {
+                    mkdir "$MNT/tree/w$i/a$a/b$b/c$c" or die "mkdir: $!";
+                }
+            }
+        }
+        $build->($i, 0);
+    });
+    result(workload => "tree", phase => "build", threads => $n,
+           seconds => $secs, ops => $entries * $n, bytes => $bytes * $n);
+
+    remount();
+    $secs = parallel($n, sub {
+        my ($i) = @_;
+        my $cmd = $i % 2 ? "ls -lR $MNT/tree" : "find $MNT/tree -ls";
+        system("$cmd > /dev/null") == 0 or die "$cmd failed\n";
+    });
+    result(workload => "tree", phase => "walk", threads => $n,
+           seconds => $secs, ops => $entries * $n * $n);
+}
+
+-x "./nufs" && -x "./nufs-mkimage" or die "build nufs and nufs-mkimage first\n";
+mounted() and die "$MNT is already mounted\n";
+unlink $LOG;
+
+for my $workload (\&small_files, \&sequential, \&random_io, \&tree) {
+    for my $n (@threads) {
+        fresh_image();
+        mount();
+        eval { $workload->($n) };
+        my $error = $@;
+        unmount() if mounted();
+        die $error if $error;
+    }
+}
+unlink $IMAGE;
+
+print JSON::PP->new->canonical->pretty->encode({
+    options => $opt{options},
+    blocks  => $blocks,
+    results => \@results,
+});
@@ -0,0 +1,498 @@
+// nufs-bench: run a few workloads against the storage layer directly,
+// once per block backend, and report how long each one took.
+//
+// usage: nufs-bench [-b backend] [-n blocks] [-c cache_blocks]
+//                   [-r readahead] [-w map_window] [-m map_budget]
+//                   [-S image:image...] [-u stripe_unit] [image]
+//
+// Without -b every backend is measured in turn. The image is formatted
+// afresh for each backend (default: a temporary file); "scratch" runs the
+// same workloads on a volume in memory instead. Then each backend
+// reads a file right after the image is opened, taking turns between an
+// image without block checksums and one with, to show what verifying
+// costs.
+//
+// Then files written side by side, 4K at a time from each in turn, are
+// defragmented (see defrag.h), with every other one read back cold before
+// and after.
+//
+// Last, half the volume is written and read back cold (the images dropped
+// from the page cache first) with the volume striped over more and more
+// images: the ones given with -S, each of which should be on a device of
+// its own, or else 1, 2 and 4 images next to the first one, which only
+// shows what striping costs. This uses the uring backend unless -b picks
+// another.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "crc32c.h"
+#include "defrag.h"
+#include "storage.h"
+
+#define SMALL_FILES 200
+#define SMALL_SIZE 1024
+#define BIG_SIZE (4 * 1024 * 1024)
+#define RANDOM_READS 2000
+#define APPENDS 10000
+#define APPEND_SIZE 100
+#define WRITE_BUFFER (64 * 1024)
+#define COLD_RUNS 21
+#define STRIPE_CHUNK (128 * 1024)
+#define FRAG_FILES 8
+#define FRAG_SIZE (1024 * 1024)
+#define FRAG_RUNS 5
+
+static const char *all_backends[] = {"mmap", "pread", "uring"};
+
+// request sizes for the sequential runs: FUSE's default and big_writes
+static const int chunks[] = {4 * 1024, 128 * 1024};
+
+// the storage layer traces every call on stdout; results go here instead
+static FILE *out;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, long bytes) {
+  double secs = now() - start;
+  if (bytes > 0) {
+    fprintf(out, "  %-12s %8.3f ms  %8.1f MB/s\n", name, secs * 1e3,
+            bytes / secs / (1024 * 1024));
+  } else {
+    fprintf(out, "  %-12s %8.3f ms\n", name, secs * 1e3);
+  }
+}
+
+// every call is its own operation, as it would be under FUSE
+static int bench_write(const char *path, const char *buf, size_t size,
+                       off_t offset) {
+  storage_op_begin();
+  int rv = storage_write(path, buf, size, offset);
+  storage_op_end();
+  return rv;
+}
+
+static int bench_read(const char *path, char *buf, size_t size,
+                      off_t offset) {
+  storage_op_begin();
+  int rv = storage_read(path, buf, size, offset);
+  storage_op_end();
+  return rv;
+}
+
+static int bench_mknod(const char *path, int mode) {
+  storage_op_begin();
+  int rv = storage_mknod(path, mode);
+  storage_op_end();
+  return rv;
+}
+
+static void bench_backend(const char *backend, const char *image) {
+  static char buf[128 * 1024];
+  char path[64];
+  double start;
+
+  unlink(image);
+  blocks_options.scratch = strcmp(backend, "scratch") == 0;
+  blocks_options.backend = backend;
+  storage_init(image);
+  fprintf(out, "%s:\n", backend);
+
+  start = now();
+  bench_mknod("/small", 040755);
+  for (int i = 0; i < SMALL_FILES; ++i) {
+    snprintf(path, sizeof(path), "/small/f%d", i);
+    bench_mknod(path, 0100644);
+    bench_write(path, buf, SMALL_SIZE, 0);
+  }
+  report("create", start, (long)SMALL_FILES * SMALL_SIZE);
+
+  memset(buf, 'x', sizeof(buf));
+  for (int i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+    char name[32];
+    snprintf(path, sizeof(path), "/big%d", i);
+
+    start = now();
+    bench_mknod(path, 0100644);
+    for (long off = 0; off < BIG_SIZE; off += chunks[i]) {
+      bench_write(path, buf, chunks[i], off);
+    }
+    snprintf(name, sizeof(name), "write %dK", chunks[i] / 1024);
+    report(name, start, BIG_SIZE);
+
+    start = now();
+    storage_sync();
+    report("sync", start, 0);
+
+    start = now();
+    for (long off = 0; off < BIG_SIZE; off += chunks[i]) {
+      bench_read(path, buf, chunks[i], off);
+    }
+    snprintf(name, sizeof(name), "read %dK", chunks[i] / 1024);
+    report(name, start, BIG_SIZE);
+  }
+
+  // a logger: one small write per line, through one open file
+  for (int buffered = 0; buffered < 2; ++buffered) {
+    int keep_cache;
+    snprintf(path, sizeof(path), "/log%d", buffered);
+    storage_set_write_buffer(buffered ? WRITE_BUFFER : 0);
+
+    start = now();
+    bench_mknod(path, 0100644);
+    storage_op_begin();
+    int fh = storage_open(path, &keep_cache);
+    storage_op_end();
+    for (int i = 0; i < APPENDS; ++i) {
+      storage_op_begin();
+      storage_write_handle(fh, buf, APPEND_SIZE, (off_t)i * APPEND_SIZE);
+      storage_op_end();
+    }
+    storage_op_begin();
+    storage_release(fh);
+    storage_op_end();
+    report(buffered ? "append buf" : "append", start,
+           (long)APPENDS * APPEND_SIZE);
+  }
+  storage_set_write_buffer(0);
+
+  snprintf(path, sizeof(path), "/big%d", 1);
+  srand(3650);
+  start = now();
+  for (int i = 0; i < RANDOM_READS; ++i) {
+    long off = (long)(rand() % (BIG_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+    bench_read(path, buf, BLOCK_SIZE, off);
+  }
+  report("random read", start, (long)RANDOM_READS * BLOCK_SIZE);
+
+  fprintf(out, "  ");
+  blocks_print_stats(out);
+  storage_free();
+  blocks_options.scratch = 0;
+}
+
+// an image holding one big file, with or without block checksums
+static void bench_big_image(const char *image, int checksums) {
+  static char buf[128 * 1024];
+
+  unlink(image);
+  blocks_options.checksums = checksums;
+  storage_init(image);
+  memset(buf, 'x', sizeof(buf));
+  bench_mknod("/big", 0100644);
+  for (long off = 0; off < BIG_SIZE; off += sizeof(buf)) {
+    bench_write("/big", buf, sizeof(buf), off);
+  }
+  storage_free();
+}
+
+// how long reading the big file takes
+static double bench_big_read() {
+  static char buf[128 * 1024];
+  double start = now();
+  for (long off = 0; off < BIG_SIZE; off += sizeof(buf)) {
+    bench_read("/big", buf, sizeof(buf), off);
+  }
+  return now() - start;
+}
+
+static int by_time(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// reports the median of runs timings (which get sorted) and returns it
+static double report_median(const char *name, double *secs, int runs,
+                            long bytes) {
+  qsort(secs, runs, sizeof(double), by_time);
+  double median = secs[runs / 2];
+  fprintf(out, "  %-12s %8.3f ms  %8.1f MB/s\n", name, median * 1e3,
+          bytes / median / (1024 * 1024));
+  return median;
+}
+
+// the big file read just after its image was opened, so every block is
+// verified against its checksum (if the image has them), and read again
+// once it was; one read is over in about a millisecond, so the medians of
+// many, taking turns with and without checksums so both see the machine
+// in the same state
+static void bench_checksums(const char *backend, const char *image) {
+  char crc_image[PATH_MAX];
+  snprintf(crc_image, sizeof(crc_image), "%s-crc", image);
+  fprintf(out, "%s, block checksums:\n", backend);
+  blocks_options.backend = backend;
+  bench_big_image(image, 0);
+  bench_big_image(crc_image, 1);
+
+  double cold[2][COLD_RUNS];
+  double warm[2][COLD_RUNS];
+  for (int run = 0; run < COLD_RUNS; ++run) {
+    for (int checked = 0; checked < 2; ++checked) {
+      storage_init(checked ? crc_image : image);
+      cold[checked][run] = bench_big_read();
+      warm[checked][run] = bench_big_read();
+      storage_free();
+    }
+  }
+  double plain = report_median("cold read", cold[0], COLD_RUNS, BIG_SIZE);
+  report_median("warm read", warm[0], COLD_RUNS, BIG_SIZE);
+  double checked = report_median("cold crc", cold[1], COLD_RUNS, BIG_SIZE);
+  report_median("warm crc", warm[1], COLD_RUNS, BIG_SIZE);
+  fprintf(out, "  cold overhead %.1f%% (crc32c: %s)\n",
+          (checked - plain) / plain * 100, crc32c_impl());
+  unlink(crc_image);
+  blocks_options.checksums = 1;
+}
+
+// an image dropped from the page cache, so what is read next comes from
+// the device
+static void drop_cache(const char *image) {
+  int fd = open(image, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// write half the volume in 4MB files and read it back cold, striped over
+// the first image and `count` of the others
+static void bench_stripe(const char *backend, const char *image,
+                         const char **more, int count) {
+  static char buf[STRIPE_CHUNK];
+  char path[64];
+  static char members[64 * PATH_MAX];
+  members[0] = 0;
+  for (int i = 0; i < count; ++i) {
+    strcat(members, i ? ":" : "");
+    strcat(members, more[i]);
+    unlink(more[i]);
+  }
+
+  unlink(image);
+  blocks_options.backend = backend;
+  blocks_options.stripe_images = count ? members : 0;
+  storage_init(image);
+  int files = (long)blocks_options.format_blocks * BLOCK_SIZE / 2 / BIG_SIZE;
+  if (files < 1) {
+    files = 1;
+  }
+  long bytes = (long)files * BIG_SIZE;
+  fprintf(out, "%s, %d image%s:\n", backend, count + 1, count ? "s" : "");
+
+  memset(buf, 's', sizeof(buf));
+  double start = now();
+  for (int f = 0; f < files; ++f) {
+    snprintf(path, sizeof(path), "/s%d", f);
+    bench_mknod(path, 0100644);
+    for (long off = 0; off < BIG_SIZE; off += sizeof(buf)) {
+      bench_write(path, buf, sizeof(buf), off);
+    }
+  }
+  storage_sync();
+  report("write+sync", start, bytes);
+
+  storage_free();
+  drop_cache(image);
+  for (int i = 0; i < count; ++i) {
+    drop_cache(more[i]);
+  }
+  storage_init(image);
+  start = now();
+  for (int f = 0; f < files; ++f) {
+    snprintf(path, sizeof(path), "/s%d", f);
+    for (long off = 0; off < BIG_SIZE; off += sizeof(buf)) {
+      bench_read(path, buf, sizeof(buf), off);
+    }
+  }
+  report("cold read", start, bytes);
+  fprintf(out, "  ");
+  blocks_print_stats(out);
+  storage_free();
+
+  for (int i = 0; i < count; ++i) {
+    unlink(more[i]);
+  }
+  blocks_options.stripe_images = 0;
+}
+
+static void bench_stripes(const char *backend, const char *image,
+                          char *list) {
+  const char *more[64];
+  int count = 0;
+  if (list) {
+    for (char *s = strtok(list, ":"); s && count < 63; s = strtok(0, ":")) {
+      more[count++] = s;
+    }
+    for (int n = 0; n <= count; ++n) {
+      bench_stripe(backend, image, more, n);
+    }
+    return;
+  }
+
+  static char names[3][PATH_MAX];
+  for (count = 0; count < 3; ++count) {
+    snprintf(names[count], sizeof(names[count]), "%s.%d", image, count + 1);
+    more[count] = names[count];
+  }
+  for (int n = 0; n <= count; n = n ? 2 * n + 1 : 1) {
+    bench_stripe(backend, image, more, n);
+  }
+}
+
+// read every file of bench_defrag() from an image that is no longer in
+// the page cache
+// every other file read right after the image was opened and dropped
+// from the page cache. Reading them all would read the same stretch of the
+// image before and after defragmenting, which the kernel's read-ahead of
+// a mapped file makes about as fast; skipping half of the files, their
+// blocks interleaved with the ones read only cost while fragmented. The
+// median of a few runs, since one is over in a few milliseconds.
+static void bench_frag_read(const char *name, const char *image) {
+  static char buf[128 * 1024];
+  char path[64];
+  double secs[FRAG_RUNS];
+  for (int run = 0; run < FRAG_RUNS; ++run) {
+    storage_free();
+    drop_cache(image);
+    storage_init(image);
+    double start = now();
+    for (int f = 0; f < FRAG_FILES; f += 2) {
+      snprintf(path, sizeof(path), "/frag%d", f);
+      for (long off = 0; off < FRAG_SIZE; off += sizeof(buf)) {
+        bench_read(path, buf, sizeof(buf), off);
+      }
+    }
+    secs[run] = now() - start;
+  }
+  report_median(name, secs, FRAG_RUNS, (long)FRAG_FILES / 2 * FRAG_SIZE);
+}
+
+static void bench_defrag(const char *backend, const char *image) {
+  static char buf[4096];
+  char path[64];
+  unlink(image);
+  blocks_options.backend = backend;
+  storage_init(image);
+  fprintf(out, "%s, %d files written 4K at a time side by side:\n", backend,
+          FRAG_FILES);
+  memset(buf, 'f', sizeof(buf));
+  for (int f = 0; f < FRAG_FILES; ++f) {
+    snprintf(path, sizeof(path), "/frag%d", f);
+    bench_mknod(path, 0100644);
+  }
+  for (long off = 0; off < FRAG_SIZE; off += sizeof(buf)) {
+    for (int f = 0; f < FRAG_FILES; ++f) {
+      snprintf(path, sizeof(path), "/frag%d", f);
+      bench_write(path, buf, sizeof(buf), off);
+    }
+  }
+
+  bench_frag_read("fragmented", image);
+  double start = now();
+  int moved = defrag_pass();
+  storage_sync();
+  report("defrag+sync", start, (long)moved * BLOCK_SIZE);
+  bench_frag_read("defragmented", image);
+  storage_free();
+}
+
+int main(int argc, char *argv[]) {
+  const char *only = 0;
+  char *stripe_list = 0;
+  int opt;
+
+  blocks_options.format_blocks = 8192; // 32MB
+  while ((opt = getopt(argc, argv, "b:n:c:r:w:m:S:u:")) != -1) {
+    switch (opt) {
+    case 'b':
+      only = optarg;
+      break;
+    case 'n':
+      blocks_options.format_blocks = atoi(optarg);
+      break;
+    case 'c':
+      blocks_options.cache_blocks = atoi(optarg);
+      break;
+    case 'r':
+      blocks_options.readahead = atoi(optarg);
+      break;
+    case 'w':
+      blocks_options.map_window = atoi(optarg);
+      break;
+    case 'm':
+      blocks_options.map_budget = atoi(optarg);
+      break;
+    case 'S':
+      stripe_list = optarg;
+      break;
+    case 'u':
+      blocks_options.stripe_unit = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-b backend] [-n blocks] [-c cache_blocks] "
+              "[-r readahead] [-w map_window] [-m map_budget] "
+              "[-S image:image...] [-u stripe_unit] [image]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  char image[] = "/tmp/nufs-bench-XXXXXX";
+  const char *path = optind < argc ? argv[optind] : 0;
+  if (!path) {
+    close(mkstemp(image));
+    path = image;
+  }
+
+  // the caching backends free their buffers whenever an image is closed;
+  // keep that memory in the process, or whether the next image opened
+  // page-faults in fresh buffers depends on what ran before it
+  mallopt(M_TRIM_THRESHOLD, INT_MAX);
+
+  out = fdopen(dup(1), "w");
+  setvbuf(out, 0, _IOLBF, 0);
+  if (!freopen("/dev/null", "w", stdout)) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  fprintf(out, "%d blocks, cache of %d blocks, read-ahead of %d\n",
+          blocks_options.format_blocks, blocks_options.cache_blocks,
+          blocks_options.readahead);
+  for (int i = 0; i < sizeof(all_backends) / sizeof(all_backends[0]); ++i) {
+    if (!only || strcmp(only, all_backends[i]) == 0) {
+      bench_backend(all_backends[i], path);
+    }
+  }
+  if (!only || strcmp(only, "scratch") == 0) {
+    bench_backend("scratch", path);
+  }
+  for (int i = 0; i < sizeof(all_backends) / sizeof(all_backends[0]); ++i) {
+    if (!only || strcmp(only, all_backends[i]) == 0) {
+      bench_checksums(all_backends[i], path);
+    }
+  }
+  for (int i = 0; i < sizeof(all_backends) / sizeof(all_backends[0]); ++i) {
+    if (!only || strcmp(only, all_backends[i]) == 0) {
+      bench_defrag(all_backends[i], path);
+    }
+  }
+  if (!only || strcmp(only, "scratch") != 0) {
+    bench_stripes(only ? only : "uring", path, stripe_list);
+  }
+
+  unlink(path);
+  return 0;
+}
@@ -34,6 +34,34 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Find the first clear bit in [from, to), one 64-bit word at a time.
+// Bits are stored least-significant first, so on a little-endian host the
+// word view agrees with bitmap_get().
+static int bitmap_scan(uint64_t *words, int from, int to) {
+  for (int i = from; i < to;) {
+    uint64_t word = ~words[i / 64] & (~0ULL << (i % 64));
+    if (word) {
+      int bit = (i & ~63) + __builtin_ctzll(word);
+      return bit < to ? bit : -1;
+    }
+    i = (i & ~63) + 64;
+  }
+  return -1;
+}
+
+// Find a clear bit, starting at the given index and wrapping around.
+int bitmap_find_free(void *bm, int size, int start) {
+  if (start >= size || start < 0) {
+    start = 0;
+  }
+
+  int bit = bitmap_scan((uint64_t *)bm, start, size);
+  if (bit < 0) {
+    bit = bitmap_scan((uint64_t *)bm, 0, start);
+  }
+  return bit;
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
 
@@ -26,6 +26,21 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first clear bit at or after the given index.
+ *
+ * The search works on whole 64-bit words, so the bitmap must be 8-byte
+ * aligned. It wraps around to the start of the bitmap if nothing is free
+ * after `start`.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ * @param start Bit index to start searching from.
+ *
+ * @return The index of a clear bit, or -1 if every bit is set.
+ */
+int bitmap_find_free(void *bm, int size, int start);
+
 /**
  * Pretty-print a bitmap.
  *
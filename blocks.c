@@ -9,25 +9,110 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "backend.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "crc32c.h"
+#include "freespace.h"
+#include "inode.h"
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 3
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+static const int BYTES_PER_INODE = 16 * 1024; // one inode per 16K of image
+
+// Bitmaps are addressed block by block, so a region never has to be
+// contiguous in memory.
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+#define CSUMS_PER_BLOCK (BLOCK_SIZE / 4)
+#define EPOCHS_PER_BLOCK (BLOCK_SIZE / 4)
+
+int BLOCK_COUNT = 0;
+long NUFS_SIZE = 0;
+int INODE_COUNT = 0;
+
+int BLOCK_BITMAP_SIZE = 0;
+int INODE_BITMAP_SIZE = 0;
+
+int BLOCK_BITMAP_START = 0;
+int INODE_BITMAP_START = 0;
+int INODE_TABLE_START = 0;
+int CSUM_START = 0;
+int CHANGES_START = 0;
+int DATA_START = 0;
+int FAST_BLOCKS = 0;
+
+blocks_csum_stats_t blocks_csum_stats;
+blocks_tier_stats_t blocks_tier_stats;
+
+blocks_options_t blocks_options = {
+    .backend = "mmap",
+    .cache_blocks = 1024,
+    .readahead = 16,
+    .map_window = 256,
+    .map_budget = 1024,
+    .format_blocks = 256,
+    .format_inodes = 0,
+    .read_only = 0,
+    .discard = 1,
+    .checksums = 1,
+    .track_changes = 1,
+    .stripe_unit = 16,
+};
+
+static const blocks_backend_t *backends[] = {
+    &mmap_backend,
+    &pread_backend,
+    &uring_backend,
+};
 
+static const blocks_backend_t *backend = &mmap_backend;
 static int blocks_fd = -1;
-static void *blocks_base = 0;
+static int slow_fd = -1; // the slow tier's image, if there is one
+// the images the fast blocks are striped over; the first is blocks_fd
+static int *stripe_fds = 0;
+static int stripes = 1;
+static int stripe_unit = 1;
+static int op_depth = 0;
+// threads (the scrubber, image builders) take turns at whole operations
+static pthread_mutex_t op_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// Checksum bookkeeping, one bit per block: checked since the image was
+// opened, found not to match, and changed during the current operation.
+static void *csum_verified = 0;
+static void *csum_bad = 0;
+static void *csum_touched = 0;
+static int *touched = 0; // the blocks whose touched bit is set
+static int touched_count = 0;
+static int touched_size = 0;
+static uint32_t csum_zero; // of a block of zeros
+// the table block csum_get() used last, which stays put until the
+// outermost operation ends
+static int csum_table_bnum = -1;
+static const uint32_t *csum_table;
+
+// accesses to each block's file data, halved by every blocks_tier_age();
+// in memory only
+static unsigned char *heat = 0;
+
+// Changed block tracking: the backup epoch blocks changed from now on are
+// tagged with, and one bit per block that already has been this epoch.
+static int epoch = 0;
+static void *epoch_tagged = 0;
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -40,59 +125,1023 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Size in bytes of a bitmap with the given number of bits, padded to whole
+// 64-bit words so bitmap_find_free() can scan it a word at a time.
+static int bitmap_bytes(int bits) { return (bits + 63) / 64 * 8; }
+
+// Work out where each region goes for an image of the given size.
+static void blocks_layout(superblock_t *sb, int block_count) {
+  int inode_count = blocks_options.format_inodes;
+  if (inode_count <= 0) {
+    inode_count = (int)((long)block_count * BLOCK_SIZE / BYTES_PER_INODE);
+  }
+  inode_count = (inode_count + 63) / 64 * 64;
+  if (inode_count < 64) {
+    inode_count = 64;
+  }
+
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->block_count = block_count;
+  sb->inode_count = inode_count;
+  sb->block_bitmap_start = 1;
+  sb->inode_bitmap_start =
+      sb->block_bitmap_start + bytes_to_blocks(bitmap_bytes(block_count));
+  sb->inode_table_start =
+      sb->inode_bitmap_start + bytes_to_blocks(bitmap_bytes(inode_count));
+  sb->data_start = sb->inode_table_start +
+                   bytes_to_blocks(inode_count * sizeof(inode_t));
+  sb->csum_start = 0;
+  sb->changes_start = 0;
+  sb->epoch = 0;
+  sb->orphan_head = 0;
+  sb->fast_blocks = 0;
+  sb->stripes = 1;
+  sb->stripe_unit = 0;
+  sb->member = 0;
+  if (!blocks_options.scratch && blocks_options.stripe_images) {
+    for (const char *c = blocks_options.stripe_images; *c; ++c) {
+      sb->stripes += *c == ':';
+    }
+    sb->stripes++;
+  }
+  if (sb->stripes > 1) {
+    sb->stripe_unit =
+        blocks_options.stripe_unit > 0 ? blocks_options.stripe_unit : 16;
+  }
+  if (getrandom(&sb->volume_id, sizeof(sb->volume_id), 0) < 0) {
+    sb->volume_id = (int)time(0) ^ getpid();
+  }
+  if (blocks_options.checksums && !blocks_options.scratch) {
+    sb->csum_start = sb->data_start;
+    sb->data_start += bytes_to_blocks(block_count * 4);
+  }
+  if (blocks_options.track_changes && !blocks_options.scratch) {
+    sb->changes_start = sb->data_start;
+    sb->epoch = 1;
+    sb->data_start += bytes_to_blocks(block_count * 4);
+  }
+}
+
+// Same as blocks_layout, for a volume with a slow tier after the fast
+// blocks; the metadata has to fit on the fast tier.
+static void blocks_layout_tiers(superblock_t *sb, int fast, int slow) {
+  blocks_layout(sb, fast + slow);
+  sb->fast_blocks = fast;
+  if (sb->data_start >= fast) {
+    fprintf(stderr, "the fast tier needs more than %d blocks\n",
+            sb->data_start);
+    exit(1);
+  }
+}
+
+// Copy the geometry of the superblock into the globals.
+static void blocks_load_geometry(superblock_t *sb) {
+  BLOCK_COUNT = sb->block_count;
+  NUFS_SIZE = (long)BLOCK_SIZE * BLOCK_COUNT;
+  INODE_COUNT = sb->inode_count;
+  BLOCK_BITMAP_SIZE = bitmap_bytes(BLOCK_COUNT);
+  INODE_BITMAP_SIZE = bitmap_bytes(INODE_COUNT);
+  BLOCK_BITMAP_START = sb->block_bitmap_start;
+  INODE_BITMAP_START = sb->inode_bitmap_start;
+  INODE_TABLE_START = sb->inode_table_start;
+  CSUM_START = sb->csum_start;
+  CHANGES_START = sb->changes_start;
+  DATA_START = sb->data_start;
+  FAST_BLOCKS = sb->fast_blocks ? sb->fast_blocks : BLOCK_COUNT;
+  stripes = sb->stripes > 1 ? sb->stripes : 1;
+  stripe_unit = sb->stripe_unit > 0 ? sb->stripe_unit : 1;
+}
+
+// Open the other images of a striped volume, checking (unless they're
+// about to be formatted) that their labels match the superblock.
+static void blocks_open_stripes(const superblock_t *sb, int fresh) {
+  char *list = strdup(blocks_options.stripe_images && !blocks_options.scratch
+                          ? blocks_options.stripe_images
+                          : "");
+  free(stripe_fds);
+  stripe_fds = calloc(stripes, sizeof(int));
+  stripe_fds[0] = blocks_fd;
+  int given = 1;
+  char *save;
+  for (char *path = strtok_r(list, ":", &save); path;
+       path = strtok_r(0, ":", &save)) {
+    int i = given++;
+    if (i >= stripes) {
+      continue; // one too many; only counted
+    }
+    stripe_fds[i] = blocks_options.read_only
+                        ? open(path, O_RDONLY)
+                        : open(path, O_CREAT | O_RDWR, 0644);
+    if (stripe_fds[i] < 0) {
+      perror(path);
+      exit(1);
+    }
+    superblock_t label;
+    if (!fresh &&
+        (pread(stripe_fds[i], &label, sizeof(label), 0) != sizeof(label) ||
+         label.magic != NUFS_MAGIC || label.volume_id != sb->volume_id ||
+         label.member != i)) {
+      fprintf(stderr, "%s: not image %d of this volume\n", path, i + 1);
+      exit(1);
+    }
+  }
+  free(list);
+  if (given != stripes) {
+    fprintf(stderr, "this volume is striped over %d images, but %d were "
+                    "given\n", stripes, given);
+    exit(1);
+  }
+}
+
+// Bytes image m of the stripe set needs: up to its last block, after its
+// label.
+static off_t stripe_image_size(int m) {
+  if (stripes == 1) {
+    return (off_t)BLOCK_SIZE * FAST_BLOCKS;
+  }
+  int last = (FAST_BLOCKS - 1) / stripe_unit; // the last stripe unit
+  if (last < m) {
+    return BLOCK_SIZE; // none of the units, just the label
+  }
+  int unit = last - (last - m) % stripes;
+  int end = (unit + 1) * stripe_unit;
+  if (end > FAST_BLOCKS) {
+    end = FAST_BLOCKS;
+  }
+  off_t pos;
+  blocks_locate(end - 1, &pos);
+  return pos + BLOCK_SIZE;
+}
+
+// Open the slow tier of a two-tier volume, checking (unless it's about to
+// be formatted) that its label matches the superblock.
+static void blocks_open_slow(const superblock_t *sb, int fresh) {
+  const char *path = blocks_options.slow_image;
+  if (!path) {
+    fprintf(stderr, "this volume has a slow tier, but no image for it was "
+                    "given\n");
+    exit(1);
+  }
+  slow_fd = blocks_options.read_only ? open(path, O_RDONLY)
+                                     : open(path, O_CREAT | O_RDWR, 0644);
+  if (slow_fd < 0) {
+    perror(path);
+    exit(1);
+  }
+
+  superblock_t label;
+  if (!fresh && (pread(slow_fd, &label, sizeof(label), 0) != sizeof(label) ||
+                 label.magic != NUFS_MAGIC ||
+                 label.volume_id != sb->volume_id)) {
+    fprintf(stderr, "%s: not the slow tier of this volume\n", path);
+    exit(1);
+  }
+}
+
+// Pick the backend named in blocks_options.
+static const blocks_backend_t *blocks_find_backend(const char *name) {
+  for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    if (strcmp(backends[i]->name, name) == 0) {
+      return backends[i];
+    }
+  }
+  fprintf(stderr, "unknown backend '%s', using mmap\n", name);
+  return &mmap_backend;
+}
+
+// Whether a block has a checksum: everything but the table itself.
+static int csum_covers(int bnum) {
+  return CSUM_START && (bnum < CSUM_START || bnum >= DATA_START);
+}
+
+// The checksum as stored: 0 is kept for "unknown".
+static uint32_t csum_block(const void *data) {
+  uint32_t crc = crc32c(0, data, BLOCK_SIZE);
+  return crc ? crc : 0xffffffff;
+}
+
+// The same, computed while the block is copied to dst.
+static uint32_t csum_block_copy(void *dst, const void *data) {
+  uint32_t crc = crc32c_copy(0, dst, data, BLOCK_SIZE);
+  return crc ? crc : 0xffffffff;
+}
+
+// Reads the table through the block looked at last, since a run of
+// blocks keeps asking the same one.
+static uint32_t csum_get(int bnum) {
+  int table = CSUM_START + bnum / CSUMS_PER_BLOCK;
+  if (table != csum_table_bnum) {
+    csum_table = backend->peek_block(table);
+    csum_table_bnum = table;
+  }
+  return csum_table[bnum % CSUMS_PER_BLOCK];
+}
+
+static void epoch_tag(int bnum);
+
+static void csum_put(int bnum, uint32_t crc) {
+  epoch_tag(CSUM_START + bnum / CSUMS_PER_BLOCK);
+  uint32_t *table = backend->get_block(CSUM_START + bnum / CSUMS_PER_BLOCK);
+  table[bnum % CSUMS_PER_BLOCK] = crc;
+}
+
+// Record that a block is changing in the current epoch, and so is the
+// block of the epoch table that says so.
+static void epoch_tag(int bnum) {
+  if (!CHANGES_START || blocks_options.read_only ||
+      bitmap_get(epoch_tagged, bnum)) {
+    return;
+  }
+  bitmap_put(epoch_tagged, bnum, 1);
+  int table = CHANGES_START + bnum / EPOCHS_PER_BLOCK;
+  ((uint32_t *)backend->get_block(table))[bnum % EPOCHS_PER_BLOCK] = epoch;
+  epoch_tag(table);
+}
+
+// Compare a block's checksum with the one it should have; a mismatch is
+// reported the first time it's seen.
+static int csum_match(int bnum, uint32_t crc, uint32_t want, long *checked,
+                      long *errors) {
+  (*checked)++;
+  if (crc == want) {
+    bitmap_put(csum_verified, bnum, 1);
+    bitmap_put(csum_bad, bnum, 0);
+    return 0;
+  }
+  if (!bitmap_get(csum_bad, bnum)) {
+    (*errors)++;
+    bitmap_put(csum_bad, bnum, 1);
+    fprintf(stderr, "nufs: block %d doesn't match its checksum\n", bnum);
+  }
+  return -EIO;
+}
+
+// Check a block against its checksum, if it has one.
+static int csum_check(int bnum, long *checked, long *errors) {
+  uint32_t want = csum_get(bnum);
+  if (want == 0) {
+    return 0;
+  }
+  return csum_match(bnum, csum_block(backend->peek_block(bnum)), want,
+                    checked, errors);
+}
+
+// Whether a block is in use, without checking the bitmap block (whose
+// checksum may be out of date while the operation runs).
+static int csum_in_use(int bnum) {
+  return bitmap_get(
+      (void *)backend->peek_block(BLOCK_BITMAP_START + bnum / BITS_PER_BLOCK),
+      bnum % BITS_PER_BLOCK);
+}
+
+// Check a block the first time it is used; blocks changed during this
+// operation have nothing to be checked against yet.
+static int csum_verify(int bnum) {
+  if (!csum_covers(bnum) || bitmap_get(csum_verified, bnum) ||
+      bitmap_get(csum_touched, bnum)) {
+    return 0;
+  }
+  return csum_check(bnum, &blocks_csum_stats.verified,
+                    &blocks_csum_stats.errors);
+}
+
+// Remember a block that may be changed, to checksum it when the operation
+// ends. A read-only image never gets new checksums.
+static void csum_touch(int bnum) {
+  if (!csum_covers(bnum) || blocks_options.read_only ||
+      bitmap_get(csum_touched, bnum)) {
+    return;
+  }
+  bitmap_put(csum_touched, bnum, 1);
+  if (touched_count == touched_size) {
+    touched_size = touched_size ? 2 * touched_size : 64;
+    touched = realloc(touched, touched_size * sizeof(int));
+  }
+  touched[touched_count++] = bnum;
+}
+
+// Checksum the blocks changed since the last time; free blocks don't
+// keep one.
+static void csum_flush() {
+  for (int i = 0; i < touched_count; ++i) {
+    int bnum = touched[i];
+    if (!bitmap_get(csum_touched, bnum)) {
+      continue; // handed out for writing through the file since
+    }
+    bitmap_put(csum_touched, bnum, 0);
+    if (!csum_in_use(bnum)) {
+      csum_put(bnum, 0);
+      bitmap_put(csum_verified, bnum, 0);
+      continue;
+    }
+    csum_put(bnum, csum_block(backend->peek_block(bnum)));
+    bitmap_put(csum_verified, bnum, 1);
+    bitmap_put(csum_bad, bnum, 0);
+  }
+  touched_count = 0;
+}
+
+// Forget the checksums of blocks that are now free.
+static void csum_clear(int bnum, int count) {
+  for (int i = bnum; i < bnum + count; ++i) {
+    if (csum_covers(i)) {
+      csum_put(i, 0);
+      bitmap_put(csum_verified, i, 0);
+    }
+  }
+}
+
+// Build the free extent index from the block bitmap, a 64-bit word at a
+// time where the word is all free or all used.
+static void blocks_index_free_space() {
+  freespace_reset();
+  freespace_set_boundary(FAST_BLOCKS < BLOCK_COUNT ? FAST_BLOCKS : 0);
+  int run = -1; // start of the free run we're in
+  for (int i = DATA_START; i < BLOCK_COUNT;) {
+    const uint64_t *words =
+        blocks_peek_block(BLOCK_BITMAP_START + i / BITS_PER_BLOCK);
+    uint64_t word = words[i % BITS_PER_BLOCK / 64];
+
+    int step = 1;
+    int used;
+    if (i % 64 == 0 && i + 64 <= BLOCK_COUNT && (word == 0 || word == ~0ull)) {
+      step = 64;
+      used = word != 0;
+    } else {
+      used = (word >> (i % 64)) & 1;
+    }
+
+    if (!used && run < 0) {
+      run = i;
+    } else if (used && run >= 0) {
+      freespace_add(run, i - run);
+      run = -1;
+    }
+    i += step;
+  }
+  if (run >= 0) {
+    freespace_add(run, BLOCK_COUNT - run);
+  }
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  if (blocks_options.scratch) {
+    // shared memory no file system sees; its pages are allocated as they
+    // are first written and freed again by discard. Unlike a private
+    // anonymous mapping it has an fd, so blocks_file_io() still works.
+    blocks_fd = memfd_create("nufs-scratch", MFD_CLOEXEC);
+    if (blocks_fd < 0) {
+      perror("memfd_create");
+      exit(1);
+    }
+  } else if (blocks_options.read_only) {
+    blocks_fd = open(image_path, O_RDONLY);
+    if (blocks_fd < 0) {
+      perror(image_path);
+      exit(1);
+    }
+  } else {
+    blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
+    if (blocks_fd < 0) {
+      perror(image_path);
+      exit(1);
+    }
+  }
+
+  // only an empty (just created) file is formatted; anything else that
+  // isn't a volume of this version is left alone
+  superblock_t sb;
+  struct stat image_st;
+  int fresh = fstat(blocks_fd, &image_st) == 0 && image_st.st_size == 0 &&
+              !blocks_options.read_only;
+  if (!fresh && (pread(blocks_fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+                 sb.magic != NUFS_MAGIC)) {
+    fprintf(stderr, "%s: not a nufs image\n", image_path);
+    exit(1);
+  }
+  if (!fresh && sb.version != NUFS_VERSION) {
+    fprintf(stderr, "%s: unsupported version %d (this is version %d)\n",
+            image_path, sb.version, NUFS_VERSION);
+    exit(1);
+  }
+  if (fresh && blocks_options.slow_image && blocks_options.slow_blocks > 0 &&
+      !blocks_options.scratch) {
+    blocks_layout_tiers(&sb, blocks_options.format_blocks,
+                        blocks_options.slow_blocks);
+  } else if (fresh) {
+    blocks_layout(&sb, blocks_options.format_blocks);
+  }
+  blocks_load_geometry(&sb);
+  blocks_open_stripes(&sb, fresh);
+  if (FAST_BLOCKS < BLOCK_COUNT) {
+    blocks_open_slow(&sb, fresh);
+  }
+
+  // make sure the disk images have the size the superblock promises
+  if (!blocks_options.read_only) {
+    for (int i = 0; i < stripes; ++i) {
+      if (ftruncate(stripe_fds[i], stripe_image_size(i)) < 0) {
+        fprintf(stderr, "%s: can't size image %d of the volume: %s\n",
+                blocks_options.scratch ? "scratch" : image_path, i + 1,
+                strerror(errno));
+        exit(1);
+      }
+    }
+    if (slow_fd >= 0 &&
+        ftruncate(slow_fd, (off_t)BLOCK_SIZE * (BLOCK_COUNT - FAST_BLOCKS)) <
+            0) {
+      perror(blocks_options.slow_image);
+      exit(1);
+    }
+  }
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  cache_capacity = blocks_options.cache_blocks;
+  cache_readahead = blocks_options.readahead;
+  map_window = blocks_options.map_window > 0 ? blocks_options.map_window : 1;
+  map_budget = (long)blocks_options.map_budget * 1024 * 1024 /
+               ((long)BLOCK_SIZE * map_window);
+  if (blocks_options.scratch) {
+    // a cache would only copy memory to memory; map it all in one piece
+    backend = &mmap_backend;
+    map_window = BLOCK_COUNT;
+    map_budget = 1;
+  } else {
+    backend = blocks_find_backend(blocks_options.backend);
+  }
+  int rv = backend->open(BLOCK_COUNT);
+  if (rv < 0) {
+    fprintf(stderr, "backend %s: %s, using mmap\n", backend->name,
+            strerror(-rv));
+    backend = &mmap_backend;
+    backend->open(BLOCK_COUNT);
+  }
+
+  crc32c_init();
+  void *zeros = calloc(1, BLOCK_SIZE);
+  csum_zero = csum_block(zeros);
+  free(zeros);
+  free(csum_verified);
+  free(csum_bad);
+  free(csum_touched);
+  csum_verified = calloc(1, bitmap_bytes(BLOCK_COUNT));
+  csum_bad = calloc(1, bitmap_bytes(BLOCK_COUNT));
+  csum_touched = calloc(1, bitmap_bytes(BLOCK_COUNT));
+  touched_count = 0;
+  memset(&blocks_csum_stats, 0, sizeof(blocks_csum_stats));
+  free(heat);
+  heat = calloc(BLOCK_COUNT, 1);
+  memset(&blocks_tier_stats, 0, sizeof(blocks_tier_stats));
+  free(epoch_tagged);
+  epoch_tagged = calloc(1, bitmap_bytes(BLOCK_COUNT));
+  epoch = sb.epoch;
+
+  if (fresh) {
+    // clear the metadata regions and reserve them in the block bitmap; the
+    // checksum and epoch tables hold leftovers until they are cleared too
+    CSUM_START = 0;
+    CHANGES_START = 0;
+    for (int i = 0; i < DATA_START; ++i) {
+      memset(blocks_get_block(i), 0, BLOCK_SIZE);
+    }
+    memcpy(get_superblock(), &sb, sizeof(sb));
+    for (int i = 0; i < DATA_START; ++i) {
+      blocks_bitmap_put(BLOCK_BITMAP_START, i, 1);
+    }
+    for (int i = 1; i < stripes; ++i) {
+      // the other stripe images get a label before their first unit
+      void *label = calloc(1, BLOCK_SIZE);
+      memcpy(label, &sb, sizeof(sb));
+      ((superblock_t *)label)->member = i;
+      if (pwrite(stripe_fds[i], label, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+        perror("stripe image label");
+        exit(1);
+      }
+      free(label);
+    }
+    if (FAST_BLOCKS < BLOCK_COUNT) {
+      // label the slow image as belonging to this volume
+      memset(blocks_get_block(FAST_BLOCKS), 0, BLOCK_SIZE);
+      memcpy(blocks_get_block(FAST_BLOCKS), &sb, sizeof(sb));
+      blocks_bitmap_put(BLOCK_BITMAP_START, FAST_BLOCKS, 1);
+    }
+    CSUM_START = sb.csum_start;
+    CHANGES_START = sb.changes_start;
+    for (int i = 0; i < DATA_START; ++i) {
+      csum_touch(i);
+    }
+    if (FAST_BLOCKS < BLOCK_COUNT) {
+      csum_touch(FAST_BLOCKS);
+    }
+    csum_flush();
+  }
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  blocks_index_free_space();
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  blocks_sync();
+  csum_table_bnum = -1;
+  backend->close();
+  for (int i = 1; i < stripes; ++i) {
+    close(stripe_fds[i]);
+  }
+  close(blocks_fd);
+  blocks_fd = -1;
+  if (slow_fd >= 0) {
+    close(slow_fd);
+    slow_fd = -1;
+  }
+}
+
+// Write every modified block back to the image file. Syncing is the last
+// thing an operation does, so what it changed can be checksummed now.
+void blocks_sync() {
+  csum_flush();
+  if (blocks_options.scratch) {
+    return; // nothing to make durable
+  }
+  backend->sync();
+  for (int i = 0; i < stripes; ++i) {
+    fdatasync(stripe_fds[i]);
+  }
+  if (slow_fd >= 0) {
+    fdatasync(slow_fd);
+  }
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  if (CSUM_START) {
+    csum_verify(bnum);
+    csum_touch(bnum);
+  }
+  epoch_tag(bnum);
+  return backend->get_block(bnum);
+}
+
+// Get a run of blocks that are contiguous in memory, for writing.
+void *blocks_get_run(int bnum, int count) {
+  for (int i = bnum + 1; i < bnum + count; ++i) {
+    blocks_get_block(i);
+  }
+  return blocks_get_block(bnum);
+}
+
+// Get the given block for reading only.
+const void *blocks_peek_block(int bnum) {
+  if (CSUM_START) {
+    csum_verify(bnum);
+  }
+  return backend->peek_block(bnum);
+}
+
+// How many blocks from bnum on are contiguous in memory.
+int blocks_contiguous(int bnum, int count) {
+  if (count <= 1 || !backend->contiguous) {
+    return 1;
+  }
+  return backend->contiguous(bnum, count);
+}
+
+// Prepare blocks for direct I/O on the image file.
+int blocks_file_io(int bnum, int count, int writing, off_t *pos) {
+  if (backend->file_io) {
+    backend->file_io(bnum, count, writing);
+  }
+  for (int i = bnum; writing && i < bnum + count; ++i) {
+    epoch_tag(i);
+  }
+  if (writing && CSUM_START) {
+    // unknown until blocks_file_io_done() has seen the new contents
+    for (int i = bnum; i < bnum + count; ++i) {
+      if (csum_covers(i)) {
+        csum_put(i, 0);
+        bitmap_put(csum_verified, i, 0);
+        bitmap_put(csum_touched, i, 0);
+      }
+    }
+  }
+  return blocks_locate(bnum, pos);
+}
+
+// Find the image file and offset of a block.
+int blocks_locate(int bnum, off_t *pos) {
+  if (bnum >= FAST_BLOCKS) {
+    *pos = (off_t)BLOCK_SIZE * (bnum - FAST_BLOCKS);
+    return slow_fd;
+  }
+  if (stripes == 1) {
+    *pos = (off_t)BLOCK_SIZE * bnum;
+    return blocks_fd;
+  }
+  int unit = bnum / stripe_unit;
+  int member = unit % stripes;
+  long at = (long)(unit / stripes) * stripe_unit + bnum % stripe_unit;
+  *pos = (off_t)BLOCK_SIZE * (at + (member > 0)); // after the label
+  return stripe_fds[member];
+}
+
+// How many blocks from bnum on are consecutive in one image file.
+int blocks_file_run(int bnum, int count) {
+  int end = bnum < FAST_BLOCKS ? FAST_BLOCKS : BLOCK_COUNT;
+  if (bnum < FAST_BLOCKS && stripes > 1 &&
+      (bnum / stripe_unit + 1) * stripe_unit < end) {
+    end = (bnum / stripe_unit + 1) * stripe_unit;
+  }
+  return bnum + count > end ? end - bnum : count;
+}
+
+int blocks_epoch() { return epoch; }
+
+// The epoch a block last changed in.
+int blocks_changed_in(int bnum) {
+  if (!CHANGES_START) {
+    return 0;
+  }
+  const uint32_t *table =
+      backend->peek_block(CHANGES_START + bnum / EPOCHS_PER_BLOCK);
+  return table[bnum % EPOCHS_PER_BLOCK];
+}
+
+// Tag blocks changed from now on with a new epoch.
+int blocks_new_epoch() {
+  if (!CHANGES_START) {
+    return 0;
+  }
+  blocks_op_begin();
+  epoch++;
+  memset(epoch_tagged, 0, bitmap_bytes(BLOCK_COUNT));
+  get_superblock()->epoch = epoch;
+  blocks_op_end();
+  printf("+ blocks_new_epoch() -> %d\n", epoch);
+  return epoch;
+}
+
+// Whether a file holds a nufs volume, without formatting it if it doesn't.
+int blocks_probe(const char *image_path) {
+  superblock_t sb;
+  int fd = open(image_path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  int ok = pread(fd, &sb, sizeof(sb), 0) == sizeof(sb) &&
+           sb.magic == NUFS_MAGIC && sb.version == NUFS_VERSION;
+  close(fd);
+  return ok;
+}
+
+// Let the backend start reading blocks that are about to be used.
+void blocks_prefetch(int bnum, int count) {
+  if (backend->prefetch) {
+    backend->prefetch(bnum, count);
+  }
+}
+
+int blocks_tier(int bnum) { return bnum < FAST_BLOCKS ? TIER_FAST : TIER_SLOW; }
+
+// Count accesses to file data.
+void blocks_tier_access(int bnum, int count) {
+  for (int i = bnum; i < bnum + count; ++i) {
+    if (heat[i] < 255) {
+      heat[i]++;
+    }
+  }
+  if (bnum < FAST_BLOCKS) {
+    blocks_tier_stats.fast_hits += count;
+  } else {
+    blocks_tier_stats.slow_hits += count;
+  }
+}
+
+int blocks_tier_heat(int bnum) { return heat[bnum]; }
+
+void blocks_tier_set_heat(int bnum, int value) { heat[bnum] = value; }
+
+void blocks_tier_age() {
+  for (int i = 0; i < BLOCK_COUNT; ++i) {
+    heat[i] >>= 1;
+  }
+}
+
+// Checksum blocks written through the image file.
+void blocks_file_io_done(int bnum, int count) {
+  // a copy read in while the file was being written (read-ahead of a
+  // neighbour, say) may predate the new contents
+  if (backend->file_io) {
+    backend->file_io(bnum, count, 1);
+  }
+  if (!CSUM_START || blocks_options.read_only) {
+    return;
+  }
+  for (int i = bnum; i < bnum + count; ++i) {
+    if (csum_covers(i)) {
+      csum_put(i, csum_block(backend->peek_block(i)));
+      bitmap_put(csum_verified, i, 1);
+      bitmap_put(csum_bad, i, 0);
+    }
+  }
+}
+
+// Check blocks before their contents are used.
+int blocks_verify(int bnum, int count) {
+  if (!CSUM_START) {
+    return 0;
+  }
+  int rv = 0;
+  for (int i = bnum; i < bnum + count; ++i) {
+    if (csum_verify(i) < 0) {
+      rv = -EIO;
+    }
+  }
+  return rv;
+}
+
+// Copy out of a run of blocks, checking each whole block that needs it
+// in the same pass as the copy.
+int blocks_read(int bnum, int skip, void *buf, size_t size) {
+  const char *src = (const char *)backend->peek_block(bnum) + skip;
+  if (!CSUM_START) {
+    memcpy(buf, src, size);
+    return 0;
+  }
+  int rv = 0;
+  size_t done = 0;
+  size_t copied = 0; // blocks already verified are copied in one go
+  for (int i = bnum; done < size; ++i) {
+    size_t span = BLOCK_SIZE - (done ? 0 : skip);
+    span = span < size - done ? span : size - done;
+    uint32_t want;
+    if (span == BLOCK_SIZE && csum_covers(i) &&
+        !bitmap_get(csum_verified, i) && !bitmap_get(csum_touched, i) &&
+        (want = csum_get(i)) != 0) {
+      memcpy((char *)buf + copied, src + copied, done - copied);
+      if (csum_match(i, csum_block_copy((char *)buf + done, src + done),
+                     want, &blocks_csum_stats.verified,
+                     &blocks_csum_stats.errors) < 0) {
+        rv = -EIO;
+      }
+      copied = done + span;
+    } else if (csum_verify(i) < 0) {
+      rv = -EIO;
+    }
+    done += span;
+  }
+  memcpy((char *)buf + copied, src + copied, size - copied);
+  return rv;
+}
+
+// Check a stretch of used blocks again, whether or not they were checked.
+int blocks_scrub(int from, int count) {
+  if (!CSUM_START) {
+    return 0;
+  }
+  blocks_op_begin();
+  int end = from + count < BLOCK_COUNT ? from + count : BLOCK_COUNT;
+  for (int i = from; i < end; ++i) {
+    if (csum_covers(i) && csum_in_use(i) && !bitmap_get(csum_touched, i)) {
+      csum_check(i, &blocks_csum_stats.scrubbed,
+                 &blocks_csum_stats.scrub_errors);
+    }
+  }
+  if (end == BLOCK_COUNT) {
+    blocks_csum_stats.scrub_passes++;
+    end = 0;
+  }
+  blocks_op_end();
+  return end;
+}
+
+// Zero blocks by punching them out of the image file.
+int blocks_punch(int bnum, int count) {
+  for (int done = 0; done < count;) {
+    int run = blocks_file_run(bnum + done, count - done);
+    off_t pos;
+    // cached copies would be written back over the hole later
+    int fd = blocks_file_io(bnum + done, run, 1, &pos);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos,
+                  (off_t)run * BLOCK_SIZE) != 0) {
+      return -errno;
+    }
+    done += run;
+  }
+  for (int i = bnum; i < bnum + count; ++i) {
+    if (csum_covers(i)) {
+      csum_put(i, csum_zero);
+      bitmap_put(csum_verified, i, 1);
+      bitmap_put(csum_bad, i, 0);
+    }
+  }
+  return 0;
+}
+
+// Hand freed blocks back to the host; a host that can't do it is only
+// asked once.
+static void blocks_discard(int bnum, int count) {
+  if (blocks_options.discard && blocks_punch(bnum, count) == -EOPNOTSUPP) {
+    blocks_options.discard = 0;
+  }
+}
+
+// Operations nest; only the end of the outermost one checksums what was
+// changed and lets the backend recycle the blocks it handed out.
+void blocks_op_begin() {
+  pthread_mutex_lock(&op_lock);
+  op_depth++;
+}
+
+void blocks_op_end() {
+  if (--op_depth == 0) {
+    csum_flush();
+    csum_table_bnum = -1;
+    backend->op_end();
+  }
+  pthread_mutex_unlock(&op_lock);
+}
+
+// Print backend and checksum statistics.
+void blocks_print_stats(FILE *out) {
+  backend->print_stats(out);
+  struct stat st;
+  if (blocks_options.scratch && fstat(blocks_fd, &st) == 0) {
+    fprintf(out, "scratch: %ld of %ld KB in memory\n",
+            (long)st.st_blocks / 2, NUFS_SIZE / 1024);
+  }
+  if (stripes > 1) {
+    fprintf(out, "stripes: %d images, units of %d blocks\n", stripes,
+            stripe_unit);
+  }
+  if (CHANGES_START) {
+    long tagged = 0;
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+      tagged += bitmap_get(epoch_tagged, i);
+    }
+    fprintf(out, "changes: epoch %d, %ld blocks changed in it so far\n",
+            epoch, tagged);
+  }
+  if (FAST_BLOCKS < BLOCK_COUNT) {
+    const blocks_tier_stats_t *ts = &blocks_tier_stats;
+    long hits = ts->fast_hits + ts->slow_hits;
+    fprintf(out,
+            "tiers: %d fast blocks (%ld free), %d slow (%ld free); %.1f%% of "
+            "%ld accesses on the fast tier; %ld demoted, %ld promoted in "
+            "%ld passes\n",
+            FAST_BLOCKS, blocks_tier_free(TIER_FAST), BLOCK_COUNT - FAST_BLOCKS,
+            blocks_tier_free(TIER_SLOW),
+            hits ? 100.0 * ts->fast_hits / hits : 0.0, hits, ts->demoted,
+            ts->promoted, ts->passes);
+  }
+  if (CSUM_START) {
+    const blocks_csum_stats_t *st = &blocks_csum_stats;
+    fprintf(out,
+            "checksums (crc32c, %s): %ld verified, %ld bad; scrub: %ld "
+            "checked, %ld bad, %ld passes\n",
+            crc32c_impl(), st->verified, st->errors, st->scrubbed,
+            st->scrub_errors, st->scrub_passes);
+  }
+}
+
+// Return a pointer to the superblock.
+superblock_t *get_superblock() { return blocks_get_block(0); }
+
+// Return a pointer to the superblock, for reading only.
+const superblock_t *peek_superblock() { return blocks_peek_block(0); }
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() { return blocks_get_block(BLOCK_BITMAP_START); }
 
 // Return a pointer to the beginning of the inode table bitmap.
-void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+// The size is INODE_BITMAP_SIZE bytes.
+void *get_inode_bitmap() { return blocks_get_block(INODE_BITMAP_START); }
+
+// Get a bit from a bitmap spanning several blocks.
+int blocks_bitmap_get(int start, int i) {
+  return bitmap_get((void *)blocks_peek_block(start + i / BITS_PER_BLOCK),
+                    i % BITS_PER_BLOCK);
+}
+
+// Set a bit in a bitmap spanning several blocks.
+void blocks_bitmap_put(int start, int i, int v) {
+  bitmap_put(blocks_get_block(start + i / BITS_PER_BLOCK), i % BITS_PER_BLOCK,
+             v);
+}
+
+// Find a clear bit in a bitmap spanning several blocks.
+int blocks_bitmap_find(int start, int size, int from) {
+  int nblocks = (size + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  if (from >= size || from < 0) {
+    from = 0;
+  }
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *)(block + BLOCK_BITMAP_SIZE);
+  int first = from / BITS_PER_BLOCK;
+  for (int k = 0; k < nblocks; ++k) {
+    int b = (first + k) % nblocks;
+    int bits = size - b * BITS_PER_BLOCK;
+    if (bits > BITS_PER_BLOCK) {
+      bits = BITS_PER_BLOCK;
+    }
+    int off = (k == 0) ? from % BITS_PER_BLOCK : 0;
+    int bit = bitmap_find_free((void *)blocks_peek_block(start + b), bits, off);
+    if (bit >= 0) {
+      return b * BITS_PER_BLOCK + bit;
+    }
+  }
+  return -1;
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+  int got;
+  return alloc_blocks(DATA_START, 1, 1, &got);
+}
 
-  for (int i = 1; i < BLOCK_COUNT; ++i) {
-    if (!bitmap_get(bbm, i)) {
-      bitmap_put(bbm, i, 1);
-      printf("+ alloc_block() -> %d\n", i);
-      return i;
-    }
+// Mark a run found in the free extent index as allocated.
+static void alloc_take(int start, int got) {
+  freespace_take(start, got);
+  for (int i = start; i < start + got; ++i) {
+    blocks_bitmap_put(BLOCK_BITMAP_START, i, 1);
+    heat[i] = 0;
   }
+}
 
-  return -1;
+// Allocate a run of contiguous blocks, preferably starting at goal; on a
+// two-tier volume, preferably on the fast tier.
+int alloc_blocks(int goal, int min, int max, int *got) {
+  if (goal < DATA_START || goal >= BLOCK_COUNT) {
+    goal = DATA_START;
+  }
+  int start = -1;
+  if (FAST_BLOCKS < BLOCK_COUNT) {
+    start = freespace_find_in(DATA_START, FAST_BLOCKS, goal, min, max, got);
+  }
+  if (start < 0) {
+    start = freespace_find(goal, min, max, got);
+  }
+  if (start < 0) {
+    return -1;
+  }
+  alloc_take(start, *got);
+  printf("+ alloc_blocks(%d, %d, %d) -> %d+%d\n", goal, min, max, start, *got);
+  return start;
+}
+
+// Allocate a run of contiguous blocks on one tier.
+int alloc_blocks_in(int tier, int goal, int min, int max, int *got) {
+  int lo = tier == TIER_FAST ? DATA_START : FAST_BLOCKS;
+  int hi = tier == TIER_FAST ? FAST_BLOCKS : BLOCK_COUNT;
+  int start = freespace_find_in(lo, hi, goal, min, max, got);
+  if (start < 0) {
+    return -1;
+  }
+  alloc_take(start, *got);
+  printf("+ alloc_blocks_in(%d, %d, %d, %d) -> %d+%d\n", tier, goal, min, max,
+         start, *got);
+  return start;
+}
+
+// Count the free blocks on a tier.
+long blocks_tier_free(int tier) {
+  return tier == TIER_FAST ? freespace_total_in(DATA_START, FAST_BLOCKS)
+                           : freespace_total_in(FAST_BLOCKS, BLOCK_COUNT);
+}
+
+// Count the free extents by length.
+long blocks_free_histogram(long *counts, int buckets) {
+  freespace_histogram(counts, buckets);
+  return freespace_total();
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
   printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  blocks_bitmap_put(BLOCK_BITMAP_START, bnum, 0);
+  freespace_add(bnum, 1);
+  blocks_discard(bnum, 1);
+  csum_clear(bnum, 1);
+}
+
+// Deallocate a batch of blocks, handing consecutive ones to the free
+// extent index as one range.
+void free_blocks(const int *bnums, int count) {
+  printf("+ free_blocks(%d blocks)\n", count);
+  for (int i = 0; i < count;) {
+    if (bnums[i] == 0) {
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (i + run < count && bnums[i + run] == bnums[i] + run) {
+      run++;
+    }
+    for (int k = 0; k < run; ++k) {
+      blocks_bitmap_put(BLOCK_BITMAP_START, bnums[i] + k, 0);
+    }
+    freespace_add(bnums[i], run);
+    blocks_discard(bnums[i], run);
+    csum_clear(bnums[i], run);
+    i += run;
+  }
 }
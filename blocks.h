@@ -4,18 +4,144 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * Block data is accessed using pointers. How the image gets into memory is
+ * up to the backend chosen in blocks_options (see backend.h): mapped
+ * directly, or through a block cache fed by pread() or io_uring.
+ *
+ * A volume may also span two images (blocks_options.slow_image): blocks
+ * 0 ... FAST_BLOCKS - 1 are in the first, fast one, which holds all the
+ * metadata, and the rest in the second, slow one. New blocks come from
+ * the fast tier while it has room; tier.h moves file blocks between the
+ * tiers by how often they are used.
+ *
+ * The fast blocks can be striped over several images of their own
+ * (blocks_options.stripe_images): stripe unit u of stripe_unit blocks is
+ * stored in image u % stripes, after the units that image already holds,
+ * so sequential I/O and the uring backend's batches reach every image at
+ * once. The first image starts with block 0; every other one starts with
+ * a label block outside the block numbers, holding a copy of the
+ * superblock.
+ *
+ * A scratch volume (blocks_options.scratch) has no image file: it lives in
+ * anonymous memory that is only allocated as blocks are first written,
+ * and is gone when it is closed. Syncing it does nothing.
+ *
+ * On-disk layout:
+ *
+ *   block 0                      superblock (geometry of the image)
+ *   BLOCK_BITMAP_START ...       free block bitmap
+ *   INODE_BITMAP_START ...       free inode bitmap
+ *   INODE_TABLE_START ...        inode table
+ *   CSUM_START ...               CRC-32C of every other block (optional)
+ *   CHANGES_START ...            epoch each block last changed in (optional)
+ *   DATA_START ...               file and directory data
+ *   FAST_BLOCKS                  copy of the superblock, first in the slow
+ *                                image (with a slow tier only)
+ *   FAST_BLOCKS + 1 ...          more data
+ *
+ * With a checksum table, every block except the table itself is checked
+ * against its checksum the first time it is used after the image is
+ * opened, and blocks written during an operation get new checksums when
+ * it ends. A checksum of 0 means "unknown" (free blocks, blocks being
+ * written through the image file) and is never checked.
+ *
+ * With an epoch table, every block that is changed (through a pointer
+ * from blocks_get_block(), the image file, or the checksum and epoch
+ * tables themselves) is tagged with the current backup epoch, which
+ * blocks_new_epoch() moves on. Blocks changed since an epoch are then
+ * found without comparing any data (see delta.h).
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
 #include <stdio.h>
+#include <sys/types.h>
+
+extern const int BLOCK_SIZE; // default = 4K
+extern int BLOCK_COUNT;      // we split the "disk" into blocks (default = 256)
+extern long NUFS_SIZE;       // default = 1MB
+extern int INODE_COUNT;      // default = one inode per 16K of image
+
+extern int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+extern int INODE_BITMAP_SIZE; // default = 64 / 8 = 8
+
+extern int BLOCK_BITMAP_START; // first block of the block bitmap
+extern int INODE_BITMAP_START; // first block of the inode bitmap
+extern int INODE_TABLE_START;  // first block of the inode table
+extern int CSUM_START;         // first block of the checksum table, or 0
+extern int CHANGES_START;      // first block of the epoch table, or 0
+extern int DATA_START;         // first block handed out by alloc_block()
+extern int FAST_BLOCKS;        // blocks in the fast tier (all, without one)
+
+// Tunables read by blocks_init(); set them before calling it.
+typedef struct blocks_options {
+  const char *backend; // "mmap" (default), "pread" or "uring"
+  int cache_blocks;    // block cache size of the pread/uring backends
+  int readahead;       // blocks the uring backend reads ahead
+  int map_window;      // blocks the mmap backend maps at a time
+  int map_budget;      // megabytes the mmap backend keeps mapped
+  int format_blocks;   // size of a freshly formatted image, in blocks
+  int format_inodes;   // its inode count; 0 = one per 16K of image
+  int read_only;       // open an existing image without writing to it
+  int discard;         // punch freed blocks out of the image file
+  int checksums;       // give a freshly formatted image a checksum table
+  int track_changes;   // ... and an epoch table
+  int scratch;         // format a volume in memory instead of opening one
+  int hugepages;       // ask for transparent huge pages for mmap windows
+  const char *slow_image; // the slow tier's image, for a two-tier volume
+  int slow_blocks;        // size of a freshly formatted slow tier, in blocks
+  const char *stripe_images; // more images to stripe over, ':' between
+  int stripe_unit;            // blocks per stripe unit of a fresh format
+} blocks_options_t;
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+extern blocks_options_t blocks_options;
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+typedef struct superblock {
+  int magic;
+  int version;
+  int block_count;
+  int inode_count;
+  int block_bitmap_start;
+  int inode_bitmap_start;
+  int inode_table_start;
+  int data_start;
+  int csum_start; // first block of the checksum table; 0 if there is none
+  int orphan_head; // first inode on the orphan list (see orphan.h), or 0
+  int fast_blocks; // blocks in the fast image; 0 if there is no slow tier
+  int volume_id;   // random; matches the slow image to this volume
+  int stripes;     // images the fast blocks are striped over; 0 means 1
+  int stripe_unit; // blocks per stripe unit
+  int member;      // in a stripe image's label: which image it is
+  int changes_start; // first block of the epoch table; 0 if there is none
+  int epoch;         // current backup epoch, from 1
+} superblock_t;
+
+// Storage tiers of a two-tier volume.
+enum blocks_tier { TIER_FAST, TIER_SLOW };
+
+// How file data was spread over the tiers (see blocks_tier_access()) and
+// what the migrator did about it.
+typedef struct blocks_tier_stats {
+  long fast_hits;   // file block reads and writes served by the fast tier
+  long slow_hits;   // ... by the slow tier
+  long demoted;     // blocks moved to the slow tier
+  long promoted;    // blocks moved to the fast tier
+  long passes;      // migrator passes
+} blocks_tier_stats_t;
+
+extern blocks_tier_stats_t blocks_tier_stats;
+
+// What block verification has found so far (see blocks_verify()). A bad
+// block is counted once, by whichever check found it first.
+typedef struct blocks_csum_stats {
+  long verified;     // blocks checked against their checksum on first use
+  long errors;       // ... that didn't match
+  long scrubbed;     // blocks checked by blocks_scrub()
+  long scrub_errors; // ... that didn't match
+  long scrub_passes; // times blocks_scrub() went over the whole image
+} blocks_csum_stats_t;
+
+extern blocks_csum_stats_t blocks_csum_stats;
 
 /**
  * Compute the number of blocks needed to store the given number of bytes.
@@ -29,7 +155,15 @@ int bytes_to_blocks(int bytes);
 /**
  * Load and initialize the given disk image.
  *
- * @param image_path Path to the disk image file.
+ * An empty image is formatted with the default geometry (unless
+ * blocks_options.read_only is set); otherwise the geometry is read back
+ * from its superblock. A non-empty image that isn't a nufs volume of
+ * this version is an error that exits, and is left as it is.
+ * With blocks_options.scratch set, a volume of format_blocks blocks is
+ * formatted in memory (without checksums) and always used through the
+ * mmap backend.
+ *
+ * @param image_path Path to the disk image file (unused for scratch).
  */
 void blocks_init(const char *image_path);
 
@@ -38,15 +172,270 @@ void blocks_init(const char *image_path);
  */
 void blocks_free();
 
+/**
+ * Write every modified block back to the image file.
+ */
+void blocks_sync();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
+ * The pointer stays valid until the end of the current operation (see
+ * blocks_op_begin()).
+ *
  * @param bnum Block number (index).
  *
  * @return Pointer to the beginning of the block in memory.
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a run of blocks that are contiguous in memory, all of which may be
+ * changed through the returned pointer.
+ *
+ * Same as blocks_get_block(bnum), but every block of the run gets a new
+ * checksum and is tagged as changed, not just the first one.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks; no more than blocks_contiguous(bnum,
+ *              count) returned.
+ *
+ * @return Pointer to the beginning of the first block in memory.
+ */
+void *blocks_get_run(int bnum, int count);
+
+/**
+ * Get a block that will only be read.
+ *
+ * Same as blocks_get_block(), but caching backends don't have to write
+ * the block back afterwards.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in memory.
+ */
+const void *blocks_peek_block(int bnum);
+
+/**
+ * Count how many consecutive blocks can be reached through one pointer.
+ *
+ * If this returns n, the pointer returned by blocks_get_block(bnum) or
+ * blocks_peek_block(bnum) also covers blocks bnum + 1 ... bnum + n - 1.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks the caller would like to access.
+ *
+ * @return Number of blocks (between 1 and count) laid out contiguously.
+ */
+int blocks_contiguous(int bnum, int count);
+
+/**
+ * Prepare blocks for I/O on the image file itself, bypassing the backend.
+ *
+ * Afterwards the image file holds the current contents of the blocks. When
+ * `writing` is set, no copy of them is kept that the file write would
+ * leave stale.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks, all in one image file (see
+ *              blocks_file_run()).
+ * @param writing Whether the blocks are about to be written.
+ * @param pos Set to the byte offset of block bnum in that file.
+ *
+ * @return File descriptor of the image file holding the blocks.
+ */
+int blocks_file_io(int bnum, int count, int writing, off_t *pos);
+
+/**
+ * Find where a block is stored.
+ *
+ * @param bnum Block number.
+ * @param pos Set to the byte offset of the block in its image file.
+ *
+ * @return File descriptor of the image file holding the block.
+ */
+int blocks_locate(int bnum, off_t *pos);
+
+/**
+ * Count how many consecutive blocks are also consecutive in one image
+ * file, so a single pread() or mmap() reaches them all.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks the caller would like to access.
+ *
+ * @return Number of blocks (between 1 and count).
+ */
+int blocks_file_run(int bnum, int count);
+
+/**
+ * @return The current backup epoch; 0 if the volume has no epoch table.
+ */
+int blocks_epoch();
+
+/**
+ * @return The epoch block bnum last changed in; 0 if it hasn't been
+ *         changed since the volume was formatted (or there is no table).
+ */
+int blocks_changed_in(int bnum);
+
+/**
+ * Start a new backup epoch, so blocks changed from now on can be told
+ * apart from those changed before. Runs as its own operation.
+ *
+ * @return The new epoch, or 0 if the volume has no epoch table.
+ */
+int blocks_new_epoch();
+
+/**
+ * @return Whether a file holds a nufs volume (checked without opening it
+ *         as one, which would format it if it doesn't).
+ */
+int blocks_probe(const char *image_path);
+
+/**
+ * Say that blocks are about to be read, so a backend that can start
+ * reading them all at once does (the uring cache, on every image of a
+ * striped volume in parallel).
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ */
+void blocks_prefetch(int bnum, int count);
+
+/**
+ * @return The tier block bnum is stored on (TIER_FAST without a slow tier).
+ */
+int blocks_tier(int bnum);
+
+/**
+ * Record that file data in some blocks was read or written, for the
+ * migrator's statistics and the tier hit rates.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ */
+void blocks_tier_access(int bnum, int count);
+
+/**
+ * How often a block was used lately: the number of accesses since the
+ * last blocks_tier_age(), plus half of what it had before that.
+ *
+ * @param bnum Block number.
+ *
+ * @return Between 0 and 255.
+ */
+int blocks_tier_heat(int bnum);
+
+/**
+ * Give a block the heat of another, when its contents move there.
+ */
+void blocks_tier_set_heat(int bnum, int value);
+
+/**
+ * Halve the heat of every block; the migrator does this once per pass.
+ */
+void blocks_tier_age();
+
+/**
+ * Zero a range of blocks by punching a hole in the image file, which also
+ * hands their space back to the host file system.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ *
+ * @return 0, or a negative errno if the host can't punch holes (the blocks
+ *         are left as they were).
+ */
+int blocks_punch(int bnum, int count);
+
+/**
+ * Check blocks against their checksums before their contents are used.
+ *
+ * Each block is only checked once after the image is opened (and again
+ * after it failed).
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ *
+ * @return 0, or -EIO if a block doesn't match its checksum.
+ */
+int blocks_verify(int bnum, int count);
+
+/**
+ * Copy data out of blocks, checking them against their checksums as
+ * blocks_verify() would, but in the same pass as the copy wherever a
+ * whole block is read.
+ *
+ * @param bnum First block; the blocks read must be contiguous in memory
+ *             (see blocks_contiguous()).
+ * @param skip Bytes to skip at the start of the first block.
+ * @param buf Where to copy to.
+ * @param size Number of bytes to copy.
+ *
+ * @return 0, or -EIO if a block doesn't match its checksum (buf is filled
+ *         in all the same).
+ */
+int blocks_read(int bnum, int skip, void *buf, size_t size);
+
+/**
+ * Record that blocks handed out with blocks_file_io(..., 1) have been
+ * written, so they get their checksums back. Copies of them read in the
+ * meantime are dropped.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ */
+void blocks_file_io_done(int bnum, int count);
+
+/**
+ * Check a stretch of used blocks against their checksums, whether or not
+ * they were checked before.
+ *
+ * @param from Block to start at.
+ * @param count Number of blocks to look at.
+ *
+ * @return Block to continue at next time; 0 after the end of the image.
+ */
+int blocks_scrub(int from, int count);
+
+/**
+ * Mark the start of an operation.
+ *
+ * Block pointers obtained during an operation stay valid until the
+ * matching blocks_op_end(). Operations may nest. The outermost one holds
+ * a lock, so threads take turns.
+ */
+void blocks_op_begin();
+
+/**
+ * Mark the end of an operation; the backend may recycle its blocks now.
+ */
+void blocks_op_end();
+
+/**
+ * Print statistics about the backend (cache hit rates etc.) and about
+ * checksum verification.
+ *
+ * @param out Stream to print to.
+ */
+void blocks_print_stats(FILE *out);
+
+/**
+ * Return a pointer to the superblock.
+ *
+ * @return A pointer to the superblock stored in block 0.
+ */
+superblock_t *get_superblock();
+
+/**
+ * Return a pointer to the superblock, for reading only.
+ *
+ * Unlike get_superblock(), this doesn't count as a change to block 0.
+ *
+ * @return A pointer to the superblock stored in block 0.
+ */
+const superblock_t *peek_superblock();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -61,20 +450,105 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Get a bit from a bitmap that may span several blocks.
+ *
+ * @param start First block of the bitmap.
+ * @param i The bit index.
+ *
+ * @return The state of the given bit (0 or 1).
+ */
+int blocks_bitmap_get(int start, int i);
+
+/**
+ * Set a bit in a bitmap that may span several blocks.
+ *
+ * @param start First block of the bitmap.
+ * @param i The bit index.
+ * @param v Value the bit should be set to (0 or 1).
+ */
+void blocks_bitmap_put(int start, int i, int v);
+
+/**
+ * Find a clear bit in a bitmap that may span several blocks.
+ *
+ * @param start First block of the bitmap.
+ * @param size Number of bits in the bitmap.
+ * @param from Bit index to start searching from (wraps around).
+ *
+ * @return The index of a clear bit, or -1 if the bitmap is full.
+ */
+int blocks_bitmap_find(int start, int size, int from);
+
 /**
  * Allocate a new block and return its number.
  *
  * Grabs the first unused block and marks it as allocated.
+ * Same as alloc_blocks(DATA_START, 1, 1, ...).
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * Takes the run starting at goal if it's free, otherwise the nearest run
+ * after goal with room for max blocks, otherwise the longest free run, as
+ * long as it has at least min blocks. Uses the in-memory free extent index
+ * (see freespace.h), so it doesn't scan the bitmap.
+ *
+ * @param goal Block the run should preferably start at.
+ * @param min Fewest blocks the caller can use.
+ * @param max Most blocks the caller wants.
+ * @param got Set to the number of blocks allocated (min ... max).
+ *
+ * @return The first block of the run, or -1 if no run of min blocks is free.
+ */
+int alloc_blocks(int goal, int min, int max, int *got);
+
+/**
+ * Allocate a run of contiguous blocks on one tier, as alloc_blocks() does
+ * on the whole volume. alloc_blocks() itself tries the fast tier first.
+ *
+ * @param tier TIER_FAST or TIER_SLOW.
+ *
+ * @return The first block of the run, or -1 if the tier has no run of min
+ *         blocks free.
+ */
+int alloc_blocks_in(int tier, int goal, int min, int max, int *got);
+
+/**
+ * @return Number of free blocks on a tier.
+ */
+long blocks_tier_free(int tier);
+
+/**
+ * Count the runs of free blocks by length, to see how fragmented free
+ * space is: counts[b] gets the runs of 2^b to 2^(b+1) - 1 blocks, and the
+ * last bucket the longer ones too.
+ *
+ * @return Number of free blocks.
+ */
+long blocks_free_histogram(long *counts, int buckets);
+
 /**
  * Deallocate the block with the given number.
  *
+ * With blocks_options.discard set, the host gets the space back too (see
+ * blocks_punch()).
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a batch of blocks, discarding them as free_block() does.
+ *
+ * @param bnums Array of block numbers to deallocate; 0 entries (holes)
+ *              are skipped.
+ * @param count Number of entries in the array.
+ */
+void free_blocks(const int *bnums, int count);
+
 #endif
@@ -0,0 +1,284 @@
+/**
+ * @file crc32c.c
+ *
+ * CRC-32C, in hardware where the CPU has it.
+ *
+ * The crc32 instruction has a latency of three cycles but can start one
+ * every cycle, so a single dependent chain runs at a third of its speed.
+ * Long buffers are therefore cut into three interleaved streams of
+ * STRIDE bytes, whose CRCs are combined by "appending" STRIDE zero bytes
+ * to the earlier ones with a table lookup (CRC is linear, so that shift
+ * is just a fixed 32x32 bit matrix, tabulated per byte).
+ *
+ * Where the CPU has AVX-512 and VPCLMULQDQ, buffers of FOLD_MIN bytes or
+ * more are instead folded 256 bytes at a time with carry-less multiplies
+ * (as in Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ"): each 128-bit lane is multiplied by x^N mod P for the N
+ * bits it moves forward, which keeps up with memory. What is left of the
+ * last 16 bytes is run through the crc32 instruction instead of a
+ * Barrett reduction.
+ */
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78 // Castagnoli, bit-reflected
+#define STRIDE 256
+#define FOLD_MIN 256 // 4 registers of 64 bytes
+
+static uint32_t byte_table[256];
+static uint32_t shift_table[4][256]; // appends STRIDE zero bytes
+
+// fold constants: for a lane moved forward by 2048, 512, 384, 256 and
+// 128 bits, x^(N+32) and x^(N-32) mod P (bit-reflected, shifted left one),
+// which multiply its low and high halves
+enum { FOLD_2048, FOLD_512, FOLD_384, FOLD_256, FOLD_128, FOLDS };
+static uint64_t fold_k[FOLDS][2];
+
+static uint32_t (*update)(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t (*update_copy)(uint32_t crc, unsigned char *dst,
+                               const unsigned char *p, size_t len);
+static const char *impl = "table";
+
+// the CRC register after feeding it len bytes, without the inversions
+static uint32_t update_table(uint32_t crc, const unsigned char *p,
+                             size_t len) {
+  while (len--) {
+    crc = byte_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+static uint32_t update_copy_table(uint32_t crc, unsigned char *dst,
+                                  const unsigned char *p, size_t len) {
+  memcpy(dst, p, len);
+  return update_table(crc, p, len);
+}
+
+static uint32_t shift(uint32_t crc) {
+  return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+         shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+update_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t c0 = crc;
+  while (len >= 3 * STRIDE) {
+    uint64_t c1 = 0, c2 = 0;
+    for (int i = 0; i < STRIDE; i += 8) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, p + i, 8);
+      memcpy(&w1, p + STRIDE + i, 8);
+      memcpy(&w2, p + 2 * STRIDE + i, 8);
+      c0 = __builtin_ia32_crc32di(c0, w0);
+      c1 = __builtin_ia32_crc32di(c1, w1);
+      c2 = __builtin_ia32_crc32di(c2, w2);
+    }
+    c0 = shift(c0) ^ c1;
+    c0 = shift(c0) ^ c2;
+    p += 3 * STRIDE;
+    len -= 3 * STRIDE;
+  }
+  while (len >= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    c0 = __builtin_ia32_crc32di(c0, w);
+    p += 8;
+    len -= 8;
+  }
+  uint32_t c = c0;
+  while (len--) {
+    c = __builtin_ia32_crc32qi(c, *p++);
+  }
+  return c;
+}
+
+// the same, storing each word as it goes by: the copy costs little more
+// than the loads the CRC needs anyway
+__attribute__((target("sse4.2"))) static uint32_t
+update_copy_sse42(uint32_t crc, unsigned char *dst, const unsigned char *p,
+                  size_t len) {
+  uint64_t c0 = crc;
+  while (len >= 3 * STRIDE) {
+    uint64_t c1 = 0, c2 = 0;
+    for (int i = 0; i < STRIDE; i += 8) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, p + i, 8);
+      memcpy(&w1, p + STRIDE + i, 8);
+      memcpy(&w2, p + 2 * STRIDE + i, 8);
+      memcpy(dst + i, &w0, 8);
+      memcpy(dst + STRIDE + i, &w1, 8);
+      memcpy(dst + 2 * STRIDE + i, &w2, 8);
+      c0 = __builtin_ia32_crc32di(c0, w0);
+      c1 = __builtin_ia32_crc32di(c1, w1);
+      c2 = __builtin_ia32_crc32di(c2, w2);
+    }
+    c0 = shift(c0) ^ c1;
+    c0 = shift(c0) ^ c2;
+    p += 3 * STRIDE;
+    dst += 3 * STRIDE;
+    len -= 3 * STRIDE;
+  }
+  memcpy(dst, p, len);
+  return update_sse42(c0, p, len);
+}
+
+#define FOLD_TARGET "avx512f,vpclmulqdq,sse4.2"
+
+// moves the lanes of x forward by the distance k was made for, onto the
+// lanes of data
+__attribute__((target(FOLD_TARGET), always_inline)) static inline __m512i
+fold(__m512i x, __m512i k, __m512i data) {
+  return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+                                   _mm512_clmulepi64_epi128(x, k, 0x11),
+                                   data, 0x96);
+}
+
+__attribute__((target(FOLD_TARGET), always_inline)) static inline __m512i
+fold_k4(int which) {
+  return _mm512_broadcast_i32x4(_mm_loadu_si128((void *)fold_k[which]));
+}
+
+// loads 64 bytes, storing them at dst too if there is one
+__attribute__((target(FOLD_TARGET), always_inline)) static inline __m512i
+fold_load(unsigned char *dst, const unsigned char *p) {
+  __m512i v = _mm512_loadu_si512(p);
+  if (dst) {
+    _mm512_storeu_si512(dst, v);
+  }
+  return v;
+}
+
+// the CRC register after len (>= FOLD_MIN) bytes, copying them to dst if
+// it isn't null
+__attribute__((target(FOLD_TARGET), always_inline)) static inline uint32_t
+update_fold(uint32_t crc, unsigned char *dst, const unsigned char *p,
+            size_t len) {
+  // a starting register is the same as xoring it into the first 4 bytes
+  __m512i x0 = _mm512_xor_si512(fold_load(dst, p),
+                                _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+  __m512i x1 = fold_load(dst ? dst + 64 : 0, p + 64);
+  __m512i x2 = fold_load(dst ? dst + 128 : 0, p + 128);
+  __m512i x3 = fold_load(dst ? dst + 192 : 0, p + 192);
+  size_t done = 256;
+
+  __m512i k = fold_k4(FOLD_2048);
+  for (; done + 256 <= len; done += 256) {
+    unsigned char *d = dst ? dst + done : 0;
+    x0 = fold(x0, k, fold_load(d, p + done));
+    x1 = fold(x1, k, fold_load(d ? d + 64 : 0, p + done + 64));
+    x2 = fold(x2, k, fold_load(d ? d + 128 : 0, p + done + 128));
+    x3 = fold(x3, k, fold_load(d ? d + 192 : 0, p + done + 192));
+  }
+
+  k = fold_k4(FOLD_512);
+  x1 = fold(x0, k, x1);
+  x2 = fold(x1, k, x2);
+  x3 = fold(x2, k, x3);
+  for (; done + 64 <= len; done += 64) {
+    x3 = fold(x3, k, fold_load(dst ? dst + done : 0, p + done));
+  }
+
+  // the first three lanes onto the last one
+  __m512i last = _mm512_inserti32x4(_mm512_setzero_si512(),
+                                    _mm512_extracti32x4_epi32(x3, 3), 3);
+  k = _mm512_inserti32x4(
+      _mm512_inserti32x4(
+          _mm512_castsi128_si512(_mm_loadu_si128((void *)fold_k[FOLD_384])),
+          _mm_loadu_si128((void *)fold_k[FOLD_256]), 1),
+      _mm_loadu_si128((void *)fold_k[FOLD_128]), 2);
+  k = _mm512_inserti32x4(k, _mm_setzero_si128(), 3);
+  x3 = fold(x3, k, last);
+  __m128i r = _mm_xor_si128(
+      _mm_xor_si128(_mm512_castsi512_si128(x3),
+                    _mm512_extracti32x4_epi32(x3, 1)),
+      _mm_xor_si128(_mm512_extracti32x4_epi32(x3, 2),
+                    _mm512_extracti32x4_epi32(x3, 3)));
+
+  uint64_t c = _mm_crc32_u64(0, _mm_cvtsi128_si64(r));
+  c = _mm_crc32_u64(c, _mm_extract_epi64(r, 1));
+  if (dst) {
+    memcpy(dst + done, p + done, len - done);
+  }
+  return update_sse42(c, p + done, len - done);
+}
+
+__attribute__((target(FOLD_TARGET))) static uint32_t
+update_avx512(uint32_t crc, const unsigned char *p, size_t len) {
+  if (len < FOLD_MIN) {
+    return update_sse42(crc, p, len);
+  }
+  return update_fold(crc, 0, p, len);
+}
+
+__attribute__((target(FOLD_TARGET))) static uint32_t
+update_copy_avx512(uint32_t crc, unsigned char *dst, const unsigned char *p,
+                   size_t len) {
+  if (len < FOLD_MIN) {
+    return update_copy_sse42(crc, dst, p, len);
+  }
+  return update_fold(crc, dst, p, len);
+}
+#endif
+
+// x^n mod P, bit-reflected
+static uint32_t xpow(int n) {
+  uint32_t r = 0x80000000; // 1
+  while (n--) {
+    r = r & 1 ? (r >> 1) ^ POLY : r >> 1;
+  }
+  return r;
+}
+
+void crc32c_init() {
+  for (int i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+    }
+    byte_table[i] = c;
+  }
+
+  static const unsigned char zeros[STRIDE];
+  for (int b = 0; b < 4; ++b) {
+    for (int i = 0; i < 256; ++i) {
+      shift_table[b][i] = update_table((uint32_t)i << (8 * b), zeros, STRIDE);
+    }
+  }
+
+  static const int fold_bits[FOLDS] = {2048, 512, 384, 256, 128};
+  for (int i = 0; i < FOLDS; ++i) {
+    fold_k[i][0] = (uint64_t)xpow(fold_bits[i] + 32) << 1;
+    fold_k[i][1] = (uint64_t)xpow(fold_bits[i] - 32) << 1;
+  }
+
+  update = update_table;
+  update_copy = update_copy_table;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    update = update_sse42;
+    update_copy = update_copy_sse42;
+    impl = "sse4.2";
+  }
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("vpclmulqdq")) {
+    update = update_avx512;
+    update_copy = update_copy_avx512;
+    impl = "avx512+vpclmulqdq";
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  return ~update(~crc, buf, len);
+}
+
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len) {
+  return ~update_copy(~crc, dst, src, len);
+}
+
+const char *crc32c_impl() { return impl; }
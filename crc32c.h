@@ -0,0 +1,51 @@
+/**
+ * @file crc32c.h
+ *
+ * CRC-32C (Castagnoli), the checksum used for image blocks.
+ *
+ * On x86-64 CPUs with AVX-512 and VPCLMULQDQ, buffers of 256 bytes or
+ * more are folded 64 bytes at a time with carry-less multiplies; with
+ * SSE4.2 alone it is computed with the crc32 instruction, three streams
+ * at a time; elsewhere with a lookup table.
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Pick the implementation and build the tables; call once before use.
+ */
+void crc32c_init();
+
+/**
+ * Compute the CRC-32C of a buffer.
+ *
+ * @param crc CRC of the data before buf (0 to start).
+ * @param buf Data.
+ * @param len Length of the data in bytes.
+ *
+ * @return The CRC of everything so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Copy a buffer and compute its CRC-32C in the same pass.
+ *
+ * @param crc CRC of the data before src (0 to start).
+ * @param dst Where to copy to; must not overlap src.
+ * @param src Data.
+ * @param len Length of the data in bytes.
+ *
+ * @return The CRC of everything so far.
+ */
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len);
+
+/**
+ * @return Name of the implementation in use ("avx512+vpclmulqdq",
+ *         "sse4.2" or "table").
+ */
+const char *crc32c_impl();
+
+#endif
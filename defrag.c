@@ -0,0 +1,212 @@
+/**
+ * @file defrag.c
+ *
+ * Online defragmenter. A pass walks the inode table one inode per
+ * operation, so requests wait for at most one file to be moved; the
+ * background thread sleeps after each file it moves for as long as moving
+ * its blocks should take at the configured rate.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "defrag.h"
+#include "inode.h"
+#include "writeback.h"
+
+#define DEFRAG_IDLE 60 // seconds to wait after a pass that moved nothing
+
+static defrag_stats_t defrag_done; // moved, defragmented, skipped, passes
+
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wake = PTHREAD_COND_INITIALIZER;
+static int defrag_running = 0;
+static int defrag_stopping = 0;
+static long defrag_block_ns = 0; // time to allow per block moved
+
+// count the runs of physically contiguous data blocks of a file (a hole
+// between two blocks that are next to each other on disk doesn't end a
+// run) and, in *blocks, its data blocks
+static int defrag_runs(const inode_t *node, int *blocks) {
+  int n = inode_blocks(node);
+  int runs = 0;
+  int last = -2; // disk block the previous run ended at
+  *blocks = 0;
+  for (int i = 0; i < n;) {
+    int bnum;
+    int run = inode_get_run(node, i * BLOCK_SIZE, n - i, &bnum);
+    if (bnum != 0) {
+      runs += bnum != last + 1;
+      last = bnum + run - 1;
+      *blocks += run;
+    }
+    i += run;
+  }
+  return runs;
+}
+
+// move a fragmented file into one run of blocks; returns blocks moved
+static int defrag_file(int inum) {
+  const inode_t *node = peek_inode(inum);
+  if (node->refs < 1 || !S_ISREG(node->mode) || writeback_is_open(inum)) {
+    return 0;
+  }
+  int blocks;
+  if (defrag_runs(node, &blocks) < 2) {
+    return 0;
+  }
+
+  int n = inode_blocks(node);
+  int tier = -1;
+  for (int i = 0; i < n; ++i) {
+    int bnum = inode_get_bnum(node, i * BLOCK_SIZE);
+    if (bnum != 0 && tier < 0) {
+      tier = blocks_tier(bnum);
+    } else if (bnum != 0 && blocks_tier(bnum) != tier) {
+      return 0;
+    }
+  }
+
+  int got;
+  int to = alloc_blocks_in(tier, tier == TIER_FAST ? DATA_START : FAST_BLOCKS,
+                           blocks, blocks, &got);
+  if (to < 0) {
+    defrag_done.skipped++;
+    return 0;
+  }
+  int at = to;
+  for (int i = 0; i < n; ++i) {
+    int bnum = inode_get_bnum(node, i * BLOCK_SIZE);
+    if (bnum == 0) {
+      continue; // a hole
+    }
+    int hot = blocks_tier_heat(bnum);
+    if (inode_move_block(get_inode(inum), i, at) < 0) {
+      break; // a damaged block stays where it is, and so does the rest
+    }
+    blocks_tier_set_heat(at, hot);
+    at++;
+  }
+  for (int b = at; b < to + blocks; ++b) {
+    free_block(b);
+  }
+
+  defrag_done.moved += at - to;
+  defrag_done.defragmented += at == to + blocks;
+  printf("+ defrag_file(%d) -> %d blocks moved to %d\n", inum, at - to, to);
+  return at - to;
+}
+
+void defrag_survey(defrag_stats_t *st) {
+  blocks_op_begin();
+  *st = defrag_done;
+  for (int inum = 0; inum < INODE_COUNT; ++inum) {
+    if (!blocks_bitmap_get(INODE_BITMAP_START, inum)) {
+      continue;
+    }
+    const inode_t *node = peek_inode(inum);
+    int blocks;
+    if (node->refs < 1 || !S_ISREG(node->mode)) {
+      continue;
+    }
+    int runs = defrag_runs(node, &blocks);
+    if (blocks > 0) {
+      st->files++;
+      st->fragmented += runs > 1;
+      st->runs += runs;
+      st->blocks += blocks;
+    }
+  }
+  blocks_op_end();
+}
+
+// wait for ns nanoseconds, or until the thread is told to stop; returns
+// whether it was (called with defrag_lock held)
+static int defrag_wait(long ns) {
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += ns / 1000000000;
+  until.tv_nsec += ns % 1000000000;
+  until.tv_sec += until.tv_nsec / 1000000000;
+  until.tv_nsec %= 1000000000;
+  while (!defrag_stopping &&
+         pthread_cond_timedwait(&defrag_wake, &defrag_lock, &until) !=
+             ETIMEDOUT) {
+  }
+  return defrag_stopping;
+}
+
+// a pass; throttled when run by the thread
+static int defrag_run(int throttled) {
+  int moved = 0;
+  for (int inum = 0; inum < INODE_COUNT; ++inum) {
+    blocks_op_begin();
+    int file = blocks_bitmap_get(INODE_BITMAP_START, inum) ? defrag_file(inum)
+                                                           : 0;
+    blocks_op_end();
+    moved += file;
+
+    if (throttled && file > 0) {
+      pthread_mutex_lock(&defrag_lock);
+      int stop = defrag_wait(file * defrag_block_ns);
+      pthread_mutex_unlock(&defrag_lock);
+      if (stop) {
+        break;
+      }
+    }
+  }
+
+  blocks_op_begin();
+  defrag_done.passes++;
+  blocks_op_end();
+  if (moved > 0) {
+    printf("+ defrag_pass() -> %d blocks moved\n", moved);
+  }
+  return moved;
+}
+
+int defrag_pass() { return defrag_run(0); }
+
+static void *defrag_main(void *arg) {
+  pthread_mutex_lock(&defrag_lock);
+  while (!defrag_stopping) {
+    pthread_mutex_unlock(&defrag_lock);
+    int moved = defrag_run(1);
+    pthread_mutex_lock(&defrag_lock);
+    if (moved == 0) {
+      defrag_wait(DEFRAG_IDLE * 1000000000L);
+    }
+  }
+  pthread_mutex_unlock(&defrag_lock);
+  return 0;
+}
+
+int defrag_start(int rate_mb) {
+  if (rate_mb <= 0 || defrag_running) {
+    return 0;
+  }
+  defrag_block_ns = 1000000000L * BLOCK_SIZE / ((long)rate_mb * 1024 * 1024);
+  defrag_stopping = 0;
+  int rv = pthread_create(&defrag_thread, 0, defrag_main, 0);
+  if (rv != 0) {
+    return -rv;
+  }
+  defrag_running = 1;
+  return 0;
+}
+
+void defrag_stop() {
+  if (!defrag_running) {
+    return;
+  }
+  pthread_mutex_lock(&defrag_lock);
+  defrag_stopping = 1;
+  pthread_cond_signal(&defrag_wake);
+  pthread_mutex_unlock(&defrag_lock);
+  pthread_join(defrag_thread, 0);
+  defrag_running = 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file defrag.h
+ *
+ * Online defragmenter. alloc_blocks() puts a growing file right after its
+ * last block when it can, but files written side by side interleave, and
+ * as files come and go free space breaks up into small holes. This moves
+ * the blocks of files stored in several runs into one run of contiguous
+ * blocks, taking the first free run long enough from the start of the
+ * volume (or of the file's tier), so files also get packed together and
+ * the free space behind them joins up.
+ *
+ * Each file is moved in one operation, its blocks copied and its pointers
+ * switched one at a time with inode_move_block(), so other requests see
+ * it either before or after. As with the tier migrator, only files nobody
+ * has open are moved, and files whose blocks are on both tiers of a
+ * two-tier volume are left to the migrator.
+ */
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+typedef struct defrag_stats {
+  long files;        // regular files with data blocks
+  long fragmented;   // ... stored in more than one run of blocks
+  long runs;         // runs of contiguous blocks, over all files
+  long blocks;       // data blocks of all files
+  long moved;        // blocks the defragmenter has moved since mounting
+  long defragmented; // files it has made contiguous
+  long skipped;      // fragmented files it found no free run for
+  long passes;       // passes over the files
+} defrag_stats_t;
+
+/**
+ * Measure how fragmented the files are, walking every inode in one
+ * operation, and add what the defragmenter has done.
+ */
+void defrag_survey(defrag_stats_t *st);
+
+/**
+ * Go over every file once, defragmenting those stored in several runs.
+ * Each file is its own operation, so file system requests get in between.
+ * Nothing is throttled: the caller's thread is busy until every file is
+ * done.
+ *
+ * @return Number of blocks moved.
+ */
+int defrag_pass();
+
+/**
+ * Start a thread that keeps defragmenting in the background.
+ *
+ * @param rate_mb How many MB of blocks to move per second at most; 0 or
+ *                less leaves the defragmenter off. After a pass that
+ *                finds nothing to do it waits a minute for the next.
+ *
+ * @return 0, or a negative errno if the thread can't be started.
+ */
+int defrag_start(int rate_mb);
+
+/**
+ * Stop the defragmenter and wait for it to finish the file it is on.
+ */
+void defrag_stop();
+
+#endif
@@ -0,0 +1,197 @@
+// nufs-delta: write the blocks of an image changed since a backup epoch
+// to stdout, for nufs-apply to bring a copy of the image up to date.
+//
+// usage: nufs-delta [-e since] image > delta
+//
+// Without -e every block that isn't all zeros is written (a full delta).
+// Either way the image then moves on to a new epoch, which is printed on
+// stderr: pass it as -e next time to get only what changed in between.
+// Blocks are found through the image's epoch table (see blocks.h), so
+// nothing is compared and unchanged data isn't even read.
+//
+// The image mustn't be mounted while this runs. Striped and two-tier
+// volumes aren't supported.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "delta.h"
+
+#define DELTA_RUN 256 // most blocks per record
+
+static int out_fd;
+static char *run_buf; // DELTA_RUN blocks
+
+static long stat_blocks = 0;
+static long stat_records = 0;
+
+static const char *usage = "usage: %s [-e since] image > delta\n";
+
+static void die(const char *what) {
+  fprintf(stderr, "nufs-delta: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static void write_all(const void *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(out_fd, data, size);
+    if (n < 0) {
+      die("write");
+    }
+    data = (const char *)data + n;
+    size -= n;
+  }
+}
+
+static void read_blocks(int bnum, int count, char *buf) {
+  off_t pos;
+  int fd = blocks_locate(bnum, &pos);
+  size_t size = (size_t)count * BLOCK_SIZE;
+  while (size > 0) {
+    ssize_t n = pread(fd, buf, size, pos);
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      die("read");
+    }
+    buf += n;
+    pos += n;
+    size -= n;
+  }
+}
+
+static int all_zeros(const char *block) {
+  for (int i = 0; i < BLOCK_SIZE; ++i) {
+    if (block[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void write_run(int bnum, int count, const char *data) {
+  delta_record_t rec = {.bnum = bnum, .count = count};
+  write_all(&rec, sizeof(rec));
+  write_all(data, (size_t)count * BLOCK_SIZE);
+  stat_records++;
+  stat_blocks += count;
+}
+
+// a full delta reads everything and leaves out the blocks of zeros
+static void delta_full() {
+  for (int first = 0; first < BLOCK_COUNT; first += DELTA_RUN) {
+    int count = BLOCK_COUNT - first < DELTA_RUN ? BLOCK_COUNT - first
+                                                : DELTA_RUN;
+    read_blocks(first, count, run_buf);
+    int start = -1; // of the run of nonzero blocks being collected
+    for (int i = 0; i <= count; ++i) {
+      int keep = i < count && !all_zeros(run_buf + (size_t)i * BLOCK_SIZE);
+      if (keep && start < 0) {
+        start = i;
+      } else if (!keep && start >= 0) {
+        write_run(first + start, i - start,
+                  run_buf + (size_t)start * BLOCK_SIZE);
+        start = -1;
+      }
+    }
+  }
+}
+
+// an incremental one only reads the blocks the epoch table points at
+static void delta_since(int since) {
+  int bnum = 0;
+  while (bnum < BLOCK_COUNT) {
+    if (blocks_changed_in(bnum) < since) {
+      bnum++;
+      continue;
+    }
+    int count = 1;
+    while (count < DELTA_RUN && bnum + count < BLOCK_COUNT &&
+           blocks_changed_in(bnum + count) >= since) {
+      count++;
+    }
+    read_blocks(bnum, count, run_buf);
+    write_run(bnum, count, run_buf);
+    bnum += count;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int since = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:")) != -1) {
+    switch (opt) {
+    case 'e':
+      since = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || since < 0) {
+    fprintf(stderr, usage, argv[0]);
+    return 1;
+  }
+  const char *image = argv[optind];
+  if (!blocks_probe(image)) {
+    fprintf(stderr, "nufs-delta: %s: not a nufs image\n", image);
+    return 1;
+  }
+
+  // the block layer traces every call on stdout; the delta needs it
+  out_fd = dup(1);
+  if (!freopen("/dev/null", "w", stdout)) {
+    die("/dev/null");
+  }
+
+  blocks_init(image);
+  const superblock_t *sb = peek_superblock();
+  if (sb->stripes > 1 || FAST_BLOCKS < BLOCK_COUNT) {
+    fprintf(stderr, "nufs-delta: %s: striped and two-tier volumes aren't "
+                    "supported\n",
+            image);
+    return 1;
+  }
+  if (!CHANGES_START) {
+    fprintf(stderr, "nufs-delta: %s: the image has no epoch table\n", image);
+    return 1;
+  }
+  if (since > blocks_epoch()) {
+    fprintf(stderr, "nufs-delta: %s: the image is only at epoch %d\n", image,
+            blocks_epoch());
+    return 1;
+  }
+
+  // what changes from here on, this superblock included, goes in the
+  // next delta as well as this one
+  run_buf = malloc((size_t)DELTA_RUN * BLOCK_SIZE);
+  int epoch = blocks_new_epoch();
+  delta_header_t hdr = {
+      .block_size = BLOCK_SIZE,
+      .block_count = BLOCK_COUNT,
+      .since = since,
+      .epoch = epoch,
+      .volume_id = sb->volume_id,
+  };
+  memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+  blocks_sync();
+  write_all(&hdr, sizeof(hdr));
+  if (since == 0) {
+    delta_full();
+  } else {
+    delta_since(since);
+  }
+  delta_record_t end = {.bnum = 0, .count = 0};
+  write_all(&end, sizeof(end));
+  blocks_free();
+
+  fprintf(stderr, "%ld blocks in %ld records; the image is now at epoch %d\n",
+          stat_blocks, stat_records, epoch);
+  return 0;
+}
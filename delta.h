@@ -0,0 +1,36 @@
+/**
+ * @file delta.h
+ *
+ * Block-level deltas of an image, written by nufs-delta and applied to a
+ * copy of the image by nufs-apply.
+ *
+ * A delta is a delta_header_t followed by delta_record_t's, each followed
+ * by count blocks of data, and ends with a record whose count is 0. A
+ * full delta (since 0) has every block that isn't all zeros; applied to
+ * an empty file it gives a copy of the image. An incremental one has the
+ * blocks changed in the epochs since..epoch-1, and only applies to a copy
+ * that is at epoch since. Numbers are stored in host byte order.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_MAGIC "NUFSDLT1"
+
+typedef struct delta_header {
+  char magic[8];       // DELTA_MAGIC
+  int32_t block_size;  // BLOCK_SIZE
+  int32_t block_count; // of the image
+  int32_t since;       // first epoch included; 0 for a full delta
+  int32_t epoch;       // the epoch the image moved on to
+  int32_t volume_id;   // of the image
+  int32_t reserved;
+} delta_header_t;
+
+typedef struct delta_record {
+  int32_t bnum;  // first block
+  int32_t count; // consecutive blocks of data after the record
+} delta_record_t;
+
+#endif
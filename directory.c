@@ -10,6 +10,8 @@
 
 #include "directory.h"
 #include "inode.h"
+#include "orphan.h"
+#include "path.h"
 #include "randomfuncs.h"
 #include "slist.h"
 
@@ -37,13 +39,22 @@ void directory_init() {
   rn->refs = 0; //resetting the ref count
 }
 
+// does the NUL-terminated entry name match the (name, len) slice?
+static int name_eq(const char *entry, const char *name, int len) {
+  return memcmp(entry, name, len) == 0 && entry[len] == 0;
+}
+
 // gets the inum of the given entry from the directory
-int directory_lookup(inode_t *di, const char *name) {
-  char *data = blocks_get_block(inode_get_bnum(di, 0));
-  char *text = data;
+int directory_lookup(const inode_t *di, const char *name) {
+  return directory_lookup_n(di, name, strlen(name));
+}
+
+// same as directory_lookup, for a name that isn't NUL-terminated
+int directory_lookup_n(const inode_t *di, const char *name, int len) {
+  char *text = (char *)blocks_peek_block(inode_get_bnum(di, 0));
 
   for (int i = 0; i < di->entries; ++i) {
-    if (streq(text, name)) {
+    if (name_eq(text, name, len)) {
       text = process_string(text);
       int *inum = (int *)(text);
       return *inum;
@@ -57,49 +68,119 @@ int directory_lookup(inode_t *di, const char *name) {
 
 // gets the inum of the given element in the file system tree
 int filesys_lookup(const char *path) {
-  if (streq(path, "/")) { // Check if path is the root directory
-    return 0;
-  }
-  path += 1; // Skip leading '/'
-  
+  path_cursor_t pc;
+  path_init(&pc, path);
+
   int dir = 0; // Start at the root directory inode
-  slist_t *pathlist = s_explode(path, '/'); 
-  for (slist_t *tmp = pathlist; tmp != NULL; tmp = tmp->next) {
-    inode_t *node = get_inode(dir); // Get the current directory inode
-    dir = directory_lookup(node, tmp->data);
-    if (dir == -1) {
-      return -1; // this means a lack of the directory component
+  while (path_next(&pc)) {
+    const inode_t *node = peek_inode(dir); // Get the current directory inode
+    if (!S_ISDIR(node->mode)) {
+      return -ENOTDIR;
+    }
+    dir = directory_lookup_n(node, pc.name, pc.len);
+    if (dir < 0) {
+      return dir; // this means a lack of the directory component
     }
   }
-  return dir; 
+  return dir;
+}
+
+// gets the inum of the directory holding the last component of the path;
+// the last component itself is returned in name/len (pointing into path)
+int filesys_lookup_parent(const char *path, const char **name, int *len) {
+  path_cursor_t pc;
+  path_init(&pc, path);
+  if (!path_next(&pc)) {
+    return -EINVAL; // "/" has no parent entry
+  }
+
+  int dir = 0;
+  while (!path_at_end(&pc)) {
+    const inode_t *node = peek_inode(dir);
+    if (!S_ISDIR(node->mode)) {
+      return -ENOTDIR;
+    }
+    dir = directory_lookup_n(node, pc.name, pc.len);
+    if (dir < 0) {
+      return dir;
+    }
+    path_next(&pc);
+  }
+
+  if (!S_ISDIR(peek_inode(dir)->mode)) {
+    return -ENOTDIR;
+  }
+  *name = pc.name;
+  *len = pc.len;
+  return dir;
 }
 
 // inserts the inum into the directory
 int directory_put(inode_t *di, const char *name, int inum) {
-  int nlen = strlen(name) + 1;
+  return directory_put_n(di, name, strlen(name), inum);
+}
+
+// same as directory_put, for a name that isn't NUL-terminated
+int directory_put_n(inode_t *di, const char *name, int len, int inum) {
+  int rv = directory_insert_n(di, name, len, inum);
+  if (rv < 0) {
+    return rv;
+  }
+
+  inode_t *sub = get_inode(inum);
+  sub->refs++;
+  inode_touch_ctime(sub);
+  return 0;
+}
+
+// deletes directory with the given name input
+int directory_delete(inode_t *di, const char *name) {
+  return directory_delete_n(di, name, strlen(name));
+}
+
+// same as directory_delete, for a name that isn't NUL-terminated
+int directory_delete_n(inode_t *di, const char *name, int len) {
+  int inum = directory_remove_n(di, name, len);
+  if (inum < 0) {
+    return inum;
+  }
+
+  inode_t *sub = get_inode(inum);
+  sub->refs--;
+  inode_touch_ctime(sub);
+  if (sub->refs < 1) {
+    orphan_add(inum);
+  }
+  return 0;
+}
+
+// adds an entry without touching the reference count of its inode
+int directory_insert_n(inode_t *di, const char *name, int len, int inum) {
+  int nlen = len + 1;
   if (di->size + nlen + sizeof(inum) > BLOCK_SIZE) {
     return -ENOSPC;
   }
 
   char *data = blocks_get_block(inode_get_bnum(di, 0));
-  memcpy(data + di->size, name, nlen);
+  memcpy(data + di->size, name, len);
+  data[di->size + len] = 0;
   di->size += nlen;
 
   memcpy(data + di->size, &inum, sizeof(inum));
   di->size += sizeof(inum);
   di->entries++;
-  inode_t *sub = get_inode(inum);
-  sub->refs++;
+  inode_touch_mtime(di);
   return 0;
 }
 
-// deletes directory with the given name input
-int directory_delete(inode_t *di, const char *name) {
+// removes an entry without touching the reference count of its inode;
+// returns the inum the entry pointed to
+int directory_remove_n(inode_t *di, const char *name, int len) {
   char *data = blocks_get_block(inode_get_bnum(di, 0));
   char *text = data;
   char *eend = 0;
   for (int i = 0; i < di->entries; i++) {
-    if (strcmp(text, name) != 0) {
+    if (!name_eq(text, name, len)) {
       text = process_string(text);
       text += 4;
     } else {
@@ -111,23 +192,75 @@ int directory_delete(inode_t *di, const char *name) {
       int elen = (int)(eend - text);
       di->size -= elen;
       di->entries--;
+      inode_touch_mtime(di);
+      return inum;
+    }
+  }
+  return -ENOENT;
+}
+
+// points an existing entry at another inode in place, without touching
+// any reference counts; returns the inum it used to point to
+int directory_set_n(inode_t *di, const char *name, int len, int inum) {
+  char *data = blocks_get_block(inode_get_bnum(di, 0));
+  char *text = data;
+
+  for (int i = 0; i < di->entries; ++i) {
+    char *slot = process_string(text);
+    if (name_eq(text, name, len)) {
+      int old;
+      memcpy(&old, slot, sizeof(int));
+      memcpy(slot, &inum, sizeof(int));
+      inode_touch_mtime(di);
+      return old;
+    }
+    text = slot + sizeof(int);
+  }
+  return -ENOENT;
+}
+
+// removes every entry except "." and ".." from the directory in one pass,
+// tearing down subdirectories recursively and freeing whatever inodes
+// lose their last reference
+void directory_teardown(inode_t *di) {
+  char *data = blocks_get_block(inode_get_bnum(di, 0));
+  char *text = data;
+  char *kept = data; // "." and ".." get compacted to the front
+
+  int entries = di->entries;
+  for (int i = 0; i < entries; i++) {
+    char *next = process_string(text);
+    int inum = *((int *)next);
+    next += sizeof(int);
+
+    if (streq(text, ".") || streq(text, "..")) {
+      memmove(kept, text, next - text);
+      kept += next - text;
+    } else {
       inode_t *sub = get_inode(inum);
+      if (S_ISDIR(sub->mode)) {
+        directory_teardown(sub);
+        di->refs--; // the subdirectory's ".." goes away with it
+      }
       sub->refs--;
       if (sub->refs < 1) {
-        free_inode(inum);
+        orphan_add(inum);
       }
-      return 0;
+      di->entries--;
     }
+    text = next;
   }
-  return -ENOENT;
+
+  di->size = (int)(kept - data);
+  inode_touch_mtime(di);
 }
 
 // list all entries that was specified by the given path
 slist_t *directory_list(const char *path) {
   int inum = filesys_lookup(path); // find the inode number for the given path
-  inode_t *di = get_inode(inum); // get the inode object with the inode number
-  char *data = blocks_get_block(inode_get_bnum(di, 0));
-  char *text = data;
+  inode_touch_atime(inum);
+  const inode_t *di = peek_inode(inum); // get the inode object
+  char *text = (char *)blocks_peek_block(inode_get_bnum(di, 0));
 
   slist_t *dir_list_wip = NULL; // initialize empty list to store directory entries
 
@@ -12,16 +12,19 @@
 #include "inode.h"
 #include "slist.h"
 
-extern const int BLOCK_COUNT;
-extern const int BLOCK_SIZE;
-extern const int NUFS_SIZE;
-extern const int BLOCK_BITMAP_SIZE;
-
 void directory_init();
-int directory_lookup(inode_t *di, const char *name);
+int directory_lookup(const inode_t *di, const char *name);
+int directory_lookup_n(const inode_t *di, const char *name, int len);
 int directory_put(inode_t *di, const char *name, int inum);
+int directory_put_n(inode_t *di, const char *name, int len, int inum);
 int directory_delete(inode_t *di, const char *name);
+int directory_delete_n(inode_t *di, const char *name, int len);
+int directory_insert_n(inode_t *di, const char *name, int len, int inum);
+int directory_remove_n(inode_t *di, const char *name, int len);
+int directory_set_n(inode_t *di, const char *name, int len, int inum);
+void directory_teardown(inode_t *di);
 int filesys_lookup(const char *path);
+int filesys_lookup_parent(const char *path, const char **name, int *len);
 slist_t *directory_list(const char *path);
 void print_directory(const char *path);
 char *process_string(char *data);
@@ -0,0 +1,394 @@
+// nufs-export: write the contents of an image to stdout as a tar or cpio
+// archive, without mounting it.
+//
+// usage: nufs-export [-c] [-N reference] [-S slow_image]
+//                    [-T image:image...] image > archive
+//
+// The archive is GNU tar unless -c asks for cpio (newc). With -N, files
+// and symlinks not modified since the reference file was (or since
+// @seconds after the epoch) are left out; directories are always written
+// so the tree stays whole. A two-tier volume needs its slow image given
+// with -S, and a striped one its other images with -T.
+//
+// The image is opened read-only. Directories are walked by inode, one
+// directory block per level of nesting, and file contents go from the
+// image file to stdout with sendfile(), so memory use doesn't grow with
+// the image. Hard links come out as separate copies.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "storage.h"
+
+#define OUT_BUFFER (64 * 1024)
+#define TAR_BLOCK 512
+
+// a GNU tar header; numbers are NUL-terminated octal
+typedef struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[8]; // "ustar  " plus NUL: GNU rather than POSIX
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char pad[167];
+} tar_header_t;
+
+_Static_assert(sizeof(tar_header_t) == TAR_BLOCK, "tar headers are 512 bytes");
+
+static int cpio = 0;
+static struct timespec since = {0, 0}; // -N; zero writes everything
+
+static int out_fd;
+static char out_buf[OUT_BUFFER];
+static int out_len = 0;
+
+static long stat_files = 0;
+static long stat_skipped = 0;
+static long stat_bytes = 0;
+
+static void die(const char *what) {
+  fprintf(stderr, "nufs-export: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static void write_all(const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(out_fd, data, size);
+    if (n < 0) {
+      die("write");
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+static void out_flush() {
+  write_all(out_buf, out_len);
+  out_len = 0;
+}
+
+static void out_write(const void *data, size_t size) {
+  if (out_len + size > OUT_BUFFER) {
+    out_flush();
+  }
+  if (size > OUT_BUFFER) {
+    write_all(data, size);
+    return;
+  }
+  memcpy(out_buf + out_len, data, size);
+  out_len += size;
+}
+
+// bytes that take size up to the next multiple of align
+static size_t padding(size_t size, int align) {
+  return (align - size % align) % align;
+}
+
+static void out_zeros(size_t size) {
+  static const char zeros[TAR_BLOCK];
+  while (size > 0) {
+    size_t n = size < sizeof(zeros) ? size : sizeof(zeros);
+    out_write(zeros, n);
+    size -= n;
+  }
+}
+
+// contents of a file: small ones through the buffer, big ones sent by the
+// kernel straight from the image file
+static void out_contents(int inum, size_t size) {
+  storage_extent_t *exts;
+  storage_op_begin();
+  int count = storage_map_inode(inum, size, 0, 0, &exts);
+  storage_op_end();
+  if (count < 0) {
+    errno = -count;
+    die("map");
+  }
+
+  for (int i = 0; i < count; ++i) {
+    int fd = exts[i].fd;
+    off_t pos = exts[i].pos;
+    size_t left = exts[i].size;
+    if (pos < 0) { // a hole
+      out_zeros(left);
+      continue;
+    }
+    if (out_len + left <= OUT_BUFFER) {
+      if (pread(fd, out_buf + out_len, left, pos) != left) {
+        die("read image");
+      }
+      out_len += left;
+      continue;
+    }
+
+    out_flush();
+    while (left > 0) {
+      ssize_t n = sendfile(out_fd, fd, &pos, left);
+      if (n <= 0) {
+        // stdout doesn't take sendfile(); copy through the buffer
+        size_t chunk = left < OUT_BUFFER ? left : OUT_BUFFER;
+        if (pread(fd, out_buf, chunk, pos) != chunk) {
+          die("read image");
+        }
+        out_len = chunk;
+        out_flush();
+        n = chunk;
+        pos += n;
+      }
+      left -= n;
+    }
+  }
+  free(exts);
+  stat_bytes += size;
+}
+
+// the low digits of value, zero-padded to fill the field
+static void octal(char *field, int width, unsigned long value) {
+  field[width - 1] = 0;
+  for (int i = width - 2; i >= 0; --i) {
+    field[i] = '0' + (value & 7);
+    value >>= 3;
+  }
+}
+
+static void tar_header(const char *name, int type, const inode_t *node,
+                       long size, const char *link) {
+  tar_header_t h;
+  memset(&h, 0, sizeof(h));
+  strncpy(h.name, name, sizeof(h.name));
+  octal(h.mode, sizeof(h.mode), node ? node->mode & 07777 : 0644);
+  octal(h.uid, sizeof(h.uid), getuid());
+  octal(h.gid, sizeof(h.gid), getgid());
+  octal(h.size, sizeof(h.size), size);
+  octal(h.mtime, sizeof(h.mtime), node ? node->mod_time.tv_sec : 0);
+  h.typeflag = type;
+  if (link) {
+    strncpy(h.linkname, link, sizeof(h.linkname));
+  }
+  memcpy(h.magic, "ustar  ", 8);
+
+  memset(h.chksum, ' ', sizeof(h.chksum));
+  unsigned sum = 0;
+  for (int i = 0; i < sizeof(h); ++i) {
+    sum += ((unsigned char *)&h)[i];
+  }
+  snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+  out_write(&h, sizeof(h));
+}
+
+// names that don't fit a header go in a GNU long name/link entry first
+static void tar_long(int type, const char *value) {
+  size_t len = strlen(value) + 1;
+  tar_header("././@LongLink", type, 0, len, 0);
+  out_write(value, len);
+  out_zeros(padding(len, TAR_BLOCK));
+}
+
+static void tar_entry(const char *path, int inum, const inode_t *node,
+                      const char *target) {
+  char name[PATH_MAX + 1];
+  snprintf(name, sizeof(name), S_ISDIR(node->mode) ? "%s/" : "%s", path);
+  if (strlen(name) > 100) {
+    tar_long('L', name);
+  }
+  if (target && strlen(target) > 100) {
+    tar_long('K', target);
+  }
+
+  if (S_ISDIR(node->mode)) {
+    tar_header(name, '5', node, 0, 0);
+  } else if (S_ISLNK(node->mode)) {
+    tar_header(name, '2', node, 0, target);
+  } else {
+    tar_header(name, '0', node, node->size, 0);
+    out_contents(inum, node->size);
+    out_zeros(padding(node->size, TAR_BLOCK));
+  }
+}
+
+static void cpio_header(const char *name, int inum, const inode_t *node,
+                        long size) {
+  char h[111];
+  size_t namesize = strlen(name) + 1;
+  snprintf(h, sizeof(h),
+           "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X", inum,
+           node ? node->mode : 0, getuid(), getgid(),
+           node && S_ISDIR(node->mode) ? 2 : 1,
+           node ? (unsigned)node->mod_time.tv_sec : 0, (unsigned)size, 0, 0, 0,
+           0, (unsigned)namesize, 0);
+  out_write(h, 110);
+  out_write(name, namesize);
+  out_zeros(padding(110 + namesize, 4));
+}
+
+static void cpio_entry(const char *path, int inum, const inode_t *node,
+                       const char *target) {
+  if (S_ISLNK(node->mode)) {
+    cpio_header(path, inum, node, strlen(target));
+    out_write(target, strlen(target));
+    out_zeros(padding(strlen(target), 4));
+  } else if (S_ISDIR(node->mode)) {
+    cpio_header(path, inum, node, 0);
+  } else {
+    cpio_header(path, inum, node, node->size);
+    out_contents(inum, node->size);
+    out_zeros(padding(node->size, 4));
+  }
+}
+
+static int changed(const inode_t *node) {
+  return node->mod_time.tv_sec > since.tv_sec ||
+         (node->mod_time.tv_sec == since.tv_sec &&
+          node->mod_time.tv_nsec > since.tv_nsec);
+}
+
+static void export_dir(int inum, char *path, int len);
+
+// write one inode (and everything below it) under the given path
+static void export_node(int inum, char *path, int len) {
+  inode_t node;
+  char target[BLOCK_SIZE];
+  storage_op_begin();
+  node = *peek_inode(inum);
+  if (S_ISLNK(node.mode)) {
+    int n = node.size < BLOCK_SIZE ? node.size : BLOCK_SIZE - 1;
+    memcpy(target, blocks_peek_block(inode_get_bnum(&node, 0)), n);
+    target[n] = 0;
+  }
+  storage_op_end();
+
+  if (!S_ISDIR(node.mode) && !changed(&node)) {
+    stat_skipped++;
+    return;
+  }
+
+  const char *link = S_ISLNK(node.mode) ? target : 0;
+  if (cpio) {
+    cpio_entry(path, inum, &node, link);
+  } else {
+    tar_entry(path, inum, &node, link);
+  }
+  stat_files++;
+
+  if (S_ISDIR(node.mode)) {
+    export_dir(inum, path, len);
+  }
+}
+
+// entries are copied out of the directory block, so nothing below has to
+// keep it in memory
+static void export_dir(int inum, char *path, int len) {
+  char block[BLOCK_SIZE];
+  storage_op_begin();
+  const inode_t *node = peek_inode(inum);
+  int entries = node->entries;
+  memcpy(block, blocks_peek_block(inode_get_bnum(node, 0)), node->size);
+  storage_op_end();
+
+  char *text = block;
+  for (int i = 0; i < entries; ++i) {
+    const char *name = text;
+    int nlen = strlen(name);
+    int child;
+    memcpy(&child, text + nlen + 1, sizeof(child));
+    text += nlen + 1 + sizeof(child);
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    if (len + 1 + nlen > PATH_MAX) {
+      fprintf(stderr, "nufs-export: path too long: %.*s/%s\n", len, path,
+              name);
+      continue;
+    }
+    int at = len;
+    if (len > 0) {
+      path[at++] = '/';
+    }
+    memcpy(path + at, name, nlen + 1);
+    export_node(child, path, at + nlen);
+    path[len] = 0;
+  }
+}
+
+static const char *usage = "usage: %s [-c] [-N reference|@seconds] "
+                           "[-S slow_image] [-T image:image...] image\n";
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "cN:S:T:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cpio = 1;
+      break;
+    case 'N':
+      if (optarg[0] == '@') {
+        since.tv_sec = atol(optarg + 1);
+      } else {
+        struct stat st;
+        if (stat(optarg, &st) != 0) {
+          die(optarg);
+        }
+        since = st.st_mtim;
+      }
+      break;
+    case 'S':
+      blocks_options.slow_image = optarg;
+      break;
+    case 'T':
+      blocks_options.stripe_images = optarg;
+      break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1) {
+    fprintf(stderr, usage, argv[0]);
+    return 1;
+  }
+
+  // the storage layer traces every call on stdout; the archive needs it
+  out_fd = dup(1);
+  if (!freopen("/dev/null", "w", stdout)) {
+    die("/dev/null");
+  }
+
+  blocks_options.read_only = 1;
+  inode_set_atime_mode(ATIME_NOATIME);
+  storage_init(argv[optind]);
+
+  char path[PATH_MAX + 1] = "";
+  export_dir(0, path, 0);
+
+  if (cpio) {
+    cpio_header("TRAILER!!!", 0, 0, 0);
+  } else {
+    out_zeros(2 * TAR_BLOCK);
+  }
+  out_flush();
+  storage_free();
+
+  fprintf(stderr, "%ld entries, %ld bytes written, %ld unchanged skipped\n",
+          stat_files, stat_bytes, stat_skipped);
+  return 0;
+}
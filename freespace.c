@@ -0,0 +1,290 @@
+/**
+ * @file freespace.c
+ *
+ * Free extent index: a treap of extents keyed by start block and
+ * augmented with the longest extent in each subtree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freespace.h"
+
+typedef struct extent {
+  int start;
+  int len;
+  int longest; // longest extent in this subtree
+  long sum;    // blocks in this subtree
+  unsigned prio;
+  int left;
+  int right; // children; -1 if none
+} extent_t;
+
+static extent_t *nodes = 0;
+static int capacity = 0;
+static int used = 0;
+static int free_list = -1; // released nodes, chained through `left`
+static int root = -1;
+static long total = 0;
+static int boundary = 0;
+static unsigned seed = 3650;
+
+static int longest(int n) { return n < 0 ? 0 : nodes[n].longest; }
+
+static long sum(int n) { return n < 0 ? 0 : nodes[n].sum; }
+
+static void update(int n) {
+  nodes[n].sum = nodes[n].len + sum(nodes[n].left) + sum(nodes[n].right);
+  int best = nodes[n].len;
+  if (longest(nodes[n].left) > best) {
+    best = longest(nodes[n].left);
+  }
+  if (longest(nodes[n].right) > best) {
+    best = longest(nodes[n].right);
+  }
+  nodes[n].longest = best;
+}
+
+static int node_new(int start, int len) {
+  int n;
+  if (free_list >= 0) {
+    n = free_list;
+    free_list = nodes[n].left;
+  } else {
+    if (used == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      nodes = realloc(nodes, capacity * sizeof(extent_t));
+    }
+    n = used++;
+  }
+
+  seed = seed * 1103515245 + 12345; // cheap LCG is plenty for priorities
+  nodes[n].start = start;
+  nodes[n].len = len;
+  nodes[n].longest = len;
+  nodes[n].sum = len;
+  nodes[n].prio = seed;
+  nodes[n].left = nodes[n].right = -1;
+  return n;
+}
+
+static void node_release(int n) {
+  nodes[n].left = free_list;
+  free_list = n;
+}
+
+// split t into extents starting before key (*l) and at or after it (*r)
+static void split(int t, int key, int *l, int *r) {
+  if (t < 0) {
+    *l = *r = -1;
+  } else if (nodes[t].start < key) {
+    split(nodes[t].right, key, &nodes[t].right, r);
+    update(t);
+    *l = t;
+  } else {
+    split(nodes[t].left, key, l, &nodes[t].left);
+    update(t);
+    *r = t;
+  }
+}
+
+// join two treaps where every extent in l comes before every one in r
+static int merge(int l, int r) {
+  if (l < 0) {
+    return r;
+  }
+  if (r < 0) {
+    return l;
+  }
+  if (nodes[l].prio > nodes[r].prio) {
+    nodes[l].right = merge(nodes[l].right, r);
+    update(l);
+    return l;
+  }
+  nodes[r].left = merge(l, nodes[r].left);
+  update(r);
+  return r;
+}
+
+static void insert(int start, int len) {
+  int l, r;
+  split(root, start, &l, &r);
+  root = merge(merge(l, node_new(start, len)), r);
+}
+
+static void erase(int start) {
+  int l, m, r;
+  split(root, start, &l, &r);
+  split(r, start + 1, &m, &r);
+  if (m >= 0) {
+    node_release(m);
+  }
+  root = merge(l, r);
+}
+
+// the extent in t with the largest start <= block, if it covers block
+static int containing(int t, int block) {
+  int best = -1;
+  while (t >= 0) {
+    if (nodes[t].start <= block) {
+      best = t;
+      t = nodes[t].right;
+    } else {
+      t = nodes[t].left;
+    }
+  }
+  if (best >= 0 && nodes[best].start + nodes[best].len > block) {
+    return best;
+  }
+  return -1;
+}
+
+// the first extent starting at or after `from` with at least `want` blocks
+static int first_fit(int t, int from, int want) {
+  while (t >= 0 && longest(t) >= want) {
+    if (nodes[t].start < from) {
+      t = nodes[t].right;
+      continue;
+    }
+    int found = first_fit(nodes[t].left, from, want);
+    if (found >= 0) {
+      return found;
+    }
+    if (nodes[t].len >= want) {
+      return t;
+    }
+    t = nodes[t].right;
+  }
+  return -1;
+}
+
+void freespace_reset() {
+  root = -1;
+  used = 0;
+  free_list = -1;
+  total = 0;
+  boundary = 0;
+}
+
+void freespace_set_boundary(int block) { boundary = block; }
+
+void freespace_add(int start, int count) {
+  if (boundary > start && boundary < start + count) {
+    freespace_add(start, boundary - start);
+    freespace_add(boundary, start + count - boundary);
+    return;
+  }
+  total += count;
+
+  // merge with the extents right before and right after the range
+  int before = start != boundary ? containing(root, start - 1) : -1;
+  if (before >= 0) {
+    start = nodes[before].start;
+    count += nodes[before].len;
+    erase(start);
+  }
+  int after =
+      start + count != boundary ? containing(root, start + count) : -1;
+  if (after >= 0) {
+    count += nodes[after].len;
+    erase(nodes[after].start);
+  }
+  insert(start, count);
+}
+
+void freespace_take(int start, int count) {
+  int n = containing(root, start);
+  if (n < 0 || nodes[n].start + nodes[n].len < start + count) {
+    fprintf(stderr, "freespace: blocks %d+%d aren't free\n", start, count);
+    abort();
+  }
+
+  int from = nodes[n].start;
+  int end = from + nodes[n].len;
+  erase(from);
+  if (start > from) {
+    insert(from, start - from);
+  }
+  if (end > start + count) {
+    insert(start + count, end - (start + count));
+  }
+  total -= count;
+}
+
+// freespace_find() among the extents of treap t
+static int find(int t, int goal, int min, int max, int *got) {
+  if (min < 1) {
+    min = 1;
+  }
+  if (max < min) {
+    max = min;
+  }
+
+  // grow in place
+  int n = containing(t, goal);
+  if (n >= 0 && nodes[n].start + nodes[n].len - goal >= min) {
+    int avail = nodes[n].start + nodes[n].len - goal;
+    *got = avail < max ? avail : max;
+    return goal;
+  }
+
+  // the nearest run with room for everything, else the longest one
+  n = first_fit(t, goal, max);
+  if (n < 0) {
+    n = first_fit(t, 0, max);
+  }
+  if (n < 0) {
+    if (longest(t) < min) {
+      return -1;
+    }
+    n = first_fit(t, 0, longest(t));
+  }
+  *got = nodes[n].len < max ? nodes[n].len : max;
+  return nodes[n].start;
+}
+
+int freespace_find(int goal, int min, int max, int *got) {
+  return find(root, goal, min, max, got);
+}
+
+int freespace_find_in(int lo, int hi, int goal, int min, int max, int *got) {
+  int l, m, r;
+  split(root, lo, &l, &m);
+  split(m, hi, &m, &r);
+  int start = find(m, goal >= lo && goal < hi ? goal : lo, min, max, got);
+  root = merge(merge(l, m), r);
+  return start;
+}
+
+int freespace_largest() { return longest(root); }
+
+long freespace_total() { return total; }
+
+long freespace_total_in(int lo, int hi) {
+  int l, m, r;
+  split(root, lo, &l, &m);
+  split(m, hi, &m, &r);
+  long n = sum(m);
+  root = merge(merge(l, m), r);
+  return n;
+}
+
+// count the extents of subtree t by size class
+static void histogram(int t, long *counts, int buckets) {
+  if (t < 0) {
+    return;
+  }
+  int b = 0;
+  while (b < buckets - 1 && nodes[t].len >> (b + 1)) {
+    b++;
+  }
+  counts[b]++;
+  histogram(nodes[t].left, counts, buckets);
+  histogram(nodes[t].right, counts, buckets);
+}
+
+void freespace_histogram(long *counts, int buckets) {
+  for (int b = 0; b < buckets; ++b) {
+    counts[b] = 0;
+  }
+  histogram(root, counts, buckets);
+}
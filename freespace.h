@@ -0,0 +1,93 @@
+/**
+ * @file freespace.h
+ *
+ * An in-memory index of the free extents (runs of free blocks) of the
+ * image.
+ *
+ * The extents live in a treap ordered by start block, where every node
+ * also knows the longest extent in its subtree. That answers "the first
+ * run of at least n blocks after block g" and "the longest run" in
+ * O(log n) without touching the bitmap, which stays the on-disk truth:
+ * blocks.c builds the index from it at mount and keeps both in sync.
+ *
+ * A boundary (the start of a volume's slow tier) can be set that no
+ * extent reaches across, so every extent lies on one tier.
+ */
+#ifndef FREESPACE_H
+#define FREESPACE_H
+
+/**
+ * Forget all extents.
+ */
+void freespace_reset();
+
+/**
+ * Keep extents from reaching across a block; call before adding any.
+ *
+ * @param block First block after the boundary; 0 for none.
+ */
+void freespace_set_boundary(int block);
+
+/**
+ * Mark a range of blocks as free, merging it with its neighbours.
+ *
+ * @param start First block of the range.
+ * @param count Number of blocks; none of them may be free already.
+ */
+void freespace_add(int start, int count);
+
+/**
+ * Mark a range of free blocks as used.
+ *
+ * @param start First block of the range.
+ * @param count Number of blocks; all of them must be in one free extent.
+ */
+void freespace_take(int start, int count);
+
+/**
+ * Pick a run of free blocks without taking it.
+ *
+ * Prefers a run starting exactly at `goal` (so a file can grow in place),
+ * then the first run after `goal` long enough for `max` blocks (wrapping
+ * around to the start), then the longest run there is.
+ *
+ * @param goal Block the run should preferably start at.
+ * @param min Fewest blocks the caller can use.
+ * @param max Most blocks the caller wants.
+ * @param got Set to the length of the run found (at most max).
+ *
+ * @return First block of the run, or -1 if no run of min blocks is free.
+ */
+int freespace_find(int goal, int min, int max, int *got);
+
+/**
+ * Same as freespace_find(), among the extents in [lo, hi) only. Neither
+ * end may fall inside an extent (the volume's ends and the boundary are
+ * fine).
+ */
+int freespace_find_in(int lo, int hi, int goal, int min, int max, int *got);
+
+/**
+ * @return Length of the longest free extent.
+ */
+int freespace_largest();
+
+/**
+ * @return Total number of free blocks.
+ */
+long freespace_total();
+
+/**
+ * @return Number of free blocks in [lo, hi), with the same restriction as
+ *         for freespace_find_in().
+ */
+long freespace_total_in(int lo, int hi);
+
+/**
+ * Count the free extents by size: counts[b] is the number of extents of
+ * 2^b to 2^(b+1) - 1 blocks, and the last bucket also has all longer ones.
+ * Walks every extent.
+ */
+void freespace_histogram(long *counts, int buckets);
+
+#endif
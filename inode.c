@@ -1,14 +1,30 @@
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "inode.h"
+#include "randomfuncs.h"
 
-const int INODES = 64;
+// where the next alloc_inode() starts looking for a free inode
+static int inode_cursor = 0;
+
+static int atime_mode = ATIME_RELATIME;
+
+// what each inode looked like when the kernel last opened it with
+// keep_cache; in memory only, since a fresh mount starts with an empty
+// page cache anyway
+typedef struct cache_stamp {
+  struct timespec mod_time;
+  int size;
+  int valid;
+} cache_stamp_t;
+
+static cache_stamp_t *cache_stamps = 0;
 
 // print information about certain inode
-void print_inode(inode_t *node) {
+void print_inode(const inode_t *node) {
   if (node) {
     printf("node{refs: %d, mode: %04o, size: %d, entries: %d, pointers[0]: %d, "
            "pointers[1]: %d, indirect pointer: %d}\n",
@@ -21,35 +37,55 @@ void print_inode(inode_t *node) {
 
 // find inode of certain number within memory
 inode_t *get_inode(int inum) {
-  //printf("-=== CHECKING INODE: %i ===-\n", inum);
-  // The one line that screwed things up for hours, FUN!
-  uint8_t *base = get_inode_bitmap();
-  inode_t *nodes = (inode_t *)(base);
-  return &(nodes[inum]); //return the requested inode
+  int per_block = BLOCK_SIZE / sizeof(inode_t);
+  inode_t *nodes = blocks_get_block(INODE_TABLE_START + inum / per_block);
+  return &(nodes[inum % per_block]); //return the requested inode
+}
+
+// same as get_inode, for an inode that will only be read: its block of
+// the inode table isn't checksummed or tagged as changed again
+const inode_t *peek_inode(int inum) {
+  int per_block = BLOCK_SIZE / sizeof(inode_t);
+  const inode_t *nodes =
+      blocks_peek_block(INODE_TABLE_START + inum / per_block);
+  return &nodes[inum % per_block];
+}
+
+// forget allocation state left over from a previously opened image
+void inodes_init() {
+  inode_cursor = 0;
+  free(cache_stamps);
+  cache_stamps = calloc(INODE_COUNT, sizeof(cache_stamp_t));
 }
 
 // create and allocate space for a new inode
 int alloc_inode() {
-  for (int i = 0; i < INODES; i++) {
-    inode_t *node = get_inode(i);
-    if (node->mode == 0) { //check if the inode is free
-      time_t now = time(NULL);
-      memset(node, 0, sizeof(inode_t)); //checking the structure
-      node->refs = 0;
-      node->mode = 010644;
-      node->size = 0;
-      node->entries = 0;
-      node->pointers[0] = alloc_block(); //allocating the first block
-      node->pointers[1] = 0;
-      node->indir_point = 0;
-      node->create_time = now;
-      node->acc_time = now;
-      node->mod_time = now;
-      printf("+ alloc_inode() -> %d\n", i);
-      return i;
-    }
+  // next-fit from the cursor keeps allocation O(1) amortized
+  int i = blocks_bitmap_find(INODE_BITMAP_START, INODE_COUNT, inode_cursor);
+  if (i < 0) {
+    return -1;
   }
-  return -1;
+  blocks_bitmap_put(INODE_BITMAP_START, i, 1);
+  inode_cursor = i + 1;
+  inode_cache_invalidate(i);
+
+  inode_t *node = get_inode(i);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  memset(node, 0, sizeof(inode_t)); //checking the structure
+  node->refs = 0;
+  node->mode = 010644;
+  node->size = 0;
+  node->entries = 0;
+  node->pointers[0] = alloc_block(); //allocating the first block
+  node->pointers[1] = 0;
+  node->indir_point = 0;
+  node->create_time = now;
+  node->acc_time = now;
+  node->mod_time = now;
+  node->change_time = now;
+  printf("+ alloc_inode() -> %d\n", i);
+  return i;
 }
 
 // free space after inode is no longer needed
@@ -58,8 +94,12 @@ void free_inode(int inum) {
   inode_t *node = get_inode(inum);
   if (node->refs <= 0) { 
     shrink_inode(node, 0); //reduce the inode to size 0
-    free_block(node->pointers[0]);
+    if (node->pointers[0]) { // may have been punched out
+      free_block(node->pointers[0]);
+    }
     memset(node, 0, sizeof(inode_t)); //clearing inode struct
+    blocks_bitmap_put(INODE_BITMAP_START, inum, 0);
+    inode_cache_invalidate(inum);
   } else {
     puts("Cannot free inode!");
     abort();
@@ -67,60 +107,293 @@ void free_inode(int inum) {
 }
 
 // increase space allocated for inode
+// (new blocks are asked for as contiguous runs right after the file's
+// current last block, so files stay in one piece when there is room)
 int grow_inode(inode_t *node, int size) {
-  int numBlocks = (node->size / BLOCK_SIZE) + 1;
+  return inode_grow_over(node, size, size);
+}
+
+// same as grow_inode, but new blocks that lie wholly in [from, size) are
+// not zeroed, since the caller is about to write all of them
+int inode_grow_over(inode_t *node, int size, int from) {
+  int numBlocks = inode_blocks(node);
   int neoNumBlocks = (size / BLOCK_SIZE) + 1;
+  if (neoNumBlocks > 2 + BLOCK_SIZE / (int)sizeof(int)) {
+    return -EFBIG; // more than the direct + indirect pointers can map
+  }
+  if (neoNumBlocks <= numBlocks) {
+    // preallocated blocks cover it
+    node->prealloc = numBlocks - neoNumBlocks;
+    node->size = size;
+    return 0;
+  }
+
+  int oldSize = node->size;
+  node->prealloc = 0;
+  int goal = inode_get_bnum(node, (numBlocks - 1) * BLOCK_SIZE) + 1;
   while (numBlocks < neoNumBlocks) {
-    //if needed this allocates additional blocks
-    if (node->pointers[1] == 0) {
-      node->pointers[1] = alloc_block();
-    } else {
-      
-      if (node->indir_point == 0) {
-        node->indir_point = alloc_block();
+    int got;
+    if (numBlocks >= 2 && node->indir_point == 0) {
+      // the indirect block goes right before the data it maps
+      node->indir_point = alloc_blocks(goal, 1, 1, &got);
+      if (node->indir_point < 0) {
+        node->indir_point = 0;
+        node->size = (numBlocks - 1) * BLOCK_SIZE;
+        shrink_inode(node, oldSize);
+        return -ENOSPC;
       }
-      int *ipointers = blocks_get_block(node->indir_point);
-      ipointers[numBlocks - 1] = alloc_block();
+      memset(blocks_get_block(node->indir_point), 0, BLOCK_SIZE);
+      goal = node->indir_point + 1;
+    }
+
+    // a run may not cross from the direct to the indirect pointers, since
+    // the indirect block has to be allocated in between
+    int want = numBlocks < 2 ? 2 - numBlocks : neoNumBlocks - numBlocks;
+    int first = alloc_blocks(goal, 1, want, &got);
+    if (first < 0) {
+      // give back what we got so far
+      node->size = (numBlocks - 1) * BLOCK_SIZE;
+      shrink_inode(node, oldSize);
+      return -ENOSPC;
     }
-    numBlocks += 1;
+
+    int *ipointers = numBlocks >= 2 ? blocks_get_block(node->indir_point) : 0;
+    for (int bnum = first; bnum < first + got; ++bnum) {
+      long at = (long)numBlocks * BLOCK_SIZE;
+      if (at < from || at + BLOCK_SIZE > size) {
+        memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+      }
+      if (numBlocks == 1) {
+        node->pointers[1] = bnum;
+      } else {
+        ipointers[numBlocks - 2] = bnum;
+      }
+      numBlocks += 1;
+    }
+    goal = first + got;
   }
   node->size = size;
   return 0;
 }
 
 // decrease space allocated for inode
+// (all blocks past the new end are released in one batch, preallocated
+// ones included)
 int shrink_inode(inode_t *node, int size) {
-  int numBlocks = (node->size / BLOCK_SIZE) + 1;
+  int numBlocks = inode_blocks(node);
   int neoNumBlocks = (size / BLOCK_SIZE) + 1;
-  while (numBlocks > neoNumBlocks) {
-    //free uneeded blocks
-    int bnum = inode_get_bnum(node, node->size);
-    free_block(bnum);
+  if (numBlocks > neoNumBlocks) {
     if (node->indir_point) {
       int *ipointers = blocks_get_block(node->indir_point);
-      int iptrIndex = (node->size / BLOCK_SIZE) - 2;
-      ipointers[iptrIndex] = 0;
-      if (ipointers[0] == 0) {
+      int first = max(neoNumBlocks, 2) - 2;
+      int count = numBlocks - 2 - first;
+      if (count > 0) {
+        free_blocks(ipointers + first, count);
+        memset(ipointers + first, 0, count * sizeof(int));
+      }
+      if (neoNumBlocks <= 2) {
+        free_block(node->indir_point);
         node->indir_point = 0;
       }
-    } else if (node->pointers[1]) {
+    }
+    if (neoNumBlocks < 2 && node->pointers[1]) {
+      free_block(node->pointers[1]);
       node->pointers[1] = 0;
-    } else {
-      puts("Attempted to shrink last remaining block");
-      return -1;
     }
-    numBlocks -= 1;
   }
+  // clear the rest of the last block, so growing again reads zeros there
+  int last = inode_get_bnum(node, size);
+  if (last) {
+    memset((char *)blocks_get_block(last) + size % BLOCK_SIZE, 0,
+           BLOCK_SIZE - size % BLOCK_SIZE);
+  }
+  node->size = size;
+  node->prealloc = 0;
   return 0;
 }
 
 // get block number for given inode
-int inode_get_bnum(inode_t *node, int file_bnum) {
+int inode_get_bnum(const inode_t *node, int file_bnum) {
   int blockIndex = file_bnum / BLOCK_SIZE;
   if (blockIndex < 2) {
     return node->pointers[blockIndex];
   } else {
-    int *indir_point = blocks_get_block(node->indir_point);
+    const int *indir_point = blocks_peek_block(node->indir_point);
     return indir_point[blockIndex - 2];
   }
 }
+
+// map the file block holding byte `offset` to its disk block (stored in
+// *bnum) and count how many file blocks from there on, at most max, sit
+// in consecutive disk blocks
+int inode_get_run(const inode_t *node, int offset, int max, int *bnum) {
+  int first = offset / BLOCK_SIZE;
+  const int *ipointers = 0;
+  if (first + max > 2) {
+    ipointers = blocks_peek_block(node->indir_point);
+  }
+
+  *bnum = first < 2 ? node->pointers[first] : ipointers[first - 2];
+  int run = 1;
+  while (run < max) {
+    int next = first + run;
+    int b = next < 2 ? node->pointers[next] : ipointers[next - 2];
+    if (*bnum ? b != *bnum + run : b != 0) {
+      break;
+    }
+    run++;
+  }
+  return run;
+}
+
+// number of file blocks the inode maps: those its size needs (always at
+// least one) plus any preallocated past the end; holes count too
+int inode_blocks(const inode_t *node) {
+  return node->size / BLOCK_SIZE + 1 + node->prealloc;
+}
+
+// point file block `index` at disk block bnum (0 makes it a hole)
+static void inode_set_bnum(inode_t *node, int index, int bnum) {
+  if (index < 2) {
+    node->pointers[index] = bnum;
+  } else {
+    ((int *)blocks_get_block(node->indir_point))[index - 2] = bnum;
+  }
+}
+
+// move file block {index} into the free block {to}, which the caller has
+// allocated: copy the contents, repoint the inode and free the old block;
+// fails with -EIO, leaving things as they were, if the old block is bad
+int inode_move_block(inode_t *node, int index, int to) {
+  int from = inode_get_bnum(node, index * BLOCK_SIZE);
+  if (blocks_verify(from, 1) < 0) {
+    return -EIO;
+  }
+  memcpy(blocks_get_block(to), blocks_peek_block(from), BLOCK_SIZE);
+  inode_set_bnum(node, index, to);
+  free_block(from);
+  return 0;
+}
+
+// map blocks for the first {size} bytes without changing the file size
+// (fallocate with KEEP_SIZE); blocks past the end count as preallocated
+int inode_reserve(inode_t *node, int size) {
+  int want = bytes_to_blocks(size);
+  if (want <= inode_blocks(node)) {
+    return 0;
+  }
+  int oldSize = node->size;
+  int rv = grow_inode(node, (want - 1) * BLOCK_SIZE);
+  if (rv < 0) {
+    return rv;
+  }
+  node->size = oldSize;
+  node->prealloc = want - (oldSize / BLOCK_SIZE + 1);
+  return 0;
+}
+
+// allocate blocks for the holes among the (mapped) file blocks holding
+// bytes [offset, offset + size), next to the block before each hole when
+// there is room
+int inode_fill_holes(inode_t *node, int offset, int size) {
+  int first = offset / BLOCK_SIZE;
+  int end = min(bytes_to_blocks(offset + size), inode_blocks(node));
+  for (int i = first; i < end;) {
+    int bnum;
+    int run = inode_get_run(node, i * BLOCK_SIZE, end - i, &bnum);
+    if (bnum != 0) {
+      i += run;
+      continue;
+    }
+
+    int goal = i > 0 ? inode_get_bnum(node, (i - 1) * BLOCK_SIZE) + 1
+                     : DATA_START;
+    int got;
+    int start = alloc_blocks(goal, 1, run, &got);
+    if (start < 0) {
+      return -ENOSPC;
+    }
+    for (int k = 0; k < got; ++k) {
+      memset(blocks_get_block(start + k), 0, BLOCK_SIZE);
+      inode_set_bnum(node, i + k, start + k);
+    }
+    i += got;
+  }
+  return 0;
+}
+
+// release the file blocks [first, first + count), leaving holes that read
+// as zeros; the size and the indirect block stay
+void inode_punch(inode_t *node, int first, int count) {
+  int end = min(first + count, inode_blocks(node));
+  for (int i = first; i < min(end, 2); ++i) {
+    if (node->pointers[i]) {
+      free_block(node->pointers[i]);
+      node->pointers[i] = 0;
+    }
+  }
+  if (end > 2) {
+    int *ipointers = blocks_get_block(node->indir_point);
+    int from = max(first, 2) - 2;
+    free_blocks(ipointers + from, end - 2 - from);
+    memset(ipointers + from, 0, (end - 2 - from) * sizeof(int));
+  }
+}
+
+// choose how reads update the access time
+void inode_set_atime_mode(int mode) { atime_mode = mode; }
+
+// is timestamp a at or before timestamp b?
+static int ts_before(struct timespec a, struct timespec b) {
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+}
+
+// record a read; leaves the inode (and its block of the inode table)
+// untouched unless the atime mode asks for it
+void inode_touch_atime(int inum) {
+  if (atime_mode == ATIME_NOATIME) {
+    return;
+  }
+
+  const inode_t *node = peek_inode(inum);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (atime_mode == ATIME_RELATIME && !ts_before(node->acc_time, node->mod_time) &&
+      !ts_before(node->acc_time, node->change_time) &&
+      now.tv_sec - node->acc_time.tv_sec < 24 * 60 * 60) {
+    return;
+  }
+  get_inode(inum)->acc_time = now;
+}
+
+// record a change to the contents of the inode
+void inode_touch_mtime(inode_t *node) {
+  clock_gettime(CLOCK_REALTIME, &node->mod_time);
+  node->change_time = node->mod_time;
+}
+
+// record a change to the inode itself (links, mode, timestamps)
+void inode_touch_ctime(inode_t *node) {
+  clock_gettime(CLOCK_REALTIME, &node->change_time);
+}
+
+// may the kernel keep the pages it cached for this inode? They are good
+// as long as the inode hasn't changed since they were validated, the way
+// FUSE's auto_cache compares mtime and size. Otherwise the current state
+// is recorded and the caller should let the kernel drop its copy.
+int inode_cache_check(int inum) {
+  const inode_t *node = peek_inode(inum);
+  cache_stamp_t *stamp = &cache_stamps[inum];
+  if (stamp->valid && stamp->size == node->size &&
+      stamp->mod_time.tv_sec == node->mod_time.tv_sec &&
+      stamp->mod_time.tv_nsec == node->mod_time.tv_nsec) {
+    return 1;
+  }
+  stamp->mod_time = node->mod_time;
+  stamp->size = node->size;
+  stamp->valid = 1;
+  return 0;
+}
+
+// the inode changed: whatever the kernel cached for it is stale
+void inode_cache_invalidate(int inum) { cache_stamps[inum].valid = 0; }
@@ -11,11 +11,8 @@
 
 #include "blocks.h"
 
-extern const int BLOCK_COUNT;
-extern const int BLOCK_SIZE;
-extern const int NUFS_SIZE;
-extern const int BLOCK_BITMAP_SIZE;
-
+// Inodes are padded to 128 bytes so a record never straddles a cache line
+// boundary and a 4K block of the inode table holds exactly 32 of them.
 typedef struct inode {
   int refs; // reference count
   int mode; // permission & type
@@ -23,17 +20,45 @@ typedef struct inode {
   int entries;
   int pointers[2];
   int indir_point;
-  time_t create_time;
-  time_t acc_time;
-  time_t mod_time;
+  struct timespec create_time;
+  struct timespec acc_time;    // last read (see the atime modes below)
+  struct timespec mod_time;    // last change to the contents
+  struct timespec change_time; // last change to the contents or the inode
+  int prealloc; // blocks mapped past the ones size needs (fallocate)
+  int orphan_next; // next inode on the orphan list, 0 at its end
+  char reserved[24];
 } inode_t;
 
-void print_inode(inode_t *node);
+_Static_assert(sizeof(inode_t) == 128, "inode_t must be two cache lines");
+
+// How reads update acc_time, picked with the mount options of the same name.
+enum atime_mode {
+  ATIME_STRICT,   // on every read
+  ATIME_RELATIME, // only if older than mod_time/change_time or a day old
+  ATIME_NOATIME,  // never
+};
+
+void print_inode(const inode_t *node);
 inode_t *get_inode(int inum);
+const inode_t *peek_inode(int inum);
+void inodes_init();
 int alloc_inode();
 void free_inode(int inum);
 int grow_inode(inode_t *node, int size);
+int inode_grow_over(inode_t *node, int size, int from);
 int shrink_inode(inode_t *node, int size);
-int inode_get_bnum(inode_t *node, int file_bnum);
+int inode_get_bnum(const inode_t *node, int file_bnum);
+int inode_get_run(const inode_t *node, int offset, int max, int *bnum);
+int inode_blocks(const inode_t *node);
+int inode_reserve(inode_t *node, int size);
+int inode_fill_holes(inode_t *node, int offset, int size);
+void inode_punch(inode_t *node, int first, int count);
+int inode_move_block(inode_t *node, int index, int to);
+void inode_set_atime_mode(int mode);
+void inode_touch_atime(int inum);
+void inode_touch_mtime(inode_t *node);
+void inode_touch_ctime(inode_t *node);
+int inode_cache_check(int inum);
+void inode_cache_invalidate(int inum);
 
 #endif
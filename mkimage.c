@@ -0,0 +1,554 @@
+// nufs-mkimage: build a nufs image from a host directory without mounting
+// it, by linking the storage layer directly.
+//
+// usage: nufs-mkimage [-j threads] [-n blocks] [-i inodes] [-x percent]
+//                     [-C] image dir
+//
+// The tree is scanned by several threads at once. The image is then sized
+// to fit it (plus -x percent of headroom, 10 by default) unless -n/-i say
+// otherwise, and built one directory at a time: every entry of a directory
+// is created in one pass, and each file gets its blocks as it's created,
+// so the files of a directory end up next to each other in the image, in
+// name order. File contents are copied straight into the image file by
+// the same threads while the rest of the tree is laid out.
+//
+// Regular files, directories, symlinks and hard links are copied; anything
+// else is skipped with a warning. An existing image is overwritten. -C
+// leaves out the block checksum table.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "storage.h"
+
+#define COPY_CHUNK (1024 * 1024)
+
+typedef struct entry {
+  char *name;
+  char *host;          // path on the host
+  struct stat st;
+  char *target;        // symlink target
+  struct entry **kids; // directory entries, sorted by name
+  int nkids;
+  int inum;            // in the image; -1 until created
+} entry_t;
+
+typedef struct copy_job {
+  const char *host;
+  storage_extent_t *exts;
+  int count;
+} copy_job_t;
+
+// the storage layer traces every call on stdout; messages go here instead
+static FILE *out;
+
+static int nthreads = 0;
+static int failed = 0;
+
+// scan: a stack of directories waiting to be read
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static entry_t **scan_stack = 0;
+static int scan_top = 0;
+static int scan_size = 0;
+static int scan_busy = 0; // directories being read right now
+
+// copy: a queue of files whose blocks are ready
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_cond = PTHREAD_COND_INITIALIZER;
+static copy_job_t *copy_jobs = 0;
+static int copy_head = 0;
+static int copy_tail = 0;
+static int copy_size = 0;
+static int copy_closed = 0;
+static long queued = 0; // bytes handed to the copy threads ...
+static long copied = 0; // ... and how many of them arrived
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *path, int err) {
+  fprintf(out, "nufs-mkimage: %s %s: %s\n", what, path, strerror(err));
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static char *join_path(const char *dir, const char *name) {
+  char *path = malloc(strlen(dir) + strlen(name) + 2);
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp((*(entry_t **)a)->name, (*(entry_t **)b)->name);
+}
+
+static void scan_push(entry_t *dir) {
+  pthread_mutex_lock(&scan_lock);
+  if (scan_top == scan_size) {
+    scan_size = scan_size ? 2 * scan_size : 64;
+    scan_stack = realloc(scan_stack, scan_size * sizeof(entry_t *));
+  }
+  scan_stack[scan_top++] = dir;
+  pthread_cond_signal(&scan_cond);
+  pthread_mutex_unlock(&scan_lock);
+}
+
+// read one directory and stat its entries; subdirectories go on the stack
+static void scan_dir(entry_t *dir) {
+  DIR *d = opendir(dir->host);
+  if (!d) {
+    fail("can't read", dir->host, errno);
+    return;
+  }
+
+  int cap = 0;
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    entry_t *e = calloc(1, sizeof(entry_t));
+    e->name = strdup(de->d_name);
+    e->host = join_path(dir->host, de->d_name);
+    e->inum = -1;
+    if (lstat(e->host, &e->st) != 0) {
+      fail("can't stat", e->host, errno);
+      free(e);
+      continue;
+    }
+
+    if (S_ISLNK(e->st.st_mode)) {
+      e->target = calloc(1, e->st.st_size + 1);
+      if (readlink(e->host, e->target, e->st.st_size) < 0) {
+        fail("can't read link", e->host, errno);
+      }
+    } else if (!S_ISREG(e->st.st_mode) && !S_ISDIR(e->st.st_mode)) {
+      fprintf(out, "nufs-mkimage: skipping special file %s\n", e->host);
+      free(e);
+      continue;
+    }
+
+    if (dir->nkids == cap) {
+      cap = cap ? 2 * cap : 16;
+      dir->kids = realloc(dir->kids, cap * sizeof(entry_t *));
+    }
+    dir->kids[dir->nkids++] = e;
+  }
+  closedir(d);
+
+  // sorted, the layout doesn't depend on which thread got there first
+  qsort(dir->kids, dir->nkids, sizeof(entry_t *), by_name);
+  for (int i = 0; i < dir->nkids; ++i) {
+    if (S_ISDIR(dir->kids[i]->st.st_mode)) {
+      scan_push(dir->kids[i]);
+    }
+  }
+}
+
+static void *scan_worker(void *arg) {
+  pthread_mutex_lock(&scan_lock);
+  for (;;) {
+    while (scan_top == 0 && scan_busy > 0) {
+      pthread_cond_wait(&scan_cond, &scan_lock);
+    }
+    if (scan_top == 0) {
+      break; // nothing queued and nobody left to queue more
+    }
+    entry_t *dir = scan_stack[--scan_top];
+    scan_busy++;
+    pthread_mutex_unlock(&scan_lock);
+
+    scan_dir(dir);
+
+    pthread_mutex_lock(&scan_lock);
+    scan_busy--;
+    if (scan_busy == 0 && scan_top == 0) {
+      pthread_cond_broadcast(&scan_cond);
+    }
+  }
+  pthread_mutex_unlock(&scan_lock);
+  return 0;
+}
+
+// blocks a file of the given size takes, indirect block included
+static long file_blocks(off_t size) {
+  long blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (blocks < 1) {
+    blocks = 1; // every inode owns its first block
+  }
+  return blocks > 2 ? blocks + 1 : blocks;
+}
+
+// add up what the tree below dir needs in the image
+static void tally(entry_t *dir, long *inodes, long *blocks) {
+  for (int i = 0; i < dir->nkids; ++i) {
+    entry_t *e = dir->kids[i];
+    *inodes += 1;
+    if (S_ISDIR(e->st.st_mode)) {
+      *blocks += 1;
+      tally(e, inodes, blocks);
+    } else if (S_ISLNK(e->st.st_mode)) {
+      *blocks += 1;
+    } else {
+      *blocks += file_blocks(e->st.st_size); // hard links count twice
+    }
+  }
+}
+
+// blocks the superblock, bitmaps, inode table, checksums and epoch table
+// of an image take (the same layout as blocks_layout())
+static long meta_blocks(long blocks, long inodes) {
+  return 1 + bytes_to_blocks((blocks + 7) / 8) +
+         bytes_to_blocks((inodes + 7) / 8) +
+         bytes_to_blocks(inodes * sizeof(inode_t)) +
+         (blocks_options.checksums ? bytes_to_blocks(blocks * 4) : 0) +
+         (blocks_options.track_changes ? bytes_to_blocks(blocks * 4) : 0);
+}
+
+static void copy_push(const char *host, storage_extent_t *exts, int count) {
+  pthread_mutex_lock(&copy_lock);
+  if (copy_tail == copy_size) {
+    copy_size = copy_size ? 2 * copy_size : 256;
+    copy_jobs = realloc(copy_jobs, copy_size * sizeof(copy_job_t));
+  }
+  copy_jobs[copy_tail++] = (copy_job_t){host, exts, count};
+  pthread_cond_signal(&copy_cond);
+  pthread_mutex_unlock(&copy_lock);
+}
+
+// copy one extent of a file, in the kernel if it can, else by hand
+static long copy_extent(int src, off_t from, int dst, off_t to, size_t size,
+                        char *buf) {
+  size_t done = 0;
+  while (done < size) {
+    loff_t in = from + done;
+    loff_t at = to + done;
+    ssize_t n = copy_file_range(src, &in, dst, &at, size - done, 0);
+    if (n < 0) {
+      break; // not between these file systems; fall back below
+    }
+    if (n == 0) {
+      return done; // the file shrank since we looked at it
+    }
+    done += n;
+  }
+
+  while (done < size) {
+    size_t want = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+    ssize_t n = pread(src, buf, want, from + done);
+    if (n <= 0) {
+      return n < 0 ? -1 : (long)done;
+    }
+    if (pwrite(dst, buf, n, to + done) != n) {
+      return -1;
+    }
+    done += n;
+  }
+  return done;
+}
+
+static void copy_file(copy_job_t *job, char *buf) {
+  int src = open(job->host, O_RDONLY);
+  if (src < 0) {
+    fail("can't open", job->host, errno);
+    return;
+  }
+
+  off_t from = 0;
+  for (int i = 0; i < job->count; ++i) {
+    long n = copy_extent(src, from, job->exts[i].fd, job->exts[i].pos,
+                         job->exts[i].size, buf);
+    if (n < 0) {
+      fail("can't copy", job->host, errno);
+      break;
+    }
+    __atomic_add_fetch(&copied, n, __ATOMIC_RELAXED);
+    from += job->exts[i].size;
+  }
+  close(src);
+
+  storage_op_begin();
+  storage_map_done(job->exts, job->count);
+  storage_op_end();
+}
+
+static void *copy_worker(void *arg) {
+  char *buf = malloc(COPY_CHUNK);
+  pthread_mutex_lock(&copy_lock);
+  for (;;) {
+    while (copy_head == copy_tail && !copy_closed) {
+      pthread_cond_wait(&copy_cond, &copy_lock);
+    }
+    if (copy_head == copy_tail) {
+      break;
+    }
+    copy_job_t job = copy_jobs[copy_head++];
+    pthread_mutex_unlock(&copy_lock);
+
+    copy_file(&job, buf);
+    free(job.exts);
+
+    pthread_mutex_lock(&copy_lock);
+  }
+  pthread_mutex_unlock(&copy_lock);
+  free(buf);
+  return 0;
+}
+
+// hard links: entries sharing a host inode, sorted so they can be found
+static entry_t **links = 0;
+static int nlinks = 0;
+
+static void collect_links(entry_t *dir) {
+  for (int i = 0; i < dir->nkids; ++i) {
+    entry_t *e = dir->kids[i];
+    if (S_ISDIR(e->st.st_mode)) {
+      collect_links(e);
+    } else if (e->st.st_nlink > 1) {
+      links = realloc(links, (nlinks + 1) * sizeof(entry_t *));
+      links[nlinks++] = e;
+    }
+  }
+}
+
+static int by_host_inode(const void *a, const void *b) {
+  const struct stat *x = &(*(entry_t **)a)->st;
+  const struct stat *y = &(*(entry_t **)b)->st;
+  if (x->st_dev != y->st_dev) {
+    return x->st_dev < y->st_dev ? -1 : 1;
+  }
+  if (x->st_ino != y->st_ino) {
+    return x->st_ino < y->st_ino ? -1 : 1;
+  }
+  return 0;
+}
+
+// the inode an earlier name of the same host file got, or -1
+static int linked_inum(entry_t *e) {
+  if (e->st.st_nlink < 2) {
+    return -1;
+  }
+  entry_t **hit = bsearch(&e, links, nlinks, sizeof(entry_t *), by_host_inode);
+  if (!hit) {
+    return -1;
+  }
+  // bsearch may land on any entry of the group; look through all of it
+  while (hit > links && by_host_inode(hit - 1, &e) == 0) {
+    hit--;
+  }
+  for (; hit < links + nlinks && by_host_inode(hit, &e) == 0; ++hit) {
+    if ((*hit)->inum >= 0) {
+      return (*hit)->inum;
+    }
+  }
+  return -1;
+}
+
+static void set_times(int inum, const struct stat *st) {
+  inode_t *node = get_inode(inum);
+  node->acc_time = st->st_atim;
+  node->mod_time = st->st_mtim;
+  node->change_time = st->st_ctim;
+}
+
+// create the entries of one directory in a single pass, then descend
+static void build_dir(entry_t *dir) {
+  for (int i = 0; i < dir->nkids; ++i) {
+    entry_t *e = dir->kids[i];
+    int len = strlen(e->name);
+    storage_op_begin();
+
+    int inum = linked_inum(e);
+    if (inum >= 0) {
+      int rv = directory_put_n(get_inode(dir->inum), e->name, len, inum);
+      if (rv < 0) {
+        fail("can't link", e->host, -rv);
+      }
+      e->inum = inum;
+      storage_op_end();
+      continue;
+    }
+
+    inum = storage_make_node(dir->inum, e->name, len, e->st.st_mode);
+    if (inum < 0) {
+      fail("can't create", e->host, -inum);
+      storage_op_end();
+      continue;
+    }
+    e->inum = inum;
+
+    if (S_ISLNK(e->st.st_mode)) {
+      storage_write_inode(inum, e->target, strlen(e->target), 0);
+    } else if (S_ISREG(e->st.st_mode) && e->st.st_size > 0) {
+      storage_extent_t *exts;
+      // the copy writes every byte, so the blocks aren't zeroed first
+      int count = storage_map_inode(inum, e->st.st_size, 0,
+                                    STORAGE_MAP_OVERWRITE, &exts);
+      if (count < 0) {
+        fail("can't allocate", e->host, -count);
+      } else {
+        queued += e->st.st_size;
+        copy_push(e->host, exts, count);
+      }
+    }
+    set_times(inum, &e->st);
+    storage_op_end();
+  }
+
+  for (int i = 0; i < dir->nkids; ++i) {
+    entry_t *e = dir->kids[i];
+    if (S_ISDIR(e->st.st_mode) && e->inum >= 0) {
+      build_dir(e);
+    }
+  }
+
+  // adding entries changed the directory's times; put the host's back
+  storage_op_begin();
+  set_times(dir->inum, &dir->st);
+  storage_op_end();
+}
+
+int main(int argc, char *argv[]) {
+  long want_blocks = 0;
+  long want_inodes = 0;
+  int headroom = 10;
+  int opt;
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "j:n:i:x:C")) != -1) {
+    switch (opt) {
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    case 'n':
+      want_blocks = atol(optarg);
+      break;
+    case 'i':
+      want_inodes = atol(optarg);
+      break;
+    case 'x':
+      headroom = atoi(optarg);
+      break;
+    case 'C':
+      blocks_options.checksums = 0;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-j threads] [-n blocks] [-i inodes] [-x percent] "
+              "[-C] image dir\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    fprintf(stderr, "usage: %s [options] image dir\n", argv[0]);
+    return 1;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  const char *image = argv[optind];
+  const char *source = argv[optind + 1];
+
+  out = fdopen(dup(2), "w");
+  setvbuf(out, 0, _IOLBF, 0);
+  if (!freopen("/dev/null", "w", stdout)) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  double start = now();
+  entry_t root = {.name = "", .host = (char *)source, .inum = 0};
+  if (stat(source, &root.st) != 0 || !S_ISDIR(root.st.st_mode)) {
+    fprintf(out, "nufs-mkimage: %s isn't a directory\n", source);
+    return 1;
+  }
+
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  scan_push(&root);
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_create(&threads[i], 0, scan_worker, 0);
+  }
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], 0);
+  }
+  double scanned = now();
+
+  long inodes = 1; // the root
+  long blocks = 1;
+  tally(&root, &inodes, &blocks);
+  long files = inodes - 1;
+
+  if (want_inodes <= 0) {
+    want_inodes = inodes + inodes * headroom / 100 + 64;
+  }
+  if (want_blocks <= 0) {
+    want_blocks = blocks + blocks * headroom / 100 + 64;
+    long meta = 0;
+    for (int i = 0; i < 3; ++i) { // the bitmap grows with the image
+      meta = meta_blocks(want_blocks + meta, want_inodes);
+    }
+    want_blocks += meta;
+  }
+  if (want_blocks > INT_MAX || want_inodes > INT_MAX / sizeof(inode_t)) {
+    fprintf(out, "nufs-mkimage: %s is too big for one image\n", source);
+    return 1;
+  }
+
+  collect_links(&root);
+  qsort(links, nlinks, sizeof(entry_t *), by_host_inode);
+
+  unlink(image);
+  blocks_options.format_blocks = want_blocks;
+  blocks_options.format_inodes = want_inodes;
+  storage_init(image);
+
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_create(&threads[i], 0, copy_worker, 0);
+  }
+
+  storage_op_begin();
+  get_inode(0)->mode = root.st.st_mode;
+  storage_op_end();
+  build_dir(&root);
+
+  pthread_mutex_lock(&copy_lock);
+  copy_closed = 1;
+  pthread_cond_broadcast(&copy_cond);
+  pthread_mutex_unlock(&copy_lock);
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], 0);
+  }
+
+  storage_sync();
+  storage_free();
+
+  double secs = now() - start;
+  fprintf(out,
+          "%ld entries, %ld bytes copied in %.3f s (scan %.3f s), "
+          "%.1f MB/s\n",
+          files, copied, secs, scanned - start,
+          copied / secs / (1024 * 1024));
+  fprintf(out, "image: %ld blocks, %ld inodes\n", want_blocks, want_inodes);
+  if (copied != queued) {
+    fprintf(out, "nufs-mkimage: %ld bytes short; did files shrink?\n",
+            queued - copied);
+  }
+  return failed;
+}
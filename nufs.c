@@ -12,16 +12,128 @@
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <stddef.h>
 
+#include "defrag.h"
 #include "directory.h"
+#include "nufs_ioctl.h"
+#include "orphan.h"
+#include "scrub.h"
 #include "storage.h"
+#include "tier.h"
+#include "trace.h"
 
 const int XS_CONST = 126;
 
+// nufs-specific mount options, parsed out of the -o list before fuse_main
+struct nufs_config {
+  int atime_mode;
+  char *backend;
+  int cache_blocks;
+  int readahead;
+  int map_window;
+  int map_budget;
+  int write_buffer;
+  int discard;
+  int checksums;
+  int track_changes;
+  int scrub_rate;
+  char *trace;
+  int scratch_mb;
+  int hugepages;
+  char *slow_image;
+  int fast_blocks;
+  int slow_blocks;
+  int tier_interval;
+  int defrag_rate;
+  char *stripe;
+  int stripe_unit;
+};
+
+static struct nufs_config nufs_config = {
+    .atime_mode = ATIME_RELATIME,
+    .backend = "mmap",
+    .cache_blocks = 1024,
+    .readahead = 16,
+    .map_window = 256,
+    .map_budget = 1024,
+    .write_buffer = 0,
+    .discard = 1,
+    .checksums = 1,
+    .track_changes = 1,
+    .scrub_rate = 0,
+    .trace = 0,
+    .scratch_mb = 0,
+    .hugepages = 0,
+    .slow_image = 0,
+    .fast_blocks = 0,
+    .slow_blocks = 0,
+    .tier_interval = 30,
+    .defrag_rate = 0,
+    .stripe = 0,
+    .stripe_unit = 16,
+};
+
+// how long the kernel may cache lookups and attributes (seconds). Changes
+// made through the mount go through the kernel, which updates or drops
+// what it cached (see nufs_open() for file contents), except those made by
+// NUFS_IOC_RMTREE and NUFS_IOC_BATCH: what they change may look unchanged
+// until these run out.
+#define NUFS_DEFAULT_TIMEOUTS "entry_timeout=10,attr_timeout=10"
+
+// let the kernel send 128K reads and writes instead of 4K ones; that is
+// as much as FUSE 2.x will take per request
+#define NUFS_DEFAULT_IO "big_writes,max_write=131072,max_read=131072"
+
+// unlink files that are still open for real instead of renaming them to
+// .fuse_hidden*; the handle keeps the contents around (see orphan.h) and
+// callbacks on it get a NULL path
+#define NUFS_DEFAULT_REMOVE "hard_remove"
+
+#define NUFS_OPT(t, p, v) {t, offsetof(struct nufs_config, p), v}
+
+static struct fuse_opt nufs_opts[] = {
+    NUFS_OPT("strictatime", atime_mode, ATIME_STRICT),
+    NUFS_OPT("relatime", atime_mode, ATIME_RELATIME),
+    NUFS_OPT("noatime", atime_mode, ATIME_NOATIME),
+    NUFS_OPT("backend=%s", backend, 0),
+    NUFS_OPT("cache_blocks=%d", cache_blocks, 0),
+    NUFS_OPT("readahead=%d", readahead, 0),
+    NUFS_OPT("map_window=%d", map_window, 0),
+    NUFS_OPT("map_budget=%d", map_budget, 0),
+    NUFS_OPT("write_buffer=%d", write_buffer, 0),
+    NUFS_OPT("discard", discard, 1),
+    NUFS_OPT("nodiscard", discard, 0),
+    NUFS_OPT("checksums", checksums, 1),
+    NUFS_OPT("nochecksums", checksums, 0),
+    NUFS_OPT("track_changes", track_changes, 1),
+    NUFS_OPT("notrack_changes", track_changes, 0),
+    NUFS_OPT("scrub_rate=%d", scrub_rate, 0),
+    NUFS_OPT("trace=%s", trace, 0),
+    NUFS_OPT("scratch=%d", scratch_mb, 0),
+    NUFS_OPT("hugepages", hugepages, 1),
+    NUFS_OPT("slow_image=%s", slow_image, 0),
+    NUFS_OPT("fast_blocks=%d", fast_blocks, 0),
+    NUFS_OPT("slow_blocks=%d", slow_blocks, 0),
+    NUFS_OPT("tier_interval=%d", tier_interval, 0),
+    NUFS_OPT("defrag_rate=%d", defrag_rate, 0),
+    NUFS_OPT("stripe=%s", stripe, 0),
+    NUFS_OPT("stripe_unit=%d", stripe_unit, 0),
+    FUSE_OPT_END,
+};
+
+// the path to show for a callback on a file handle, whose file may have
+// been unlinked since it was opened
+static const char *shown(const char *path) {
+  return path ? path : "(unlinked)";
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
+  storage_op_begin();
   int rv = storage_can_find(path);
+  storage_op_end();
 
   printf("access(%s, %04o) -> %d\n", path, mask, rv);
   return rv;
@@ -31,7 +143,9 @@ int nufs_access(const char *path, int mask) {
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
+  storage_op_begin();
   int rv = storage_stat(path, st);
+  storage_op_end();
 
   printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
          st->st_size);
@@ -46,6 +160,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   char item_path[128];
   int rv;
 
+  storage_op_begin();
   slist_t *items = directory_list(path);
   for (slist_t *xs = items; xs != 0; xs = xs->next) {
     printf("+ viewing path: '%s'\n", xs->data);
@@ -74,6 +189,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, xs->data, &st, 0);
   }
   s_free(items);
+  storage_op_end();
 
   printf("readdir(%s) -> %d\n", path, rv);
   return 0;
@@ -84,7 +200,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // Note, for this assignment, you can alternatively implement the create
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+  storage_op_begin();
   int rv = storage_mknod(path, mode);
+  storage_op_end();
   printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
@@ -98,114 +216,235 @@ int nufs_mkdir(const char *path, mode_t mode) {
 }
 
 int nufs_unlink(const char *path) {
+  storage_op_begin();
   int rv = storage_unlink(path);
+  storage_op_end();
   printf("unlink(%s) -> %d\n", path, rv);
   return rv;
 }
 
 int nufs_link(const char *from, const char *to) {
+  storage_op_begin();
   int rv = storage_link(to, from);
+  storage_op_end();
   printf("link(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path) {
-  inode_t *node = get_inode(filesys_lookup(path));
-  int mode = node->mode;
-  if (mode != 040755) {
-    printf("rmdir(%s) -> %d\n", path, -1);
-    return -1;
-  }
-
-  char *data = blocks_get_block(node->pointers[0]);
-  char *text = data;
-
-  for (int i = 0; i < node->entries; i++) {
-    // alloca?
-    char *path_full = malloc(strlen(path) + strlen(text) + 2);
-    // Check memory allocation
-    if (!path_full) {
-      printf("Error allocating path memory\n");
-      return -1;
-    }
-    char *pos = path_full;
-    memcpy(pos, path, strlen(path));
-    pos += strlen(path);
-    if (strcmp(path, "/") != 0) {
-      pos[0] = '/';
-      pos += 1;
-    }
-    memcpy(pos, text, strlen(text) + 1);
-
-    nufs_unlink(path_full);
-    text = process_string(text);
-    text += 4;
-  }
-  int rv = nufs_unlink(path);
+  storage_op_begin();
+  int rv = storage_rmdir(path);
+  storage_op_end();
   printf("rmdir(%s) -> %d\n", path, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
+// (the FUSE 2 API carries no renameat2() flags, so this is a plain rename)
 int nufs_rename(const char *from, const char *to) {
-  int rv = storage_rename(from, to);
+  storage_op_begin();
+  int rv = storage_rename(from, to, 0);
+  storage_op_end();
   printf("rename(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
-  int rv = -1;
-  int inum = filesys_lookup(path);
-  inode_t *node = get_inode(inum);
-
-  if (node->mode == mode) {
-    return 0;
-  } else {
-    shrink_inode(node, 0);
-    node->mode = mode;
-    rv = 0;
-  }
-
+  storage_op_begin();
+  int rv = storage_chmod(path, mode);
+  storage_op_end();
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
 
 int nufs_truncate(const char *path, off_t size) {
+  storage_op_begin();
   int rv = storage_truncate(path, size);
+  storage_op_end();
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
 }
 
+// Preallocate, punch holes in or zero a range of a file
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi) {
+  if (!path) {
+    return -ENOENT; // unlinked while open
+  }
+  storage_op_begin();
+  int rv = storage_fallocate(path, mode, offset, length);
+  storage_op_end();
+  printf("fallocate(%s, %#x, %ld bytes, @+%ld) -> %d\n", path, mode, length,
+         offset, rv);
+  return rv;
+}
+
 // This is called on open, but doesn't need to do much
 // since FUSE doesn't assume you maintain state for
 // open files.
 // You can just check whether the file is accessible.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = nufs_access(path, 0);
+  int keep_cache;
+  storage_op_begin();
+  int rv = storage_open(path, &keep_cache);
+  storage_op_end();
+  if (rv >= 0) {
+    fi->fh = rv; // see storage_open()
+    // unchanged since the kernel last read it: keep the page cache
+    fi->keep_cache = keep_cache;
+    rv = 0;
+  }
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
 
+// Write out what the file handle buffered; called on every close()
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  storage_op_begin();
+  int rv = storage_flush(fi->fh);
+  storage_op_end();
+  printf("flush(%s) -> %d\n", shown(path), rv);
+  return rv;
+}
+
+// The last reference to an open file went away
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  storage_op_begin();
+  int rv = storage_release(fi->fh);
+  storage_op_end();
+  printf("release(%s) -> %d\n", shown(path), rv);
+  return rv;
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  storage_op_begin();
+  int rv = fi->fh ? storage_read_handle(fi->fh, buf, size, offset)
+                  : storage_read(path, buf, size, offset);
+  storage_op_end();
+  printf("read(%s, %ld bytes, @+%ld) -> %d\n", shown(path), size, offset,
+         rv);
   return rv;
 }
 
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int rv = storage_write(path, buf, size, offset);
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  storage_op_begin();
+  int rv = fi->fh ? storage_write_handle(fi->fh, buf, size, offset)
+                  : storage_write(path, buf, size, offset);
+  storage_op_end();
+  printf("write(%s, %ld bytes, @+%ld) -> %d\n", shown(path), size, offset,
+         rv);
+  return rv;
+}
+
+// zeros for FUSE to read holes from, grown to the largest hole seen
+static void *nufs_zeros(size_t size) {
+  static void *zeros = 0;
+  static size_t have = 0;
+  if (size > have) {
+    free(zeros);
+    zeros = calloc(1, size);
+    have = size;
+  }
+  return zeros;
+}
+
+// a bufvec over pieces of the image files; with no extents, one empty buffer
+static struct fuse_bufvec *nufs_image_bufvec(storage_extent_t *exts,
+                                             int count) {
+  int bufs = count > 0 ? count : 1;
+  struct fuse_bufvec *bv =
+      malloc(sizeof(struct fuse_bufvec) + (bufs - 1) * sizeof(struct fuse_buf));
+  *bv = FUSE_BUFVEC_INIT(0);
+  bv->count = bufs;
+
+  size_t hole = 0;
+  for (int i = 0; i < count; ++i) {
+    if (exts[i].pos < 0 && exts[i].size > hole) {
+      hole = exts[i].size;
+    }
+  }
+  void *zeros = hole ? nufs_zeros(hole) : NULL;
+
+  for (int i = 0; i < count; ++i) {
+    bv->buf[i].size = exts[i].size;
+    if (exts[i].pos < 0) { // a hole
+      bv->buf[i].flags = 0;
+      bv->buf[i].mem = zeros;
+      continue;
+    }
+    bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bv->buf[i].mem = NULL;
+    bv->buf[i].fd = exts[i].fd;
+    bv->buf[i].pos = exts[i].pos;
+  }
+  return bv;
+}
+
+// Read data by pointing FUSE at where it lives in the image, so it can
+// be spliced to the kernel without passing through our memory
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  storage_extent_t *exts;
+  storage_op_begin();
+  int rv = fi->fh ? storage_map_handle(fi->fh, size, offset, 0, &exts)
+                  : storage_map(path, size, offset, 0, &exts);
+  storage_op_end();
+  if (rv >= 0) {
+    *bufp = nufs_image_bufvec(exts, rv);
+    free(exts);
+  }
+  printf("read_buf(%s, %ld bytes, @+%ld) -> %d\n", shown(path), size, offset,
+         rv);
+  return rv < 0 ? rv : 0;
+}
+
+// Write data by letting FUSE move it straight into the image
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(buf);
+  if (fi->fh && size < nufs_config.write_buffer) {
+    // small enough to be merged in the handle's buffer
+    char *data = malloc(size);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = data;
+    int rv = fuse_buf_copy(&dst, buf, 0);
+    if (rv >= 0) {
+      rv = nufs_write(path, data, rv, offset, fi);
+    }
+    free(data);
+    return rv;
+  }
+
+  // one operation throughout: while the image file is being written, the
+  // background threads mustn't read (or cache, or move) those blocks
+  storage_extent_t *exts;
+  storage_op_begin();
+  int rv = fi->fh ? storage_map_handle(fi->fh, size, offset, 1, &exts)
+                  : storage_map(path, size, offset, 1, &exts);
+  if (rv >= 0) {
+    int count = rv;
+    struct fuse_bufvec *dst = nufs_image_bufvec(exts, count);
+    rv = fuse_buf_copy(dst, buf, 0);
+    storage_map_done(exts, count);
+    free(dst);
+    free(exts);
+  }
+  storage_op_end();
+  printf("write_buf(%s, %ld bytes, @+%ld) -> %d\n", shown(path), size,
+         offset, rv);
   return rv;
 }
 
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  storage_op_begin();
   int rv = storage_set_time(path, ts);
+  storage_op_end();
   printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
          ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
   return rv;
@@ -214,24 +453,372 @@ int nufs_utimens(const char *path, const struct timespec ts[2]) {
 // Extended operations
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = 0;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  int rv;
+  if (cmd == NUFS_IOC_DEFRAG) {
+    defrag_pass(); // in batches of its own, not under this operation
+  }
+  storage_op_begin();
+  switch (cmd) {
+  case NUFS_IOC_RMTREE:
+    rv = path ? storage_rmtree(path) : -ENOENT;
+    break;
+  case NUFS_IOC_BATCH:
+    rv = path ? storage_batch(path, data) : -ENOENT;
+    break;
+  case NUFS_IOC_CSUM_STATS: {
+    struct nufs_csum_stats *st = data;
+    st->verified = blocks_csum_stats.verified;
+    st->errors = blocks_csum_stats.errors;
+    st->scrubbed = blocks_csum_stats.scrubbed;
+    st->scrub_errors = blocks_csum_stats.scrub_errors;
+    st->scrub_passes = blocks_csum_stats.scrub_passes;
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_TIER_STATS: {
+    struct nufs_tier_stats *st = data;
+    st->fast_hits = blocks_tier_stats.fast_hits;
+    st->slow_hits = blocks_tier_stats.slow_hits;
+    st->demoted = blocks_tier_stats.demoted;
+    st->promoted = blocks_tier_stats.promoted;
+    st->passes = blocks_tier_stats.passes;
+    st->fast_free = blocks_tier_free(TIER_FAST);
+    st->slow_free = blocks_tier_free(TIER_SLOW);
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_FRAG_STATS:
+  case NUFS_IOC_DEFRAG: {
+    struct nufs_frag_stats *st = data;
+    defrag_stats_t ds;
+    defrag_survey(&ds);
+    st->files = ds.files;
+    st->fragmented = ds.fragmented;
+    st->runs = ds.runs;
+    st->blocks = ds.blocks;
+    st->moved = ds.moved;
+    st->defragmented = ds.defragmented;
+    st->skipped = ds.skipped;
+    st->passes = ds.passes;
+    long counts[NUFS_FREE_BUCKETS];
+    st->free_blocks = blocks_free_histogram(counts, NUFS_FREE_BUCKETS);
+    for (int b = 0; b < NUFS_FREE_BUCKETS; ++b) {
+      st->free_runs[b] = counts[b];
+    }
+    rv = 0;
+    break;
+  }
+  default:
+    rv = -ENOTTY;
+  }
+  storage_op_end();
+  printf("ioctl(%s, %d, ...) -> %d\n", shown(path), cmd, rv);
   return rv;
 }
 
 // Makes a symlink between the two given locations
 int nufs_symlink(const char *to, const char *from) {
+  storage_op_begin();
   int rv = storage_mknod(from, 0120000);
-  if (rv < 0) {
-    return rv;
+  if (rv == 0) {
+    storage_write(from, to, strlen(to), 0);
   }
-  storage_write(from, to, strlen(to), 0);
-  return 0;
+  storage_op_end();
+  return rv;
 }
 
 // Reads a link
 int nufs_readlink(const char *path, char *buf, size_t size) {
-  return storage_read(path, buf, size, 0);
+  storage_op_begin();
+  int rv = storage_read(path, buf, size, 0);
+  storage_op_end();
+  return rv;
+}
+
+// Flush everything to the image on fsync().
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  storage_op_begin();
+  int rv = storage_flush(fi ? fi->fh : 0);
+  storage_sync();
+  storage_op_end();
+  printf("fsync(%s) -> %d\n", shown(path), rv);
+  return rv;
+}
+
+// Start background work once FUSE is running (and has daemonized, which
+// would leave threads started before behind).
+void *nufs_init(struct fuse_conn_info *conn) {
+  int rv = scrub_start(nufs_config.scrub_rate);
+  if (rv < 0) {
+    fprintf(stderr, "nufs: can't start the scrubber: %s\n", strerror(-rv));
+  }
+  int rv2 = orphan_start();
+  if (rv2 < 0) {
+    // unlinked files are then freed within unlink itself
+    fprintf(stderr, "nufs: can't start the reclaimer: %s\n", strerror(-rv2));
+  }
+  int rv3 = tier_start(nufs_config.tier_interval);
+  if (rv3 < 0) {
+    // everything new still goes to the fast tier while it has room
+    fprintf(stderr, "nufs: can't start the migrator: %s\n", strerror(-rv3));
+  }
+  int rv4 = defrag_start(nufs_config.defrag_rate);
+  if (rv4 < 0) {
+    fprintf(stderr, "nufs: can't start the defragmenter: %s\n",
+            strerror(-rv4));
+  }
+  printf("init() -> %d, %d, %d, %d\n", rv, rv2, rv3, rv4);
+  return 0;
+}
+
+// Write everything back and close the image on unmount.
+void nufs_destroy(void *private_data) {
+  scrub_stop();
+  orphan_stop();
+  tier_stop();
+  defrag_stop();
+  storage_free();
+  trace_close();
+  printf("destroy()\n");
+}
+
+// With -o trace=FILE, every callback goes through one of these, which
+// time it and append a record to the trace (see trace.h).
+#define TRACE_START(o)                                                         \
+  trace_record_t rec = {.op = (o)};                                            \
+  rec.start_ns = trace_clock()
+
+static int traced_access(const char *path, int mask) {
+  TRACE_START(TRACE_ACCESS);
+  rec.mode = mask;
+  rec.result = nufs_access(path, mask);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_getattr(const char *path, struct stat *st) {
+  TRACE_START(TRACE_GETATTR);
+  rec.result = nufs_getattr(path, st);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_READDIR);
+  rec.result = nufs_readdir(path, buf, filler, offset, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_mknod(const char *path, mode_t mode, dev_t rdev) {
+  TRACE_START(TRACE_MKNOD);
+  rec.mode = mode;
+  rec.result = nufs_mknod(path, mode, rdev);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_mkdir(const char *path, mode_t mode) {
+  TRACE_START(TRACE_MKDIR);
+  rec.mode = mode;
+  rec.result = nufs_mkdir(path, mode);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_unlink(const char *path) {
+  TRACE_START(TRACE_UNLINK);
+  rec.result = nufs_unlink(path);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_link(const char *from, const char *to) {
+  TRACE_START(TRACE_LINK);
+  rec.result = nufs_link(from, to);
+  trace_log(&rec, from, to);
+  return rec.result;
+}
+
+static int traced_rmdir(const char *path) {
+  TRACE_START(TRACE_RMDIR);
+  rec.result = nufs_rmdir(path);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_rename(const char *from, const char *to) {
+  TRACE_START(TRACE_RENAME);
+  rec.result = nufs_rename(from, to);
+  trace_log(&rec, from, to);
+  return rec.result;
+}
+
+static int traced_chmod(const char *path, mode_t mode) {
+  TRACE_START(TRACE_CHMOD);
+  rec.mode = mode;
+  rec.result = nufs_chmod(path, mode);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_truncate(const char *path, off_t size) {
+  TRACE_START(TRACE_TRUNCATE);
+  rec.size = size;
+  rec.result = nufs_truncate(path, size);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_fallocate(const char *path, int mode, off_t offset,
+                            off_t length, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_FALLOCATE);
+  rec.mode = mode;
+  rec.offset = offset;
+  rec.size = length;
+  rec.result = nufs_fallocate(path, mode, offset, length, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_OPEN);
+  rec.result = nufs_open(path, fi);
+  rec.fh = fi->fh;
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_flush(const char *path, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_FLUSH);
+  rec.fh = fi->fh;
+  rec.result = nufs_flush(path, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_RELEASE);
+  rec.fh = fi->fh;
+  rec.result = nufs_release(path, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+  TRACE_START(TRACE_READ);
+  rec.fh = fi->fh;
+  rec.offset = offset;
+  rec.size = size;
+  rec.result = nufs_read(path, buf, size, offset, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_write(const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_WRITE);
+  rec.fh = fi->fh;
+  rec.offset = offset;
+  rec.size = size;
+  rec.result = nufs_write(path, buf, size, offset, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_read_buf(const char *path, struct fuse_bufvec **bufp,
+                           size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+  TRACE_START(TRACE_READ_BUF);
+  rec.fh = fi->fh;
+  rec.offset = offset;
+  rec.size = size;
+  rec.result = nufs_read_buf(path, bufp, size, offset, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_write_buf(const char *path, struct fuse_bufvec *buf,
+                            off_t offset, struct fuse_file_info *fi) {
+  TRACE_START(TRACE_WRITE_BUF);
+  rec.fh = fi->fh;
+  rec.offset = offset;
+  rec.size = fuse_buf_size(buf);
+  rec.result = nufs_write_buf(path, buf, offset, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_utimens(const char *path, const struct timespec ts[2]) {
+  TRACE_START(TRACE_UTIMENS);
+  rec.offset = ts[0].tv_sec; // access and modification time, in seconds
+  rec.size = ts[1].tv_sec;
+  rec.result = nufs_utimens(path, ts);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_ioctl(const char *path, int cmd, void *arg,
+                        struct fuse_file_info *fi, unsigned int flags,
+                        void *data) {
+  TRACE_START(TRACE_IOCTL);
+  rec.mode = cmd;
+  rec.result = nufs_ioctl(path, cmd, arg, fi, flags, data);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_symlink(const char *to, const char *from) {
+  TRACE_START(TRACE_SYMLINK);
+  rec.result = nufs_symlink(to, from);
+  trace_log(&rec, from, to);
+  return rec.result;
+}
+
+static int traced_readlink(const char *path, char *buf, size_t size) {
+  TRACE_START(TRACE_READLINK);
+  rec.size = size;
+  rec.result = nufs_readlink(path, buf, size);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static int traced_fsync(const char *path, int datasync,
+                        struct fuse_file_info *fi) {
+  TRACE_START(TRACE_FSYNC);
+  rec.fh = fi ? fi->fh : 0;
+  rec.result = nufs_fsync(path, datasync, fi);
+  trace_log(&rec, path, 0);
+  return rec.result;
+}
+
+static void nufs_trace_ops(struct fuse_operations *ops) {
+  ops->access = traced_access;
+  ops->getattr = traced_getattr;
+  ops->readdir = traced_readdir;
+  ops->mknod = traced_mknod;
+  ops->mkdir = traced_mkdir;
+  ops->link = traced_link;
+  ops->unlink = traced_unlink;
+  ops->rmdir = traced_rmdir;
+  ops->rename = traced_rename;
+  ops->chmod = traced_chmod;
+  ops->truncate = traced_truncate;
+  ops->fallocate = traced_fallocate;
+  ops->open = traced_open;
+  ops->read = traced_read;
+  ops->write = traced_write;
+  ops->read_buf = traced_read_buf;
+  ops->write_buf = traced_write_buf;
+  ops->utimens = traced_utimens;
+  ops->ioctl = traced_ioctl;
+  ops->readlink = traced_readlink;
+  ops->symlink = traced_symlink;
+  ops->fsync = traced_fsync;
+  ops->flush = traced_flush;
+  ops->release = traced_release;
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
@@ -247,20 +834,74 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->rename = nufs_rename;
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
+  ops->fallocate = nufs_fallocate;
   ops->open = nufs_open;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->read_buf = nufs_read_buf;
+  ops->write_buf = nufs_write_buf;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
   ops->readlink = nufs_readlink;
   ops->symlink = nufs_symlink;
+  ops->fsync = nufs_fsync;
+  ops->flush = nufs_flush;
+  ops->release = nufs_release;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
+  // files unlinked while open are still read and written through their
+  // handle (see NUFS_DEFAULT_REMOVE)
+  ops->flag_nullpath_ok = 1;
 };
 
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
+  assert(argc > 2);
+  const char *image_path = argv[--argc];
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &nufs_config, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+  // our defaults go first so options given on the command line win
+  fuse_opt_insert_arg(&args, 1,
+                      "-o" NUFS_DEFAULT_TIMEOUTS "," NUFS_DEFAULT_IO
+                      "," NUFS_DEFAULT_REMOVE);
+
+  blocks_options.backend = nufs_config.backend;
+  blocks_options.cache_blocks = nufs_config.cache_blocks;
+  blocks_options.readahead = nufs_config.readahead;
+  blocks_options.map_window = nufs_config.map_window;
+  blocks_options.map_budget = nufs_config.map_budget;
+  blocks_options.discard = nufs_config.discard;
+  blocks_options.checksums = nufs_config.checksums;
+  blocks_options.track_changes = nufs_config.track_changes;
+  blocks_options.hugepages = nufs_config.hugepages;
+  blocks_options.slow_image = nufs_config.slow_image;
+  blocks_options.slow_blocks = nufs_config.slow_blocks;
+  if (nufs_config.fast_blocks > 0) {
+    blocks_options.format_blocks = nufs_config.fast_blocks;
+  }
+  blocks_options.stripe_images = nufs_config.stripe;
+  blocks_options.stripe_unit = nufs_config.stripe_unit;
+  if (nufs_config.scratch_mb > 0) {
+    // the image argument is ignored
+    blocks_options.scratch = 1;
+    blocks_options.format_blocks = nufs_config.scratch_mb * 256;
+  }
+  storage_init(image_path);
+  inode_set_atime_mode(nufs_config.atime_mode);
+  storage_set_write_buffer(nufs_config.write_buffer);
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  if (nufs_config.trace) {
+    // opened now: FUSE changes to / when it daemonizes
+    int rv = trace_open(nufs_config.trace, nufs_config.write_buffer);
+    if (rv < 0) {
+      fprintf(stderr, "%s: %s\n", nufs_config.trace, strerror(-rv));
+      return 1;
+    }
+    nufs_trace_ops(&nufs_ops);
+  }
+  return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
@@ -0,0 +1,84 @@
+/**
+ * @file nufs_batch.c
+ *
+ * Client side of NUFS_IOC_BATCH; see nufs_batch.h.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "nufs_batch.h"
+
+void nufs_batch_init(struct nufs_batch *batch) {
+  batch->count = 0;
+  batch->bytes = 0;
+}
+
+// append an operation with room for its name and data, or return NULL
+static struct nufs_batch_op *batch_add(struct nufs_batch *batch, int opcode,
+                                       const char *name, const void *data,
+                                       size_t size) {
+  size_t name_len = strlen(name);
+  if (name_len > UINT16_MAX) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  if (size > NUFS_BATCH_BYTES ||
+      NUFS_BATCH_OP_SIZE(name_len, size) > NUFS_BATCH_BYTES - batch->bytes) {
+    errno = ENOSPC;
+    return 0;
+  }
+
+  struct nufs_batch_op *op = (void *)(batch->ops + batch->bytes);
+  memset(op, 0, sizeof(*op));
+  op->op = opcode;
+  op->name_len = name_len;
+  op->data_len = size;
+  memcpy(op + 1, name, name_len);
+  if (size > 0) {
+    memcpy((char *)(op + 1) + name_len, data, size);
+  }
+  batch->count++;
+  batch->bytes += NUFS_BATCH_OP_SIZE(name_len, size);
+  return op;
+}
+
+struct nufs_batch_op *nufs_batch_create(struct nufs_batch *batch,
+                                        const char *name, mode_t mode,
+                                        const void *data, size_t size) {
+  struct nufs_batch_op *op =
+      batch_add(batch, NUFS_BATCH_CREATE, name, data, size);
+  if (op) {
+    op->mode = mode;
+  }
+  return op;
+}
+
+struct nufs_batch_op *nufs_batch_write(struct nufs_batch *batch,
+                                       const char *name, off_t offset,
+                                       const void *data, size_t size) {
+  struct nufs_batch_op *op =
+      batch_add(batch, NUFS_BATCH_WRITE, name, data, size);
+  if (op) {
+    op->offset = offset;
+  }
+  return op;
+}
+
+struct nufs_batch_op *nufs_batch_stat(struct nufs_batch *batch,
+                                      const char *name) {
+  return batch_add(batch, NUFS_BATCH_STAT, name, 0, 0);
+}
+
+struct nufs_batch_op *nufs_batch_unlink(struct nufs_batch *batch,
+                                        const char *name) {
+  return batch_add(batch, NUFS_BATCH_UNLINK, name, 0, 0);
+}
+
+int nufs_batch_run(int dirfd, struct nufs_batch *batch) {
+  int rv = batch->count > 0 ? ioctl(dirfd, NUFS_IOC_BATCH, batch) : 0;
+  batch->count = 0;
+  batch->bytes = 0;
+  return rv < 0 ? -1 : 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file nufs_batch.h
+ *
+ * Client side of NUFS_IOC_BATCH: build a batch of creates, small writes,
+ * stats and unlinks on the files of one directory, then run it in a
+ * single round trip to the file system.
+ *
+ *     struct nufs_batch batch;
+ *     nufs_batch_init(&batch);
+ *     struct nufs_batch_op *op;
+ *     op = nufs_batch_create(&batch, "a", 0644, "hi", 2);
+ *     ...
+ *     nufs_batch_run(dirfd, &batch); // then look at op->result
+ *
+ * Like nufs_ioctl.h, this is meant to be used by client programs, and
+ * nufs_batch.c doesn't depend on the rest of nufs.
+ *
+ * A batch goes around the kernel's lookup and attribute caches: for up to
+ * the mount's entry_timeout and attr_timeout, other system calls may still
+ * find files it unlinked and see the old size and contents of files it
+ * wrote. See NUFS_IOC_BATCH.
+ */
+#ifndef NUFS_BATCH_H
+#define NUFS_BATCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "nufs_ioctl.h"
+
+/**
+ * Empty a batch, to start building it.
+ */
+void nufs_batch_init(struct nufs_batch *batch);
+
+/**
+ * Add an operation that creates a regular file and writes size bytes of
+ * data to it (size may be 0).
+ *
+ * @return The operation, whose result is filled in when the batch runs;
+ *         NULL with errno set to ENOSPC if the batch is full (run it and
+ *         start another), or to ENAMETOOLONG.
+ */
+struct nufs_batch_op *nufs_batch_create(struct nufs_batch *batch,
+                                        const char *name, mode_t mode,
+                                        const void *data, size_t size);
+
+/**
+ * Add an operation that writes size bytes of data at offset; its result
+ * is the number of bytes written. Returns as nufs_batch_create().
+ */
+struct nufs_batch_op *nufs_batch_write(struct nufs_batch *batch,
+                                       const char *name, off_t offset,
+                                       const void *data, size_t size);
+
+/**
+ * Add an operation that fills in the mode, size, ino, nlink and mtime_ns
+ * of the operation with the file's attributes. Returns as
+ * nufs_batch_create().
+ */
+struct nufs_batch_op *nufs_batch_stat(struct nufs_batch *batch,
+                                      const char *name);
+
+/**
+ * Add an operation that removes a file (not a directory). Returns as
+ * nufs_batch_create().
+ */
+struct nufs_batch_op *nufs_batch_unlink(struct nufs_batch *batch,
+                                        const char *name);
+
+/**
+ * Run a batch on the directory open as dirfd, then empty it so it can be
+ * filled again; the operations' results stay readable until then.
+ *
+ * @return 0, or -1 with errno set if the ioctl failed (ENOTTY if dirfd
+ *         isn't on a nufs volume); the operations can fail on their own.
+ */
+int nufs_batch_run(int dirfd, struct nufs_batch *batch);
+
+#endif
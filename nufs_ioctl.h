@@ -0,0 +1,160 @@
+/**
+ * @file nufs_ioctl.h
+ *
+ * ioctl commands understood by a mounted nufs file system.
+ *
+ * This header is meant to be included by client programs as well.
+ */
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * Remove everything below the directory the ioctl is issued on.
+ *
+ * The directory itself stays (empty), so `rm -rf dir` becomes this ioctl
+ * followed by a single rmdir(2).
+ */
+#define NUFS_IOC_RMTREE _IO('N', 1)
+
+/**
+ * What block checksum verification has found since the volume was
+ * mounted (all zero if the image has no checksums).
+ */
+struct nufs_csum_stats {
+  uint64_t verified;     // blocks checked on first use
+  uint64_t errors;       // ... that didn't match their checksum
+  uint64_t scrubbed;     // blocks checked by the background scrubber
+  uint64_t scrub_errors; // ... that didn't match
+  uint64_t scrub_passes; // complete passes over the image
+};
+
+/**
+ * Read the checksum statistics; may be issued on any file or directory.
+ */
+#define NUFS_IOC_CSUM_STATS _IOR('N', 2, struct nufs_csum_stats)
+
+/**
+ * How file data was served by the tiers of a two-tier volume since it
+ * was mounted, and what the migrator has moved (all zero but fast_hits
+ * without a slow tier).
+ */
+struct nufs_tier_stats {
+  uint64_t fast_hits;   // file blocks read or written on the fast tier
+  uint64_t slow_hits;   // ... on the slow tier
+  uint64_t demoted;     // blocks moved to the slow tier
+  uint64_t promoted;    // blocks moved to the fast tier
+  uint64_t passes;      // migrator passes over the files
+  uint64_t fast_free;   // free blocks on the fast tier
+  uint64_t slow_free;   // ... on the slow tier
+};
+
+/**
+ * Read the tier statistics; may be issued on any file or directory.
+ */
+#define NUFS_IOC_TIER_STATS _IOR('N', 3, struct nufs_tier_stats)
+
+// Operations of a batch (see NUFS_IOC_BATCH).
+enum nufs_batch_opcode {
+  NUFS_BATCH_CREATE = 1, // create a file, writing data_len bytes to it
+  NUFS_BATCH_WRITE,      // write data_len bytes at offset
+  NUFS_BATCH_STAT,       // fill in the attributes
+  NUFS_BATCH_UNLINK,     // remove a file
+};
+
+/**
+ * One operation of a batch, followed by name_len bytes of name (a single
+ * path component, no NUL) and data_len bytes of data. The next operation
+ * starts at the next multiple of 8 bytes (NUFS_BATCH_OP_SIZE).
+ */
+struct nufs_batch_op {
+  uint16_t op;       // enum nufs_batch_opcode
+  uint16_t name_len;
+  uint32_t data_len;
+  int32_t result;    // filled in: 0 (bytes written for WRITE) or -errno
+  uint32_t mode;     // CREATE: mode of the new file; STAT: filled in
+  int64_t offset;    // WRITE: where in the file
+  uint64_t size;     // STAT: filled in
+  uint32_t ino;      // STAT: filled in
+  uint32_t nlink;    // STAT: filled in
+  int64_t mtime_ns;  // STAT: filled in, since the epoch
+};
+
+#define NUFS_BATCH_OP_SIZE(name_len, data_len)                                 \
+  ((sizeof(struct nufs_batch_op) + (name_len) + (data_len) + 7) & ~(size_t)7)
+
+// room for operations; an ioctl's size has 14 bits, so the whole
+// struct nufs_batch has to stay under 16K
+#define NUFS_BATCH_BYTES 16368
+
+/**
+ * A batch of operations on the files of one directory.
+ */
+struct nufs_batch {
+  uint32_t count; // operations in ops
+  uint32_t bytes; // bytes of ops they take up
+  uint8_t ops[NUFS_BATCH_BYTES];
+} __attribute__((aligned(8)));
+
+/**
+ * Run a batch of operations on names in the directory the ioctl is issued
+ * on, all in one request and one operation of the file system, so other
+ * requests don't come in between. Every operation is run, in order, and
+ * its result filled in; the ioctl itself only fails (with EINVAL, and
+ * without running anything) if the batch is malformed, or with ENOTDIR.
+ * See nufs_batch.h for building batches.
+ *
+ * The operations don't pass through the kernel, so it doesn't update what
+ * it has cached: until entry_timeout and attr_timeout run out (10 seconds
+ * by default), a name the batch unlinked may still be found, and a file
+ * it wrote may show its old size, times and contents. A name it created
+ * is found at once, as long as negative lookups aren't cached
+ * (negative_timeout, 0 by default). NUFS_BATCH_STAT always sees what the
+ * batches did; mount with the timeouts at 0 if other system calls must.
+ */
+#define NUFS_IOC_BATCH _IOWR('N', 4, struct nufs_batch)
+
+// size classes of free runs in struct nufs_frag_stats
+#define NUFS_FREE_BUCKETS 16
+
+/**
+ * How fragmented the files and the free space of the volume are, and what
+ * the defragmenter has done since the volume was mounted.
+ */
+struct nufs_frag_stats {
+  uint64_t files;        // regular files with data blocks
+  uint64_t fragmented;   // ... stored in more than one run of blocks
+  uint64_t runs;         // runs of contiguous blocks, over all files
+  uint64_t blocks;       // data blocks of all files
+  uint64_t moved;        // blocks the defragmenter has moved
+  uint64_t defragmented; // files it has made contiguous
+  uint64_t skipped;      // fragmented files it found no free run for
+  uint64_t passes;       // passes over the files
+  uint64_t free_blocks;
+  // runs of free blocks by length: free_runs[i] counts the runs of 2^i
+  // to 2^(i+1) - 1 blocks; the last one also the longer ones
+  uint64_t free_runs[NUFS_FREE_BUCKETS];
+};
+
+/**
+ * Measure fragmentation (this walks every inode); may be issued on any
+ * file or directory.
+ */
+#define NUFS_IOC_FRAG_STATS _IOR('N', 5, struct nufs_frag_stats)
+
+/**
+ * Run a defragmenter pass over the whole volume now, then measure as
+ * NUFS_IOC_FRAG_STATS does. Files that are open, the one the ioctl is
+ * issued on included, are left as they are, so issue it on a directory.
+ *
+ * The pass isn't throttled and runs in the thread serving the ioctl. When
+ * nufs serves one request at a time (-s, as `make mount` does), the mount
+ * answers nothing else until the pass is over, which on a badly
+ * fragmented volume means until all of it has been copied; the
+ * defrag_rate mount option runs passes in the background instead.
+ */
+#define NUFS_IOC_DEFRAG _IOR('N', 6, struct nufs_frag_stats)
+
+#endif
@@ -0,0 +1,159 @@
+/**
+ * @file orphan.c
+ *
+ * The orphan list and the reclaimer thread that empties it.
+ */
+#include <pthread.h>
+#include <stdio.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "orphan.h"
+#include "writeback.h"
+
+#define ORPHAN_BATCH 256 // blocks freed per operation
+#define ORPHAN_INLINE 16 // files with no more blocks are freed right away
+
+static pthread_t orphan_thread;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t orphan_wake = PTHREAD_COND_INITIALIZER;
+static int orphan_running = 0;
+static int orphan_stopping = 0;
+static int orphan_pending = 0; // there may be orphans to reclaim
+
+// tell the reclaimer there is work
+static void orphan_kick() {
+  pthread_mutex_lock(&orphan_lock);
+  orphan_pending = 1;
+  pthread_cond_signal(&orphan_wake);
+  pthread_mutex_unlock(&orphan_lock);
+}
+
+// is the inode small enough, or the reclaimer absent, to free it now?
+static int orphan_free_now(const inode_t *node) {
+  return !orphan_running || inode_blocks(node) <= ORPHAN_INLINE;
+}
+
+// take an inode off the list
+static void orphan_unlink(int inum) {
+  int *link = &get_superblock()->orphan_head;
+  while (*link && *link != inum) {
+    link = &get_inode(*link)->orphan_next;
+  }
+  if (*link) {
+    *link = get_inode(inum)->orphan_next;
+  }
+}
+
+void orphan_add(int inum) {
+  inode_t *node = get_inode(inum);
+  int open = writeback_is_open(inum);
+  if (!open && orphan_free_now(node)) {
+    free_inode(inum);
+    return;
+  }
+
+  printf("+ orphan_add(%d)%s\n", inum, open ? "; still open" : "");
+  superblock_t *sb = get_superblock();
+  node->orphan_next = sb->orphan_head;
+  sb->orphan_head = inum;
+  if (!open) {
+    orphan_kick();
+  }
+}
+
+void orphan_closed(int inum) {
+  const inode_t *node = peek_inode(inum);
+  if (node->refs > 0 || !blocks_bitmap_get(INODE_BITMAP_START, inum) ||
+      writeback_is_open(inum)) {
+    return;
+  }
+  if (orphan_free_now(node)) {
+    orphan_unlink(inum);
+    free_inode(inum);
+  } else {
+    orphan_kick();
+  }
+}
+
+int orphan_reclaim() {
+  blocks_op_begin();
+  int inum = peek_superblock()->orphan_head;
+  while (inum && writeback_is_open(inum)) {
+    inum = peek_inode(inum)->orphan_next;
+  }
+  if (inum) {
+    inode_t *node = get_inode(inum);
+    int blocks = inode_blocks(node);
+    if (blocks > ORPHAN_BATCH) {
+      // from the end, so what is left stays a valid (shorter) file
+      shrink_inode(node, (blocks - ORPHAN_BATCH - 1) * BLOCK_SIZE);
+    } else {
+      orphan_unlink(inum);
+      free_inode(inum);
+    }
+  }
+  blocks_op_end();
+  return inum != 0;
+}
+
+void orphan_recover() {
+  blocks_op_begin();
+  int count = 0;
+  for (int inum = peek_superblock()->orphan_head; inum;
+       inum = peek_inode(inum)->orphan_next) {
+    count++;
+  }
+  blocks_op_end();
+
+  if (count > 0) {
+    printf("+ orphan_recover() -> %d inodes\n", count);
+    while (orphan_reclaim()) {
+    }
+  }
+}
+
+static void *orphan_main(void *arg) {
+  pthread_mutex_lock(&orphan_lock);
+  while (!orphan_stopping) {
+    if (!orphan_pending) {
+      pthread_cond_wait(&orphan_wake, &orphan_lock);
+      continue;
+    }
+    orphan_pending = 0;
+    pthread_mutex_unlock(&orphan_lock);
+    int more = orphan_reclaim();
+    pthread_mutex_lock(&orphan_lock);
+    if (more) {
+      orphan_pending = 1;
+    }
+  }
+  pthread_mutex_unlock(&orphan_lock);
+  return 0;
+}
+
+int orphan_start() {
+  if (orphan_running) {
+    return 0;
+  }
+  orphan_stopping = 0;
+  orphan_pending = 1; // in case anything was left waiting
+  int rv = pthread_create(&orphan_thread, 0, orphan_main, 0);
+  if (rv != 0) {
+    return -rv;
+  }
+  orphan_running = 1;
+  return 0;
+}
+
+void orphan_stop() {
+  if (!orphan_running) {
+    return;
+  }
+  pthread_mutex_lock(&orphan_lock);
+  orphan_stopping = 1;
+  pthread_cond_signal(&orphan_wake);
+  pthread_mutex_unlock(&orphan_lock);
+  pthread_join(orphan_thread, 0);
+  orphan_running = 0;
+}
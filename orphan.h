@@ -0,0 +1,62 @@
+/**
+ * @file orphan.h
+ *
+ * Orphans: inodes whose last link is gone but whose blocks haven't all
+ * been freed yet.
+ *
+ * They are chained through inode_t.orphan_next, starting at
+ * superblock_t.orphan_head, so the list is part of the image: whatever a
+ * crash leaves on it is finished by orphan_recover() at the next mount.
+ * An orphan that is still open (see writeback_is_open()) keeps its
+ * contents until the last handle on it is released.
+ *
+ * Small files are freed right away. Bigger ones are left to the reclaimer
+ * thread when it runs, which frees ORPHAN_BATCH blocks per operation so
+ * unlink doesn't have to wait for the whole file and other requests get
+ * in between the batches.
+ */
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+/**
+ * The last link to an inode went away: free it, or put it on the orphan
+ * list if it is open or big enough to be freed in the background.
+ *
+ * @param inum Inode number; its refs must have dropped below 1.
+ */
+void orphan_add(int inum);
+
+/**
+ * A handle on an inode was released; frees it, or hands it to the
+ * reclaimer, if it is an orphan nobody has open any more.
+ */
+void orphan_closed(int inum);
+
+/**
+ * Free up to ORPHAN_BATCH blocks of the first orphan that isn't open,
+ * and the inode itself once it is empty. Runs as its own operation.
+ *
+ * @return Whether there was anything to do.
+ */
+int orphan_reclaim();
+
+/**
+ * Finish every orphan left on the list, as after a crash. Nothing can be
+ * open yet, so this empties the list. Called by storage_init().
+ */
+void orphan_recover();
+
+/**
+ * Start the reclaimer thread.
+ *
+ * @return 0, or a negative errno if the thread can't be started.
+ */
+int orphan_start();
+
+/**
+ * Stop the reclaimer after its current batch. Orphans it hasn't got to
+ * stay on the list for the next mount.
+ */
+void orphan_stop();
+
+#endif
@@ -0,0 +1,37 @@
+/**
+ * @file path.c
+ *
+ * An allocation-free cursor over the components of a path.
+ */
+#include "path.h"
+
+void path_init(path_cursor_t *pc, const char *path) {
+  pc->next = path;
+  pc->name = path;
+  pc->len = 0;
+}
+
+int path_next(path_cursor_t *pc) {
+  const char *start = pc->next;
+  while (*start == '/') {
+    start++;
+  }
+
+  const char *end = start;
+  while (*end != 0 && *end != '/') {
+    end++;
+  }
+
+  pc->name = start;
+  pc->len = (int)(end - start);
+  pc->next = end;
+  return pc->len > 0;
+}
+
+int path_at_end(const path_cursor_t *pc) {
+  const char *rest = pc->next;
+  while (*rest == '/') {
+    rest++;
+  }
+  return *rest == 0;
+}
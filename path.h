@@ -0,0 +1,44 @@
+/**
+ * @file path.h
+ *
+ * An allocation-free cursor over the components of a path.
+ *
+ * Components are handed out as (pointer, length) slices of the original
+ * string, so walking a path never copies or mallocs anything.
+ */
+#ifndef PATH_H
+#define PATH_H
+
+typedef struct path_cursor {
+  const char *next; // rest of the path after the current component
+  const char *name; // current component (not NUL-terminated)
+  int len;          // length of the current component
+} path_cursor_t;
+
+/**
+ * Start walking the given path.
+ *
+ * @param pc Cursor to initialize.
+ * @param path Path to walk; must stay alive while the cursor is used.
+ */
+void path_init(path_cursor_t *pc, const char *path);
+
+/**
+ * Advance to the next component, skipping repeated slashes.
+ *
+ * @param pc Cursor to advance.
+ *
+ * @return 1 if pc->name/pc->len now hold a component, 0 at the end.
+ */
+int path_next(path_cursor_t *pc);
+
+/**
+ * Check whether the current component is the last one in the path.
+ *
+ * @param pc Cursor to check.
+ *
+ * @return 1 if nothing but slashes follows the current component.
+ */
+int path_at_end(const path_cursor_t *pc);
+
+#endif
@@ -0,0 +1,449 @@
+// nufs-replay: run a trace recorded with `nufs -o trace=FILE` against a
+// fresh image, through the storage layer, and report how long each kind
+// of operation took.
+//
+// usage: nufs-replay [-p] [-x speed] [-b backend] [-n blocks] [-s image]
+//                    trace [image]
+//
+// By default operations are issued back to back. -p keeps the recorded
+// pace instead, waiting until each one is due (-x 2 plays twice as fast).
+// The image starts out freshly formatted, or as a copy of -s image when
+// the trace was taken on a volume that already had files. Written data is
+// a fixed pattern; only offsets and sizes come from the trace.
+//
+// For every op the recorded and replayed latencies are printed side by
+// side (count, mean and percentiles), along with how many operations
+// succeeded or failed differently than they did when recorded.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "nufs_ioctl.h"
+#include "slist.h"
+#include "storage.h"
+#include "trace.h"
+
+// latencies of one op, recorded and replayed
+typedef struct op_stats {
+  uint32_t *recorded;
+  uint32_t *replayed;
+  long count;
+  long size;
+  long mismatches; // succeeded when the recorded one failed or vice versa
+} op_stats_t;
+
+static op_stats_t stats[TRACE_OPS];
+
+static int write_buffer = 0;
+static char *data = 0; // what gets written; grown to the largest request
+static size_t data_size = 0;
+
+// recorded write-back handles and the ones the replay got for them
+static int *handles = 0;
+static int nhandles = 0;
+
+static FILE *out;
+
+static void die(const char *what) {
+  fprintf(stderr, "nufs-replay: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static char *buffer(size_t size) {
+  if (size > data_size) {
+    data = realloc(data, size);
+    for (size_t i = data_size; i < size; ++i) {
+      data[i] = 'a' + i % 26;
+    }
+    data_size = size;
+  }
+  return data;
+}
+
+static int handle(uint32_t recorded) {
+  return recorded < nhandles ? handles[recorded] : 0;
+}
+
+static void set_handle(uint32_t recorded, int fh) {
+  if (recorded >= nhandles) {
+    int n = recorded + 8;
+    handles = realloc(handles, n * sizeof(int));
+    memset(handles + nhandles, 0, (n - nhandles) * sizeof(int));
+    nhandles = n;
+  }
+  handles[recorded] = fh;
+}
+
+// what nufs_readdir does: list the directory and stat every entry
+static int replay_readdir(const char *path) {
+  char item[4096];
+  struct stat st;
+  slist_t *items = directory_list(path);
+  for (slist_t *xs = items; xs != 0; xs = xs->next) {
+    snprintf(item, sizeof(item), "%s/%s", strcmp(path, "/") ? path : "",
+             xs->data);
+    storage_stat(item, &st);
+  }
+  s_free(items);
+  return 0;
+}
+
+// what nufs_write_buf does: small buffered writes go through the handle,
+// everything else straight into the image file
+static int replay_write_buf(const char *path, const trace_record_t *rec) {
+  int fh = handle(rec->fh);
+  char *buf = buffer(rec->size);
+  if (fh && rec->size < write_buffer) {
+    return storage_write_handle(fh, buf, rec->size, rec->offset);
+  }
+
+  storage_extent_t *exts;
+  int count = fh ? storage_map_handle(fh, rec->size, rec->offset, 1, &exts)
+               : storage_map(path, rec->size, rec->offset, 1, &exts);
+  if (count < 0) {
+    return count;
+  }
+  size_t done = 0;
+  for (int i = 0; i < count; ++i) {
+    if (exts[i].pos >= 0 &&
+        pwrite(exts[i].fd, buf + done, exts[i].size, exts[i].pos) < 0) {
+      count = -errno;
+      break;
+    }
+    done += exts[i].size;
+  }
+  if (count >= 0) {
+    storage_map_done(exts, count);
+  }
+  free(exts);
+  return count < 0 ? count : (int)rec->size;
+}
+
+// what nufs_read_buf hands to FUSE, read here so the data is touched
+static int replay_read_buf(const char *path, const trace_record_t *rec) {
+  storage_extent_t *exts;
+  char *buf = buffer(rec->size);
+  int fh = handle(rec->fh);
+  int count = fh ? storage_map_handle(fh, rec->size, rec->offset, 0, &exts)
+               : storage_map(path, rec->size, rec->offset, 0, &exts);
+  if (count < 0) {
+    return count;
+  }
+  int rv = 0;
+  for (int i = 0; i < count && rv == 0; ++i) {
+    if (exts[i].pos >= 0 &&
+        pread(exts[i].fd, buf, exts[i].size, exts[i].pos) < 0) {
+      rv = -errno;
+    }
+  }
+  free(exts);
+  return rv;
+}
+
+// one operation, as the matching nufs callback would run it
+static int replay(const trace_record_t *rec, const char *path,
+                  const char *path2) {
+  int rv = 0;
+  struct stat st;
+  storage_op_begin();
+  switch (rec->op) {
+  case TRACE_ACCESS:
+    rv = storage_can_find(path);
+    break;
+  case TRACE_GETATTR:
+    rv = storage_stat(path, &st);
+    break;
+  case TRACE_READDIR:
+    rv = replay_readdir(path);
+    break;
+  case TRACE_MKNOD:
+    rv = storage_mknod(path, rec->mode);
+    break;
+  case TRACE_MKDIR:
+    rv = storage_mknod(path, rec->mode | 040000);
+    break;
+  case TRACE_UNLINK:
+    rv = storage_unlink(path);
+    break;
+  case TRACE_LINK:
+    rv = storage_link(path2, path);
+    break;
+  case TRACE_RMDIR:
+    rv = storage_rmdir(path);
+    break;
+  case TRACE_RENAME:
+    rv = storage_rename(path, path2, 0);
+    break;
+  case TRACE_CHMOD:
+    rv = storage_chmod(path, rec->mode);
+    break;
+  case TRACE_TRUNCATE:
+    rv = storage_truncate(path, rec->size);
+    break;
+  case TRACE_FALLOCATE:
+    rv = storage_fallocate(path, rec->mode, rec->offset, rec->size);
+    break;
+  case TRACE_OPEN: {
+    int keep_cache;
+    rv = storage_open(path, &keep_cache);
+    if (rv >= 0 && rec->fh == 0) {
+      // traced before every open file had a handle: go by path
+      storage_release(rv);
+    } else if (rv >= 0) {
+      set_handle(rec->fh, rv);
+    }
+    rv = rv < 0 ? rv : 0;
+    break;
+  }
+  case TRACE_FLUSH:
+    rv = storage_flush(handle(rec->fh));
+    break;
+  case TRACE_RELEASE:
+    rv = storage_release(handle(rec->fh));
+    set_handle(rec->fh, 0);
+    break;
+  case TRACE_READ:
+    rv = handle(rec->fh)
+             ? storage_read_handle(handle(rec->fh), buffer(rec->size),
+                                   rec->size, rec->offset)
+             : storage_read(path, buffer(rec->size), rec->size, rec->offset);
+    break;
+  case TRACE_READLINK:
+    rv = storage_read(path, buffer(rec->size), rec->size, 0);
+    break;
+  case TRACE_WRITE: {
+    int fh = handle(rec->fh);
+    char *buf = buffer(rec->size);
+    rv = fh ? storage_write_handle(fh, buf, rec->size, rec->offset)
+            : storage_write(path, buf, rec->size, rec->offset);
+    break;
+  }
+  case TRACE_READ_BUF:
+    rv = replay_read_buf(path, rec);
+    break;
+  case TRACE_WRITE_BUF:
+    rv = replay_write_buf(path, rec);
+    break;
+  case TRACE_UTIMENS: {
+    struct timespec ts[2] = {{rec->offset, 0}, {rec->size, 0}};
+    rv = storage_set_time(path, ts);
+    break;
+  }
+  case TRACE_IOCTL:
+    rv = (unsigned)rec->mode == (unsigned)NUFS_IOC_RMTREE
+             ? storage_rmtree(path)
+             : 0;
+    break;
+  case TRACE_SYMLINK:
+    rv = storage_mknod(path, 0120000);
+    if (rv == 0) {
+      storage_write(path, path2, strlen(path2), 0);
+    }
+    break;
+  case TRACE_FSYNC:
+    rv = storage_flush(handle(rec->fh));
+    storage_sync();
+    break;
+  default:
+    rv = -ENOSYS;
+  }
+  storage_op_end();
+  return rv;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+  struct timespec ts = {ns / 1000000000, ns % 1000000000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR) {
+  }
+}
+
+static void record(const trace_record_t *rec, uint32_t took, int rv) {
+  op_stats_t *s = &stats[rec->op];
+  if (s->count == s->size) {
+    s->size = s->size ? 2 * s->size : 256;
+    s->recorded = realloc(s->recorded, s->size * sizeof(uint32_t));
+    s->replayed = realloc(s->replayed, s->size * sizeof(uint32_t));
+  }
+  s->recorded[s->count] = rec->duration_ns;
+  s->replayed[s->count] = took;
+  s->count++;
+  if ((rv < 0) != (rec->result < 0)) {
+    s->mismatches++;
+  }
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// mean and percentiles, in microseconds
+static void latencies(const char *what, uint32_t *ns, long count) {
+  qsort(ns, count, sizeof(uint32_t), compare_u32);
+  double sum = 0;
+  for (long i = 0; i < count; ++i) {
+    sum += ns[i];
+  }
+  fprintf(out,
+          "    %-8s mean %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f\n",
+          what, sum / count / 1e3, ns[count / 2] / 1e3,
+          ns[count * 9 / 10] / 1e3, ns[count * 99 / 100] / 1e3,
+          ns[count - 1] / 1e3);
+}
+
+static void report(double secs, long ops) {
+  fprintf(out, "%ld operations in %.3f s (%.0f ops/s); latencies in us\n",
+          ops, secs, ops / secs);
+  for (int op = 1; op < TRACE_OPS; ++op) {
+    op_stats_t *s = &stats[op];
+    if (s->count == 0) {
+      continue;
+    }
+    fprintf(out, "  %s: %ld", trace_op_name(op), s->count);
+    if (s->mismatches) {
+      fprintf(out, " (%ld with a different outcome)", s->mismatches);
+    }
+    fprintf(out, "\n");
+    latencies("recorded", s->recorded, s->count);
+    latencies("replayed", s->replayed, s->count);
+  }
+}
+
+static void copy_image(const char *from, const char *to) {
+  int in = open(from, O_RDONLY);
+  if (in < 0) {
+    die(from);
+  }
+  int dst = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (dst < 0) {
+    die(to);
+  }
+  struct stat st;
+  fstat(in, &st);
+  for (off_t done = 0; done < st.st_size;) {
+    loff_t at = done;
+    ssize_t n = copy_file_range(in, &at, dst, 0, st.st_size - done, 0);
+    if (n <= 0) {
+      die("copy image");
+    }
+    done += n;
+  }
+  close(in);
+  close(dst);
+}
+
+int main(int argc, char *argv[]) {
+  int paced = 0;
+  double speed = 1;
+  const char *start_image = 0;
+  int opt;
+
+  blocks_options.format_blocks = 65536; // 256MB
+  while ((opt = getopt(argc, argv, "px:b:n:s:")) != -1) {
+    switch (opt) {
+    case 'p':
+      paced = 1;
+      break;
+    case 'x':
+      speed = atof(optarg);
+      break;
+    case 'b':
+      blocks_options.backend = optarg;
+      break;
+    case 'n':
+      blocks_options.format_blocks = atoi(optarg);
+      break;
+    case 's':
+      start_image = optarg;
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind >= argc || argc - optind > 2 || speed <= 0) {
+    fprintf(stderr,
+            "usage: %s [-p] [-x speed] [-b backend] [-n blocks] [-s image] "
+            "trace [image]\n",
+            argv[0]);
+    return 1;
+  }
+
+  FILE *in = fopen(argv[optind], "r");
+  if (!in) {
+    die(argv[optind]);
+  }
+  trace_header_t hdr;
+  if (trace_read_header(in, &hdr) < 0) {
+    fprintf(stderr, "nufs-replay: %s: not a trace\n", argv[optind]);
+    return 1;
+  }
+
+  char image[] = "/tmp/nufs-replay-XXXXXX";
+  const char *path = optind + 1 < argc ? argv[optind + 1] : 0;
+  if (!path) {
+    close(mkstemp(image));
+    path = image;
+  }
+  unlink(path);
+  if (start_image) {
+    copy_image(start_image, path);
+  }
+
+  // the storage layer traces every call on stdout; results go here instead
+  out = fdopen(dup(1), "w");
+  if (!freopen("/dev/null", "w", stdout)) {
+    die("/dev/null");
+  }
+
+  storage_init(path);
+  write_buffer = hdr.write_buffer;
+  storage_set_write_buffer(write_buffer);
+
+  trace_record_t rec;
+  static char path1[UINT16_MAX + 1];
+  static char path2[UINT16_MAX + 1];
+  long ops = 0;
+  int rv;
+  uint64_t begin = now_ns();
+  while ((rv = trace_read(in, &rec, path1, path2)) > 0) {
+    if (rec.op <= 0 || rec.op >= TRACE_OPS) {
+      continue;
+    }
+    if (paced) {
+      sleep_until(begin + (uint64_t)(rec.start_ns / speed));
+    }
+    uint64_t t = now_ns();
+    int result = replay(&rec, path1, path2);
+    uint64_t took = now_ns() - t;
+    record(&rec, took > UINT32_MAX ? UINT32_MAX : took, result);
+    ops++;
+  }
+  double secs = (now_ns() - begin) / 1e9;
+  if (rv < 0) {
+    fprintf(stderr, "nufs-replay: trace is cut short\n");
+  }
+  fclose(in);
+
+  storage_free();
+  if (path == image) {
+    unlink(path);
+  }
+  report(secs, ops);
+  return 0;
+}
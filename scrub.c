@@ -0,0 +1,71 @@
+/**
+ * @file scrub.c
+ *
+ * Background scrubber. The thread checks SCRUB_BATCH blocks at a time,
+ * each batch in its own operation so file system requests get in between,
+ * and sleeps after each one to stay at the configured rate.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "scrub.h"
+
+#define SCRUB_BATCH 64
+
+static pthread_t scrub_thread;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wake = PTHREAD_COND_INITIALIZER;
+static int scrub_running = 0;
+static int scrub_stopping = 0;
+static long scrub_pause_ns = 0; // between batches
+
+static void *scrub_main(void *arg) {
+  int cursor = 0;
+  pthread_mutex_lock(&scrub_lock);
+  while (!scrub_stopping) {
+    pthread_mutex_unlock(&scrub_lock);
+    cursor = blocks_scrub(cursor, SCRUB_BATCH);
+    pthread_mutex_lock(&scrub_lock);
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += scrub_pause_ns;
+    until.tv_sec += until.tv_nsec / 1000000000;
+    until.tv_nsec %= 1000000000;
+    while (!scrub_stopping &&
+           pthread_cond_timedwait(&scrub_wake, &scrub_lock, &until) !=
+               ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&scrub_lock);
+  return 0;
+}
+
+int scrub_start(int rate_mb) {
+  if (rate_mb <= 0 || scrub_running) {
+    return 0;
+  }
+  scrub_pause_ns =
+      1000000000L * SCRUB_BATCH * BLOCK_SIZE / ((long)rate_mb * 1024 * 1024);
+  scrub_stopping = 0;
+  int rv = pthread_create(&scrub_thread, 0, scrub_main, 0);
+  if (rv != 0) {
+    return -rv;
+  }
+  scrub_running = 1;
+  return 0;
+}
+
+void scrub_stop() {
+  if (!scrub_running) {
+    return;
+  }
+  pthread_mutex_lock(&scrub_lock);
+  scrub_stopping = 1;
+  pthread_cond_signal(&scrub_wake);
+  pthread_mutex_unlock(&scrub_lock);
+  pthread_join(scrub_thread, 0);
+  scrub_running = 0;
+}
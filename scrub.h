@@ -0,0 +1,26 @@
+/**
+ * @file scrub.h
+ *
+ * Background scrubber: a thread that keeps going over the used blocks of
+ * the image, checking them against their checksums (see blocks_scrub()),
+ * so damage is found before anybody reads the block.
+ */
+#ifndef SCRUB_H
+#define SCRUB_H
+
+/**
+ * Start the scrubber.
+ *
+ * @param rate_mb How many MB of blocks to check per second; 0 or less
+ *                leaves the scrubber off.
+ *
+ * @return 0, or a negative errno if the thread can't be started.
+ */
+int scrub_start(int rate_mb);
+
+/**
+ * Stop the scrubber and wait for it to finish its current batch.
+ */
+void scrub_stop();
+
+#endif
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <libgen.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,14 +14,53 @@
 #include "blocks.h"
 #include "directory.h"
 #include "inode.h"
+#include "nufs_ioctl.h"
+#include "orphan.h"
+#include "path.h"
 #include "randomfuncs.h"
 #include "slist.h"
 #include "storage.h"
+#include "writeback.h"
 
 // initializes storage
 void storage_init(const char *path) {
   blocks_init(path);
-  directory_init();
+  inodes_init();
+  // only a freshly formatted image needs a root directory
+  if (!blocks_bitmap_get(INODE_BITMAP_START, 0)) {
+    directory_init();
+  }
+  // finish freeing what was unlinked before a crash
+  if (!blocks_options.read_only) {
+    orphan_recover();
+  }
+}
+
+// brackets one file system operation; block pointers obtained in between
+// stay valid until the matching storage_op_end()
+void storage_op_begin() { blocks_op_begin(); }
+
+void storage_op_end() { blocks_op_end(); }
+
+// writes everything back to the image
+void storage_sync() { blocks_sync(); }
+
+// closes the image
+void storage_free() { blocks_free(); }
+
+// fills in the attributes of an inode
+static void storage_stat_inode(int inode_number, struct stat *st) {
+  writeback_flush_inode(inode_number); // the size may still grow
+  const inode_t *node = peek_inode(inode_number);
+  print_inode(node);
+  memset(st, 0, sizeof(struct stat));
+  st->st_uid = getuid();
+  st->st_mode = node->mode;
+  st->st_size = node->size;
+  st->st_nlink = node->refs;
+  st->st_atim = node->acc_time;
+  st->st_mtim = node->mod_time;
+  st->st_ctim = node->change_time;
 }
 
 // logic for nufs getattr
@@ -28,19 +68,88 @@ int storage_stat(const char *path, struct stat *st) {
   int inode_number = filesys_lookup(path);
   printf("+ storage_stat(%s) -> 0; inode %d\n", path, inode_number);
   if (inode_number >= 0) {
-    inode_t *node = get_inode(inode_number);
-    print_inode(node);
-    memset(st, 0, sizeof(struct stat));
-    st->st_uid = getuid();
-    st->st_mode = node->mode;
-    st->st_size = node->size;
-    st->st_nlink = node->refs;
+    storage_stat_inode(inode_number, st);
     return 0;
   } else {
     return inode_number;
   }
 }
 
+// lets the block layer start loading every block of a range at once
+// (the cache backends load blocks before they are written, too), so a
+// striped volume reads from all its images in parallel
+static void storage_prefetch(const inode_t *node, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    int pos = offset + done;
+    int skip = pos % BLOCK_SIZE;
+    int bnum;
+    int run = inode_get_run(node, pos, bytes_to_blocks(skip + size - done),
+                            &bnum);
+    if (bnum) {
+      blocks_prefetch(bnum, run);
+    }
+    done += min(size - done, run * BLOCK_SIZE - skip);
+  }
+}
+
+// copies between buf and the file contents, with one memcpy per run of
+// blocks that follow each other both on disk and in memory; reading fails
+// with -EIO if a block doesn't match its checksum
+static int storage_copy(const inode_t *node, char *buf, size_t size,
+                        off_t offset, int to_file) {
+  if (size > BLOCK_SIZE) {
+    storage_prefetch(node, size, offset);
+  }
+  size_t done = 0;
+  while (done < size) {
+    int pos = offset + done;
+    int skip = pos % BLOCK_SIZE;
+    int bnum;
+    int run = inode_get_run(node, pos, bytes_to_blocks(skip + size - done),
+                            &bnum);
+    if (bnum == 0) { // a hole; writes fill them in first
+      size_t span = min(size - done, run * BLOCK_SIZE - skip);
+      memset(buf + done, 0, span);
+      done += span;
+      continue;
+    }
+    run = blocks_contiguous(bnum, run);
+    blocks_tier_access(bnum, run);
+
+    size_t span = min(size - done, run * BLOCK_SIZE - skip);
+    if (to_file) {
+      memcpy((char *)blocks_get_run(bnum, run) + skip, buf + done, span);
+    } else if (blocks_read(bnum, skip, buf + done, span) < 0) {
+      return -EIO;
+    }
+    done += span;
+  }
+  return 0;
+}
+
+// gets the file ready for {size} bytes to be written at offset; with
+// overwrite, the caller writes every one of them, so blocks allocated for
+// the range alone needn't be zeroed first
+static int storage_prepare_write(inode_t *node, int inode_number, size_t size,
+                                 off_t offset, int overwrite) {
+  // only grow: writing inside the file leaves its size alone
+  if (offset + size > node->size) {
+    int rv = inode_grow_over(node, offset + size,
+                             overwrite ? offset : offset + size);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  int rv = inode_fill_holes(node, offset, size);
+  if (rv < 0) {
+    return rv;
+  }
+  inode_touch_mtime(node);
+  inode_cache_invalidate(inode_number);
+  return 0;
+}
+
 // reads {size} bytes from path contents to buffer
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
   int inode_number = filesys_lookup(path);
@@ -48,30 +157,30 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
     return inode_number;
   }
 
-  inode_t *node = get_inode(inode_number);
   printf("+ storage_read(%s); inode %d\n", path, inode_number);
+  return storage_read_inode(inode_number, buf, size, offset);
+}
+
+// reads through a handle from storage_open(), which works even after the
+// file's last link is gone
+int storage_read_handle(int fh, char *buf, size_t size, off_t offset) {
+  return storage_read_inode(writeback_inum(fh), buf, size, offset);
+}
+
+// reads {size} bytes from the contents of an inode
+int storage_read_inode(int inum, char *buf, size_t size, off_t offset) {
+  writeback_flush_inode(inum);
+  const inode_t *node = peek_inode(inum);
   print_inode(node);
 
   if (offset >= node->size) {
     return 0;
   }
+  inode_touch_atime(inum);
 
   size = min(size, node->size - offset);
-  int num_read = 0;
-
-  while (num_read < size) {
-    int block_num = inode_get_bnum(node, offset + num_read);
-    char *starting_block = blocks_get_block(block_num);
-    char *read_ptr = starting_block + ((offset + num_read) % BLOCK_SIZE);
-
-    int bytes_to_read =
-        min(size - num_read, BLOCK_SIZE - ((offset + num_read) % BLOCK_SIZE));
-    printf(" + reading from block: %d\n", block_num);
-    memcpy(buf + num_read, read_ptr, bytes_to_read);
-    num_read += bytes_to_read;
-  }
-
-  return num_read;
+  int rv = storage_copy(node, buf, size, offset, 0);
+  return rv < 0 ? rv : size;
 }
 
 // writes {size} bytes from buffer to path contents
@@ -85,35 +194,152 @@ int storage_write(const char *path, const char *buf, size_t size,
   printf("OFFSET: %li\n", offset);
   printf("-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-\n");
   //*/
-  int truncate_result = storage_truncate(path, offset + size);
-  if (truncate_result < 0) {
-    return truncate_result;
+  int inode_number = filesys_lookup(path);
+  if (inode_number < 0) {
+    return inode_number;
+  }
+
+  // buffered data was written first, so it must land first
+  writeback_flush_inode(inode_number);
+  return storage_write_inode(inode_number, buf, size, offset);
+}
+
+// writes {size} bytes from buffer to the contents of an inode
+int storage_write_inode(int inum, const char *buf, size_t size, off_t offset) {
+  inode_t *node = get_inode(inum);
+  printf("+ storage_write(inode %d)\n", inum);
+  print_inode(node);
+
+  int rv = storage_prepare_write(node, inum, size, offset, 1);
+  if (rv < 0) {
+    return rv;
   }
 
+  storage_copy(node, (char *)buf, size, offset, 1);
+  return size;
+}
+
+// opens the file at path, returning a handle that keeps its contents
+// around until storage_release() even if it is unlinked (and buffers
+// writes, see writeback.h); *keep_cache tells whether the kernel's cached
+// pages of the file are still good
+int storage_open(const char *path, int *keep_cache) {
   int inode_number = filesys_lookup(path);
   if (inode_number < 0) {
     return inode_number;
   }
+  *keep_cache = inode_cache_check(inode_number);
+  return writeback_open(inode_number);
+}
 
-  inode_t *node = get_inode(inode_number);
-  printf("+ storage_write(%s); inode %d\n", path, inode_number);
-  print_inode(node);
+// writes through a handle from storage_open()
+int storage_write_handle(int fh, const char *buf, size_t size, off_t offset) {
+  return writeback_write(fh, buf, size, offset);
+}
+
+// writes out a handle's buffered data
+int storage_flush(int fh) { return fh ? writeback_flush(fh) : 0; }
+
+// flushes and closes a handle; an unlinked file goes away with the last one
+int storage_release(int fh) {
+  if (!fh) {
+    return 0;
+  }
+  int inum = writeback_inum(fh);
+  int rv = writeback_release(fh);
+  orphan_closed(inum);
+  return rv;
+}
 
-  int num_written = 0;
+// sets the size of the write-back buffer of files opened from now on
+void storage_set_write_buffer(int size) { writeback_set_size(size); }
+
+// maps {size} bytes of path contents at offset onto the image files, so
+// they can be read or written there directly; returns the number of
+// extents stored in *exts (to be freed by the caller)
+int storage_map(const char *path, size_t size, off_t offset, int writing,
+                storage_extent_t **exts) {
+  *exts = 0;
+  int inode_number = filesys_lookup(path);
+  if (inode_number < 0) {
+    return inode_number;
+  }
+  printf("+ storage_map(%s, %s); inode %d\n", path, writing ? "w" : "r",
+         inode_number);
+  return storage_map_inode(inode_number, size, offset, writing, exts);
+}
 
-  while (num_written < size) {
-    int block_num = inode_get_bnum(node, offset + num_written);
-    char *starting_block = blocks_get_block(block_num);
-    char *write_ptr = starting_block + ((offset + num_written) % BLOCK_SIZE);
+// same as storage_map, through a handle from storage_open()
+int storage_map_handle(int fh, size_t size, off_t offset, int writing,
+                       storage_extent_t **exts) {
+  return storage_map_inode(writeback_inum(fh), size, offset, writing, exts);
+}
 
-    int bytes_to_write = min(
-        size - num_written, BLOCK_SIZE - ((offset + num_written) % BLOCK_SIZE));
-    printf("+ writing to block: %d\n", block_num);
-    memcpy(write_ptr, buf + num_written, bytes_to_write);
-    num_written += bytes_to_write;
+// same as storage_map, for an inode
+int storage_map_inode(int inode_number, size_t size, off_t offset,
+                      int writing, storage_extent_t **exts) {
+  *exts = 0;
+  writeback_flush_inode(inode_number);
+  const inode_t *node = peek_inode(inode_number);
+  if (writing) {
+    int rv = storage_prepare_write(get_inode(inode_number), inode_number, size,
+                                   offset, writing == STORAGE_MAP_OVERWRITE);
+    if (rv < 0) {
+      return rv;
+    }
+  } else {
+    if (offset >= node->size) {
+      return 0;
+    }
+    inode_touch_atime(inode_number);
+    size = min(size, node->size - offset);
   }
 
-  return num_written;
+  storage_extent_t *ext =
+      malloc(bytes_to_blocks(offset % BLOCK_SIZE + size) * sizeof(*ext));
+  int count = 0;
+  size_t done = 0;
+  while (done < size) {
+    int pos = offset + done;
+    int skip = pos % BLOCK_SIZE;
+    int bnum;
+    int run = inode_get_run(node, pos, bytes_to_blocks(skip + size - done),
+                            &bnum);
+    if (bnum) {
+      run = blocks_file_run(bnum, run);
+    }
+    if (bnum && !writing && blocks_verify(bnum, run) < 0) {
+      free(ext);
+      return -EIO;
+    }
+    ext[count].bnum = bnum;
+    if (bnum) {
+      blocks_tier_access(bnum, run);
+      off_t at;
+      ext[count].fd = blocks_file_io(bnum, run, writing != 0, &at);
+      ext[count].pos = at + skip;
+    } else {
+      ext[count].fd = -1;
+      ext[count].pos = -1;
+    }
+    ext[count].size = min(size - done, run * BLOCK_SIZE - skip);
+    done += ext[count].size;
+    count++;
+  }
+  *exts = ext;
+  return count;
+}
+
+// tells the block layer that data was written to extents handed out by
+// storage_map(..., 1), so it can checksum them
+void storage_map_done(const storage_extent_t *exts, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (exts[i].pos < 0 || exts[i].size == 0) {
+      continue;
+    }
+    int skip = exts[i].pos % BLOCK_SIZE;
+    blocks_file_io_done(exts[i].bnum, bytes_to_blocks(skip + exts[i].size));
+  }
 }
 
 // changes length of file by calling grow/shrink inode
@@ -123,7 +349,10 @@ int storage_truncate(const char *path, off_t size) {
     return inode_number;
   }
 
+  writeback_flush_inode(inode_number);
   inode_t *node = get_inode(inode_number);
+  inode_touch_mtime(node);
+  inode_cache_invalidate(inode_number);
   if (size >= node->size) {
     return grow_inode(node, size);
   } else {
@@ -131,151 +360,509 @@ int storage_truncate(const char *path, off_t size) {
   }
 }
 
-// Parse full path for...
-// ...Parent of given file
-void storage_find_parent(const char *fullpath, char *dir) {
-  strcpy(dir, fullpath);
+// zeroes bytes [offset, end) of the mapped part of a file: whole blocks
+// are released (leaving holes) or, with keep, punched out of the image
+// but left allocated; partial blocks at the edges are cleared in place
+static void storage_zero(inode_t *node, int offset, int end, int keep) {
+  end = min(end, inode_blocks(node) * BLOCK_SIZE);
+  if (offset >= end) {
+    return;
+  }
 
-  int word_len = 0;
-  for (int i = strlen(fullpath) - 1; fullpath[i] != '/'; --i) {
-    word_len++;
+  int first = bytes_to_blocks(offset); // first whole block
+  int last = end / BLOCK_SIZE;         // past the last whole block
+  for (int i = offset / BLOCK_SIZE; i < bytes_to_blocks(end); ++i) {
+    if (i >= first && i < last) {
+      continue;
+    }
+    int from = max(offset, i * BLOCK_SIZE);
+    int to = min(end, (i + 1) * BLOCK_SIZE);
+    int bnum = inode_get_bnum(node, i * BLOCK_SIZE);
+    if (bnum) {
+      memset((char *)blocks_get_block(bnum) + from % BLOCK_SIZE, 0, to - from);
+    }
   }
 
-  if (word_len == strlen(fullpath) - 1) {
-    dir[1] = '\0';
-  } else {
-    dir[strlen(fullpath) - word_len - 1] = '\0';
+  if (first >= last) {
+    return;
+  }
+  if (!keep) {
+    inode_punch(node, first, last - first);
+    return;
+  }
+  for (int i = first; i < last;) {
+    int bnum;
+    int run = inode_get_run(node, i * BLOCK_SIZE, last - i, &bnum);
+    if (bnum && blocks_punch(bnum, run) < 0) {
+      for (int k = 0; k < run; ++k) {
+        memset(blocks_get_block(bnum + k), 0, BLOCK_SIZE);
+      }
+    }
+    i += run;
   }
 }
 
-// ...Child of given file
-char *storage_find_child(const char *fullpath, char *sub) {
-  strcpy(sub, fullpath);
+// preallocates space for, punches a hole in or zeroes part of a file, as
+// fallocate(2) does; holes are made of whole blocks
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length) {
+  int inode_number = filesys_lookup(path);
+  if (inode_number < 0) {
+    return inode_number;
+  }
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
+  }
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+               FALLOC_FL_ZERO_RANGE)) {
+    return -EOPNOTSUPP;
+  }
+  if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+      (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) {
+    return -EOPNOTSUPP; // a hole may not change the size
+  }
+  if (offset + length > INT32_MAX) {
+    return -EFBIG;
+  }
+
+  writeback_flush_inode(inode_number);
+  inode_t *node = get_inode(inode_number);
+  printf("+ storage_fallocate(%s, %#x, %ld, %ld); inode %d\n", path, mode,
+         offset, length, inode_number);
+  int end = offset + length;
+  int oldSize = node->size;
+  inode_cache_invalidate(inode_number);
+
+  if (mode & FALLOC_FL_PUNCH_HOLE) {
+    storage_zero(node, offset, end, 0);
+    inode_touch_mtime(node);
+    return 0;
+  }
+  if (mode & FALLOC_FL_ZERO_RANGE) {
+    // zero what's there; whatever gets allocated below is zeroed anyway
+    storage_zero(node, offset, end, 1);
+  }
 
-  int word_len = 0;
-  for (int i = strlen(fullpath) - 1; fullpath[i] != '/'; i--) {
-    word_len++;
+  int rv = 0;
+  if (end > node->size) {
+    if (mode & FALLOC_FL_KEEP_SIZE) {
+      rv = inode_reserve(node, end);
+    } else {
+      rv = grow_inode(node, end);
+    }
+  }
+  if (rv == 0) {
+    rv = inode_fill_holes(node, offset, length);
   }
 
-  sub += strlen(fullpath) - word_len;
-  return sub;
+  if ((mode & FALLOC_FL_ZERO_RANGE) || node->size != oldSize) {
+    inode_touch_mtime(node);
+  } else {
+    inode_touch_ctime(node);
+  }
+  return rv;
 }
 
-// create new node (file or dir) at given path
-int storage_mknod(const char *path, int mode) {
-  if (filesys_lookup(path) > -1) {
-    printf("Node already exists!\n");
-    return -EEXIST;
+// creates a node named (name, len) in directory dir, returning its inum
+int storage_make_node(int dir, const char *name, int len, int mode) {
+  int inum = alloc_inode(); // create new node
+  if (inum < 0) {
+    return -ENOSPC;
   }
+  inode_t *created = get_inode(inum);
+  created->mode = mode;
 
-  char *newNodePath = malloc(strlen(path) + 10);
-  memset(newNodePath, 0, strlen(path) + 10);
-  newNodePath[0] = '/'; // root
-
-  slist_t *items = s_explode(path + 1, '/'); // path as list of strings
-  for (slist_t *currentItem = items; currentItem != NULL; currentItem = currentItem->next) {
-    int s = directory_lookup(get_inode(filesys_lookup(newNodePath)), currentItem->data);
-    int d = filesys_lookup(newNodePath);
-    if (currentItem->next == NULL && s < 0) { // end of the pathway
-      int nodeNumToCreate = alloc_inode(); // create new node
-      inode_t *created = get_inode(nodeNumToCreate);
-      created->mode = mode;
+  if (S_ISDIR(mode)) {
+    directory_put(created, "..", dir); // setting system default directories
+    directory_put(created, ".", inum);
+  }
 
-      if (created->mode == 040755) {
-        char *selfname = "."; // setting system default directories
-        char *parentname = "..";
+  int rv = directory_put_n(get_inode(dir), name, len, inum);
+  if (rv != 0) {
+    printf("Couldn't make node %.*s in inode %d!\n", len, name, dir);
+    if (S_ISDIR(mode)) {
+      get_inode(dir)->refs--; // drop the ".." reference again
+    }
+    created->refs = 0;
+    free_inode(inum);
+    return rv;
+  }
 
-        directory_put(created, parentname, filesys_lookup(newNodePath));
-        directory_put(created, selfname, nodeNumToCreate);
-      }
+  created->refs = 1;
+  return inum;
+}
 
-      int rv = directory_put(get_inode(filesys_lookup(newNodePath)), currentItem->data,
-                             nodeNumToCreate);
-      if (rv != 0) {
-        printf("Couldn't make node at %s!", newNodePath);
-        free(newNodePath);
-        return -1;
+// create new node (file or dir) at given path
+// (missing intermediate directories are created along the way)
+int storage_mknod(const char *path, int mode) {
+  path_cursor_t pc;
+  path_init(&pc, path);
+
+  int dir = 0; // root
+  while (path_next(&pc)) {
+    int inum = directory_lookup_n(peek_inode(dir), pc.name, pc.len);
+    if (path_at_end(&pc)) { // end of the pathway
+      if (inum >= 0) {
+        printf("Node already exists!\n");
+        return -EEXIST;
       }
+      int rv = storage_make_node(dir, pc.name, pc.len, mode);
+      return rv < 0 ? rv : 0;
+    }
 
-      created->refs = 1;
-      free(newNodePath);
-      return 0;
-    } else if (s > -1 && get_inode(s)->mode == 040755) { // intermediate node
-      if (strcmp(newNodePath, "/") == 0) {
-        strcpy(newNodePath + strlen(newNodePath), currentItem->data);
-      } else {
-        strcpy(newNodePath + strlen(newNodePath), "/");
-        strcpy(newNodePath + strlen(newNodePath), currentItem->data);
-      }
-    } else { // root node
-      int nodeNumToCreate = alloc_inode();
-      inode_t *created = get_inode(nodeNumToCreate);
-      created->mode = 040755;
-
-      char *selfname = ".";
-      char *parentname = "..";
-
-      directory_put(created, parentname, d);
-      directory_put(created, selfname, nodeNumToCreate);
-      directory_put(get_inode(d), currentItem->data, nodeNumToCreate);
-      created->refs = 1;
-
-      if (strcmp(newNodePath, "/") == 0) { // if new node is base node
-        strcat(newNodePath, currentItem->data);
-      } else {
-        strcat(newNodePath, "/");
-        strcat(newNodePath, currentItem->data);
+    if (inum < 0) { // intermediate node
+      inum = storage_make_node(dir, pc.name, pc.len, 040755);
+      if (inum < 0) {
+        return inum;
       }
-      // loop the loop again!
+    } else if (!S_ISDIR(peek_inode(inum)->mode)) {
+      return -ENOTDIR;
     }
+    dir = inum; // loop the loop again!
   }
+
+  printf("Node already exists!\n");
+  return -EEXIST; // the root
 }
 
 // unlinks node at given path from parent
 int storage_unlink(const char *path) {
-  char *dir = alloca(strlen(path) + 1);
-  char *sub = alloca(strlen(path) + 1);
+  const char *name;
+  int len;
+  int dirnum = filesys_lookup_parent(path, &name, &len);
+  if (dirnum < 0) {
+    return dirnum;
+  }
 
-  storage_find_parent(path, dir);
-  sub = storage_find_child(path, sub);
+  // don't let buffered data outlive the inode it belongs to
+  writeback_flush_all();
+  return directory_delete_n(get_inode(dirnum), name, len);
+}
 
-  int dirnum = filesys_lookup(dir);
-  int subnum = filesys_lookup(path);
+// removes the empty directory at the given path
+int storage_rmdir(const char *path) {
+  const char *name;
+  int len;
+  int dirnum = filesys_lookup_parent(path, &name, &len);
+  if (dirnum < 0) {
+    return dirnum;
+  }
 
   inode_t *dirnode = get_inode(dirnum);
-  inode_t *subnode = get_inode(subnum);
+  int inum = directory_lookup_n(dirnode, name, len);
+  if (inum < 0) {
+    return inum;
+  }
 
-  int rv = directory_delete(dirnode, sub);
+  const inode_t *node = peek_inode(inum);
+  if (!S_ISDIR(node->mode)) {
+    return -ENOTDIR;
+  }
+  if (node->entries > 2) {
+    return -ENOTEMPTY;
+  }
+
+  int rv = directory_delete_n(dirnode, name, len);
+  if (rv == 0) {
+    dirnode->refs--; // drop the reference held by its ".." entry
+  }
   return rv;
 }
 
+// removes everything below the directory at the given path, leaving it
+// empty; works on inodes directly, so it's linear in the size of the tree
+int storage_rmtree(const char *path) {
+  int inum = filesys_lookup(path);
+  if (inum < 0) {
+    return inum;
+  }
+
+  inode_t *node = get_inode(inum);
+  if (!S_ISDIR(node->mode)) {
+    return -ENOTDIR;
+  }
+
+  writeback_flush_all();
+  directory_teardown(node);
+  return 0;
+}
+
+// checks that the operations of a batch stay inside it and have names
+// that are single path components
+static int storage_batch_check(const struct nufs_batch *batch) {
+  if (batch->bytes > NUFS_BATCH_BYTES) {
+    return -EINVAL;
+  }
+  size_t at = 0;
+  for (uint32_t i = 0; i < batch->count; ++i) {
+    const struct nufs_batch_op *op = (const void *)(batch->ops + at);
+    if (at + sizeof(*op) > batch->bytes ||
+        NUFS_BATCH_OP_SIZE(op->name_len, op->data_len) > batch->bytes - at) {
+      return -EINVAL;
+    }
+    const char *name = (const char *)(op + 1);
+    if (op->name_len == 0 || memchr(name, '/', op->name_len) ||
+        (op->name_len <= 2 && !memcmp(name, "..", op->name_len))) {
+      return -EINVAL;
+    }
+    at += NUFS_BATCH_OP_SIZE(op->name_len, op->data_len);
+  }
+  return 0;
+}
+
+// runs one operation of a batch on a name in directory dir
+static int storage_batch_op(int dir, struct nufs_batch_op *op) {
+  const char *name = (const char *)(op + 1);
+  const char *data = name + op->name_len;
+  int inum = directory_lookup_n(peek_inode(dir), name, op->name_len);
+  if (op->op == NUFS_BATCH_CREATE) {
+    if (inum >= 0) {
+      return -EEXIST;
+    }
+    if ((op->mode & S_IFMT) != 0 && !S_ISREG(op->mode)) {
+      return -EINVAL;
+    }
+    inum = storage_make_node(dir, name, op->name_len,
+                             S_IFREG | (op->mode & 07777));
+    if (inum < 0 || op->data_len == 0) {
+      return inum < 0 ? inum : 0;
+    }
+    int rv = storage_write_inode(inum, data, op->data_len, 0);
+    return rv < 0 ? rv : 0;
+  }
+
+  if (inum < 0) {
+    return inum;
+  }
+  int mode = peek_inode(inum)->mode;
+  switch (op->op) {
+  case NUFS_BATCH_WRITE:
+    if (S_ISDIR(mode)) {
+      return -EISDIR;
+    }
+    if (op->offset < 0) {
+      return -EINVAL;
+    }
+    writeback_flush_inode(inum);
+    return storage_write_inode(inum, data, op->data_len, op->offset);
+  case NUFS_BATCH_STAT: {
+    struct stat st;
+    storage_stat_inode(inum, &st);
+    op->mode = st.st_mode;
+    op->size = st.st_size;
+    op->ino = inum;
+    op->nlink = st.st_nlink;
+    op->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return 0;
+  }
+  case NUFS_BATCH_UNLINK:
+    if (S_ISDIR(mode)) {
+      return -EISDIR;
+    }
+    writeback_flush_all();
+    return directory_delete_n(get_inode(dir), name, op->name_len);
+  default:
+    return -EINVAL;
+  }
+}
+
+// runs a batch of operations on the files of the directory at path (see
+// NUFS_IOC_BATCH), filling in their results; names are looked up in the
+// directory, not resolved from the root
+int storage_batch(const char *path, struct nufs_batch *batch) {
+  int dir = filesys_lookup(path);
+  if (dir < 0) {
+    return dir;
+  }
+  if (!S_ISDIR(peek_inode(dir)->mode)) {
+    return -ENOTDIR;
+  }
+  int rv = storage_batch_check(batch);
+  if (rv < 0) {
+    return rv;
+  }
+
+  size_t at = 0;
+  int failed = 0;
+  for (uint32_t i = 0; i < batch->count; ++i) {
+    struct nufs_batch_op *op = (void *)(batch->ops + at);
+    op->result = storage_batch_op(dir, op);
+    failed += op->result < 0;
+    at += NUFS_BATCH_OP_SIZE(op->name_len, op->data_len);
+  }
+  printf("+ storage_batch(%s) -> %u ops, %d failed\n", path, batch->count,
+         failed);
+  return 0;
+}
+
 // link files {from} and {to}
 int storage_link(const char *from, const char *to) {
   int toNum = filesys_lookup(to);
-  if (toNum >= 0) {
-    char *fromParent = alloca(strlen(from) + 1);
-    char *fromChild = alloca(strlen(from) + 1);
-    storage_find_parent(from, fromParent);
-    fromChild = storage_find_child(from, fromChild);
+  if (toNum < 0) {
+    return toNum;
+  }
 
-    int fromParentNum = filesys_lookup(fromParent);
-    inode_t *fromParentNode = get_inode(fromParentNum);
+  const char *fromChild;
+  int len;
+  int fromParentNum = filesys_lookup_parent(from, &fromChild, &len);
+  if (fromParentNum < 0) {
+    return fromParentNum;
+  }
 
-    int rv = directory_put(fromParentNode, fromChild, toNum);
-    return rv;
-  } else {
-    return toNum;
+  inode_t *fromParentNode = get_inode(fromParentNum);
+  if (directory_lookup_n(fromParentNode, fromChild, len) >= 0) {
+    return -EEXIST;
+  }
+  return directory_put_n(fromParentNode, fromChild, len, toNum);
+}
+
+// is directory inode anc the same as or above directory inode dir?
+static int storage_is_ancestor(int anc, int dir) {
+  while (dir != anc) {
+    if (dir == 0) {
+      return 0; // reached the root
+    }
+    dir = directory_lookup(peek_inode(dir), "..");
+    if (dir < 0) {
+      return 0;
+    }
   }
+  return 1;
+}
+
+// a directory that changes parent has to have its ".." (and the link
+// counts that go with it) follow
+static void storage_reparent(int inum, int olddir, int newdir) {
+  inode_t *node = get_inode(inum);
+  if (!S_ISDIR(node->mode) || olddir == newdir) {
+    return;
+  }
+  directory_set_n(node, "..", 2, newdir);
+  get_inode(olddir)->refs--;
+  get_inode(newdir)->refs++;
 }
 
 // renames file named {from} to {to}
-int storage_rename(const char *from, const char *to) {
-  int link_result = storage_link(to, from);
-  if (link_result >= 0) {
-    return storage_unlink(from);
+//
+// The entry is moved between the two parent directories in place: an
+// existing target is replaced by repointing its entry, so {to} always
+// names either the old or the new file and no reference count ever goes
+// up and back down. RENAME_NOREPLACE fails with EEXIST if {to} exists and
+// RENAME_EXCHANGE swaps the two entries.
+int storage_rename(const char *from, const char *to, int flags) {
+  if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) {
+    return -EINVAL;
+  }
+
+  const char *fromName, *toName;
+  int fromLen, toLen;
+  int fromDir = filesys_lookup_parent(from, &fromName, &fromLen);
+  if (fromDir < 0) {
+    return fromDir;
+  }
+  int toDir = filesys_lookup_parent(to, &toName, &toLen);
+  if (toDir < 0) {
+    return toDir;
+  }
+
+  inode_t *fromDirNode = get_inode(fromDir);
+  inode_t *toDirNode = get_inode(toDir);
+  int src = directory_lookup_n(fromDirNode, fromName, fromLen);
+  if (src < 0) {
+    return src;
+  }
+  int dst = directory_lookup_n(toDirNode, toName, toLen);
+  inode_t *srcNode = get_inode(src);
+
+  if (flags & RENAME_EXCHANGE) {
+    if (dst < 0) {
+      return dst;
+    }
+    if ((S_ISDIR(srcNode->mode) && storage_is_ancestor(src, toDir)) ||
+        (S_ISDIR(get_inode(dst)->mode) && storage_is_ancestor(dst, fromDir))) {
+      return -EINVAL;
+    }
+    directory_set_n(fromDirNode, fromName, fromLen, dst);
+    directory_set_n(toDirNode, toName, toLen, src);
+    storage_reparent(src, fromDir, toDir);
+    storage_reparent(dst, toDir, fromDir);
+    inode_touch_ctime(srcNode);
+    inode_touch_ctime(get_inode(dst));
+    return 0;
+  }
+
+  if (dst == src) {
+    return 0; // both names already refer to the same file
+  }
+  if (S_ISDIR(srcNode->mode) && storage_is_ancestor(src, toDir)) {
+    return -EINVAL; // can't move a directory below itself
+  }
+
+  if (dst >= 0) {
+    if (flags & RENAME_NOREPLACE) {
+      return -EEXIST;
+    }
+
+    inode_t *dstNode = get_inode(dst);
+    if (S_ISDIR(dstNode->mode)) {
+      if (!S_ISDIR(srcNode->mode)) {
+        return -EISDIR;
+      }
+      if (dstNode->entries > 2) {
+        return -ENOTEMPTY;
+      }
+    } else if (S_ISDIR(srcNode->mode)) {
+      return -ENOTDIR;
+    }
+
+    writeback_flush_inode(dst); // it may be freed below
+
+    // repoint the target entry, then drop the source entry
+    directory_set_n(toDirNode, toName, toLen, src);
+    directory_remove_n(fromDirNode, fromName, fromLen);
+    storage_reparent(src, fromDir, toDir);
+
+    // the replaced file loses the link it had
+    if (S_ISDIR(dstNode->mode)) {
+      toDirNode->refs--; // its ".."
+    }
+    dstNode->refs--;
+    inode_touch_ctime(dstNode);
+    if (dstNode->refs < 1) {
+      orphan_add(dst);
+    }
   } else {
-    return link_result;
-  }  
+    int rv = directory_insert_n(toDirNode, toName, toLen, src);
+    if (rv < 0) {
+      return rv;
+    }
+    directory_remove_n(fromDirNode, fromName, fromLen);
+    storage_reparent(src, fromDir, toDir);
+  }
+
+  inode_touch_ctime(srcNode);
+  return 0;
+}
+
+// changes the permission bits of the file; the file type stays
+int storage_chmod(const char *path, int mode) {
+  int inum = filesys_lookup(path);
+  if (inum < 0) {
+    return inum;
+  }
+
+  inode_t *node = get_inode(inum);
+  node->mode = (node->mode & S_IFMT) | (mode & 07777);
+  inode_touch_ctime(node);
+  return 0;
+}
+
+// sets a timestamp from a utimens() value, honoring UTIME_NOW/UTIME_OMIT
+static void set_timestamp(struct timespec *dst, const struct timespec *src) {
+  if (src->tv_nsec == UTIME_NOW) {
+    clock_gettime(CLOCK_REALTIME, dst);
+  } else if (src->tv_nsec != UTIME_OMIT) {
+    *dst = *src;
+  }
 }
 
 // updates timestamps of a file within storage
@@ -283,7 +870,9 @@ int storage_set_time(const char *path, const struct timespec ts[2]) {
   int inode_number = filesys_lookup(path);
   if (inode_number >= 0) {
     inode_t *node = get_inode(inode_number);
-    node->mod_time = ts->tv_sec;
+    set_timestamp(&node->acc_time, &ts[0]);
+    set_timestamp(&node->mod_time, &ts[1]);
+    inode_touch_ctime(node);
     return 0;
   } else {
     return inode_number;
@@ -291,11 +880,10 @@ int storage_set_time(const char *path, const struct timespec ts[2]) {
 }
 
 // returns 0 if file at path can be accessed
+// (this is a pure lookup: access() and open() don't count as reads)
 int storage_can_find(const char *path) {
   int inode_number = filesys_lookup(path);
   if (inode_number >= 0) {
-    inode_t *node = get_inode(inode_number);
-    node->acc_time = time(NULL);
     return 0;
   } else {
     return -1;
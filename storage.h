@@ -14,21 +14,61 @@
 
 #include "slist.h"
 
-extern const int BLOCK_COUNT;
-extern const int BLOCK_SIZE;
-extern const int NUFS_SIZE;
-extern const int BLOCK_BITMAP_SIZE;
+// flags for storage_rename(), as for renameat2(2)
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+// for storage_map*()'s writing: the caller writes every byte of the range
+// (so blocks newly allocated for it aren't zeroed first), not just some
+#define STORAGE_MAP_OVERWRITE 2
+
+// a piece of file contents stored contiguously in one image file
+typedef struct storage_extent {
+  int fd;      // the image file holding it
+  int bnum;    // the block it starts in
+  off_t pos;   // byte offset in that file; -1 for a hole (zeros)
+  size_t size; // length in bytes
+} storage_extent_t;
 
 void storage_init(const char *path);
+void storage_free();
+void storage_sync();
+void storage_op_begin();
+void storage_op_end();
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
+int storage_read_handle(int fh, char *buf, size_t size, off_t offset);
+int storage_read_inode(int inum, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+int storage_write_inode(int inum, const char *buf, size_t size, off_t offset);
+int storage_open(const char *path, int *keep_cache);
+int storage_write_handle(int fh, const char *buf, size_t size, off_t offset);
+int storage_flush(int fh);
+int storage_release(int fh);
+void storage_set_write_buffer(int size);
+int storage_map(const char *path, size_t size, off_t offset, int writing,
+                storage_extent_t **exts);
+int storage_map_handle(int fh, size_t size, off_t offset, int writing,
+                       storage_extent_t **exts);
+int storage_map_inode(int inum, size_t size, off_t offset, int writing,
+                      storage_extent_t **exts);
+void storage_map_done(const storage_extent_t *exts, int count);
 int storage_truncate(const char *path, off_t size);
-void storage_find_parent(const char *fullpath, char *dir);
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length);
 int storage_mknod(const char *path, int mode);
+int storage_make_node(int dir, const char *name, int len, int mode);
 int storage_unlink(const char *path);
+int storage_rmdir(const char *path);
+int storage_rmtree(const char *path);
+struct nufs_batch;
+int storage_batch(const char *path, struct nufs_batch *batch);
 int storage_link(const char *from, const char *to);
-int storage_rename(const char *from, const char *to);
+int storage_rename(const char *from, const char *to, int flags);
+int storage_chmod(const char *path, int mode);
 int storage_set_time(const char *path, const struct timespec ts[2]);
 int storage_can_find(const char *path);
 
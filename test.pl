@@ -2,12 +2,43 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 57;
 use IO::Handle;
+use Fcntl qw(O_RDONLY O_DIRECTORY);
+use POSIX qw(EINVAL EEXIST ENOENT EISDIR EOPNOTSUPP);
+
+# from nufs_ioctl.h: _IO('N', 1), _IOWR('N', 4, struct nufs_batch),
+# _IOR('N', 5, struct nufs_frag_stats), and the batch opcodes
+use constant NUFS_IOC_RMTREE => (ord("N") << 8) | 1;
+use constant NUFS_FRAG_STATS_SIZE => 200;
+use constant NUFS_IOC_FRAG_STATS =>
+    (2 << 30) | (NUFS_FRAG_STATS_SIZE << 16) | (ord("N") << 8) | 5;
+use constant NUFS_BATCH_SIZE => 16376;
+use constant NUFS_IOC_BATCH =>
+    (3 << 30) | (NUFS_BATCH_SIZE << 16) | (ord("N") << 8) | 4;
+use constant {
+    BATCH_CREATE => 1, BATCH_WRITE => 2, BATCH_STAT => 3, BATCH_UNLINK => 4,
+};
+
+# Perl has no fallocate(): the x86-64 syscall number, and the modes from
+# <linux/falloc.h>
+use constant SYS_fallocate => 285;
+use constant {
+    FALLOC_FL_KEEP_SIZE => 1, FALLOC_FL_PUNCH_HOLE => 2,
+    FALLOC_FL_ZERO_RANGE => 0x10,
+};
+
+# the mount point is on another device once nufs is up
+sub mounted {
+    my @mnt = stat("mnt");
+    my @here = stat(".");
+    return @mnt && $mnt[0] != $here[0];
+}
 
 sub mount {
     system("(make mount 2>&1) >> test.log &");
-    sleep 1;
+    my $deadline = time() + 30; # make may have to build nufs first
+    select(undef, undef, undef, 0.01) until mounted() or time() > $deadline;
 }
 
 sub unmount {
@@ -41,6 +72,69 @@ sub read_text_slice {
     return $data;
 }
 
+# free blocks of the volume, from NUFS_IOC_FRAG_STATS; -1 if it failed
+sub free_blocks {
+    my $stats = "\0" x NUFS_FRAG_STATS_SIZE;
+    sysopen(my $fh, "mnt", O_RDONLY | O_DIRECTORY) or return -1;
+    ioctl($fh, NUFS_IOC_FRAG_STATS, $stats) or return -1;
+    close $fh;
+    return unpack("Q", substr($stats, 64, 8));
+}
+
+# writes a file, opens it for reading and writing, and unlinks it;
+# returns the handle
+sub open_unlinked {
+    my ($name, $data) = @_;
+    open my $out, ">", "mnt/$name" or return;
+    print $out $data;
+    close $out;
+    open my $fh, "+<", "mnt/$name" or return;
+    unlink("mnt/$name");
+    return $fh;
+}
+
+# fallocate(2) on a file; returns 0 or -errno
+sub fallocate_file {
+    my ($name, $mode, $offset, $length) = @_;
+    open my $fh, "+<", "mnt/$name" or return -($! + 0);
+    my $rv = syscall(SYS_fallocate, fileno($fh), $mode, $offset, $length);
+    my $err = $! + 0;
+    close $fh;
+    return $rv == 0 ? 0 : -$err;
+}
+
+# one struct nufs_batch_op with its name and data, padded to 8 bytes
+sub batch_op {
+    my ($op, $name, $data, $mode, $offset) = @_;
+    $data //= "";
+    my $rec = pack("SSLlLqQLLq", $op, length($name), length($data), 0,
+                   $mode // 0, $offset // 0, 0, 0, 0, 0) . $name . $data;
+    return $rec . "\0" x (-length($rec) % 8);
+}
+
+# runs NUFS_IOC_BATCH on a directory; returns what each operation got
+# back (result and the stat fields), or -errno if the ioctl failed
+sub run_batch {
+    my ($dir, @ops) = @_;
+    my $ops = join("", @ops);
+    my $batch = pack("LL", scalar(@ops), length($ops)) . $ops;
+    $batch .= "\0" x (NUFS_BATCH_SIZE - length($batch));
+    sysopen(my $fh, "mnt/$dir", O_RDONLY | O_DIRECTORY) or return -($! + 0);
+    ioctl($fh, NUFS_IOC_BATCH, $batch) or return -($! + 0);
+    close $fh;
+
+    my @results;
+    my $at = 8;
+    for my $op (@ops) {
+        my (undef, undef, undef, $result, $mode, undef, $size, undef, $nlink,
+            $mtime_ns) = unpack("SSLlLqQLLq", substr($batch, $at, 48));
+        push @results, { result => $result, mode => $mode, size => $size,
+                         nlink => $nlink, mtime_ns => $mtime_ns };
+        $at += length($op);
+    }
+    return @results;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -171,5 +265,265 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Batches";
+
+mkdir("mnt/batch");
+mkdir("mnt/batch/sub");
+
+my @r = run_batch("batch", batch_op(BATCH_CREATE, "m", "", 0644),
+                  batch_op(BATCH_CREATE, "x/y", "", 0644));
+ok((@r == 1 and $r[0] == -EINVAL and !-e "mnt/batch/m"),
+   "A malformed batch fails with EINVAL and runs nothing");
+
+@r = run_batch("batch",
+               batch_op(BATCH_CREATE, "a", "hello", 0644),
+               batch_op(BATCH_CREATE, "a", "", 0644),
+               batch_op(BATCH_WRITE, "a", " world", 0, 5),
+               batch_op(BATCH_STAT, "a"),
+               batch_op(BATCH_WRITE, "none", "x", 0, 0),
+               batch_op(BATCH_UNLINK, "sub"),
+               batch_op(BATCH_CREATE, "b", "", 0600),
+               batch_op(BATCH_UNLINK, "b"),
+               batch_op(BATCH_STAT, "b"));
+my $results = join(" ", map { ref $_ ? $_->{result} : "failed($_)" } @r);
+say "# Results: $results";
+ok($results eq join(" ", 0, -EEXIST, 6, 0, -ENOENT, -EISDIR, 0, 0, -ENOENT),
+   "Each operation of a batch gets its own result");
+
+my @st = stat("mnt/batch/a");
+my $bst = $r[3];
+ok((ref $bst and @st and $bst->{size} == 11 and $bst->{size} == $st[7] and
+    $bst->{mode} == $st[2] and $bst->{nlink} == $st[3] and
+    int($bst->{mtime_ns} / 1_000_000_000) == $st[9]),
+   "Batch stat agrees with stat(2)");
+ok(read_text("batch/a") eq "hello world", "Read back what a batch wrote");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Removing directories";
+
+mkdir("mnt/full");
+write_text("full/file.txt", "x");
+ok((!rmdir("mnt/full") and $!{ENOTEMPTY} and -d "mnt/full"),
+   "rmdir of a non-empty directory fails with ENOTEMPTY");
+ok((!rmdir("mnt/full/file.txt") and $!{ENOTDIR} and -f "mnt/full/file.txt"),
+   "rmdir of a file fails with ENOTDIR");
+
+mkdir("mnt/tree");
+for my $a (1..5) {
+    mkdir("mnt/tree/d$a");
+    for my $b (1..5) {
+        mkdir("mnt/tree/d$a/d$b");
+        write_text("tree/d$a/d$b/f$_.txt", "$a $b $_") for 1..10;
+    }
+}
+my $removed = 0;
+if (sysopen(my $tree, "mnt/tree", O_RDONLY | O_DIRECTORY)) {
+    $removed = ioctl($tree, NUFS_IOC_RMTREE, 0);
+    close $tree;
+}
+ok(($removed and `ls -A mnt/tree` eq ""),
+   "NUFS_IOC_RMTREE removes everything below a directory");
+ok((rmdir("mnt/tree") and !-e "mnt/tree" and -f "mnt/full/file.txt"),
+   "rmdir removes the emptied directory, and nothing else went");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Links and renames";
+
+write_text("target.txt", "old");
+write_text("temp.txt", "new");
+ok((!link("mnt/temp.txt", "mnt/target.txt") and $!{EEXIST}),
+   "link to a name that exists fails with EEXIST");
+
+open my $replaced, "<", "mnt/target.txt";
+ok((rename("mnt/temp.txt", "mnt/target.txt") and !-e "mnt/temp.txt" and
+    read_text("target.txt") eq "new"),
+   "rename replaces an existing file");
+my $was = $replaced ? <$replaced> // "" : "";
+close $replaced if $replaced;
+$was =~ s/\s*$//;
+ok($was eq "old", "The replaced file is still read through an open handle");
+
+mkdir("mnt/outer");
+mkdir("mnt/outer/inner");
+ok((!rename("mnt/outer", "mnt/outer/inner/moved") and $!{EINVAL} and
+    -d "mnt/outer/inner"),
+   "Moving a directory into its own subtree fails with EINVAL");
+
+mkdir("mnt/empty");
+ok((rename("mnt/outer", "mnt/empty") and -d "mnt/empty/inner" and
+    !-e "mnt/outer"),
+   "A directory replaces an empty one");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# fallocate";
+
+# three 4K blocks of x each; the ranges below start and end inside blocks
+my $blocks = "x" x 12288;
+for my $name ("keep.bin", "punch.bin", "zero.bin") {
+    open my $fh, ">", "mnt/$name" or next;
+    print $fh $blocks;
+    close $fh;
+}
+
+ok((fallocate_file("keep.bin", FALLOC_FL_KEEP_SIZE, 12288, 8192) == 0 and
+    -s "mnt/keep.bin" == 12288 and
+    read_text_slice("keep.bin", 12288, 0) eq $blocks),
+   "Preallocating with KEEP_SIZE leaves the size and data alone");
+
+ok((fallocate_file("keep.bin", 0, 0, 20000) == 0 and
+    -s "mnt/keep.bin" == 20000),
+   "Preallocating past the end grows the file");
+
+ok((fallocate_file("punch.bin", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   1000, 8000) == 0 and
+    -s "mnt/punch.bin" == 12288 and
+    read_text_slice("punch.bin", 12288, 0) eq
+        ("x" x 1000) . ("\0" x 8000) . ("x" x 3288)),
+   "A punched hole reads as zeros, partial blocks included");
+
+# needs a kernel whose FUSE passes FALLOC_FL_ZERO_RANGE through
+ok((fallocate_file("zero.bin", FALLOC_FL_ZERO_RANGE, 4095, 4098) == 0 and
+    -s "mnt/zero.bin" == 12288 and
+    read_text_slice("zero.bin", 12288, 0) eq
+        ("x" x 4095) . ("\0" x 4098) . ("x" x 4095)),
+   "A zeroed range reads as zeros, partial blocks included");
+
+ok(fallocate_file("punch.bin", FALLOC_FL_PUNCH_HOLE, 0, 10) == -EOPNOTSUPP,
+   "Punching a hole without KEEP_SIZE fails with EOPNOTSUPP");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Unlinked open files";
+
+my $free = free_blocks();
+my $doomed = "u" x (256 * 1024);
+my $open = open_unlinked("doomed.bin", $doomed);
+$back = "";
+if ($open) {
+    sysseek($open, 0, 0);
+    sysread($open, $back, length($doomed));
+}
+ok((!-e "mnt/doomed.bin" and $back eq $doomed),
+   "An unlinked file is still read through an open handle");
+
+$back = "";
+if ($open) {
+    sysseek($open, 0, 0);
+    syswrite($open, "zz");
+    sysseek($open, 0, 0);
+    sysread($open, $back, 4);
+}
+ok($back eq "zzuu", "... and written");
+
+my $held = free_blocks();
+close $open if $open;
+my $deadline = time() + 5; # the last handle is released asynchronously
+select(undef, undef, undef, 0.01)
+    until free_blocks() == $free or time() > $deadline;
+ok(($held < $free and free_blocks() == $free),
+   "Closing the last handle frees its blocks");
+
+# nufs dies with a file unlinked but still open: its blocks stay on the
+# image's orphan list until the next mount finishes it
+$open = open_unlinked("doomed.bin", $doomed);
+$open->sync if $open; # gets the orphan list onto the image
+system("pkill -9 -f '^./nufs .*mnt data.nufs'");
+close $open if $open;
+unmount();
+mount();
+ok(free_blocks() == $free,
+   "The next mount frees a file that was unlinked while open");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Overwriting across blocks";
+
+# written a block at a time, so every block has a checksum to go stale
+for my $name ("whole.bin", "middle.bin") {
+    open my $fh, ">", "mnt/$name" or next;
+    print $fh "a" x 4096 for 1 .. 16;
+    close $fh;
+}
+
+if (open my $fh, "+<", "mnt/whole.bin") {
+    syswrite($fh, "b" x 65536);
+    close $fh;
+}
+if (open my $fh, "+<", "mnt/middle.bin") {
+    sysseek($fh, 100, 0);
+    syswrite($fh, "b" x 10000);
+    close $fh;
+}
+
+unmount();
+mount();
+
+ok(read_text_slice("whole.bin", 65536, 0) eq "b" x 65536,
+   "A file overwritten in one write reads back after remounting");
+ok(read_text_slice("middle.bin", 65536, 0) eq
+       ("a" x 100) . ("b" x 10000) . ("a" x 55436),
+   "Overwriting across block boundaries reads back after remounting");
+
+unmount();
+
+system("rm -rf data.nufs test.log copy.nufs full.delta 2.delta test.tree");
+
+say "# Incremental backups";
+
+system("(make nufs-mkimage nufs-delta nufs-apply 2>&1) >> test.log");
+mkdir("test.tree");
+mkdir("test.tree/d1");
+for my $i (1 .. 5) {
+    open my $fh, ">", "test.tree/d1/f$i" or next;
+    print $fh chr(ord("a") + $i) x 20000;
+    close $fh;
+}
+system("(./nufs-mkimage data.nufs test.tree 2>&1) >> test.log");
+system("./nufs-delta data.nufs > full.delta 2>> test.log");
+system("./nufs-apply copy.nufs < full.delta 2>> test.log");
+ok(system("cmp -s data.nufs copy.nufs") == 0,
+   "A full delta makes a copy of the image");
+
+# the delta from epoch 2 has to pick up every block the write changed
+mount();
+if (open my $fh, "+<", "mnt/d1/f3") {
+    sysseek($fh, 100, 0);
+    syswrite($fh, "z" x 10000);
+    close $fh;
+}
+unmount();
+system("./nufs-delta -e 2 data.nufs > 2.delta 2>> test.log");
+system("./nufs-apply copy.nufs < 2.delta 2>> test.log");
+ok(system("cmp -s data.nufs copy.nufs") == 0,
+   "An incremental delta brings the copy up to date");
 
+system("rm -rf copy.nufs full.delta 2.delta test.tree");
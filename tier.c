@@ -0,0 +1,161 @@
+/**
+ * @file tier.c
+ *
+ * Migrator for two-tier volumes. Each pass ages the heat of every block,
+ * then walks the inode table one inode per operation and moves the data
+ * blocks of each file, one at a time, to the tier they belong on. Moved
+ * blocks of a file are placed after each other where there is room.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "inode.h"
+#include "tier.h"
+#include "writeback.h"
+
+#define TIER_RESERVE 20 // percent of the fast data blocks kept free
+#define TIER_HOT 4      // heat at which a slow block is promoted
+
+static pthread_t tier_thread;
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_wake = PTHREAD_COND_INITIALIZER;
+static int tier_running = 0;
+static int tier_stopping = 0;
+static int tier_interval = 0; // seconds between passes
+
+// move the file's data blocks that are on the wrong tier; *fast_free
+// keeps count of the free fast blocks
+static int tier_file(int inum, long reserve, long *fast_free) {
+  const inode_t *node = peek_inode(inum);
+  if (node->refs < 1 || S_ISDIR(node->mode) || writeback_is_open(inum)) {
+    return 0;
+  }
+
+  int moved = 0;
+  int goal = -1; // where the last block of this file went
+  int blocks = inode_blocks(node);
+  for (int i = 0; i < blocks; ++i) {
+    int bnum = inode_get_bnum(node, i * BLOCK_SIZE);
+    if (bnum == 0) {
+      continue; // a hole
+    }
+    int hot = blocks_tier_heat(bnum);
+    int tier;
+    if (blocks_tier(bnum) == TIER_FAST && hot == 0 && *fast_free < reserve) {
+      tier = TIER_SLOW;
+    } else if (blocks_tier(bnum) == TIER_SLOW && hot >= TIER_HOT &&
+               *fast_free > reserve) {
+      tier = TIER_FAST;
+    } else {
+      continue;
+    }
+
+    int got;
+    int to = alloc_blocks_in(tier, goal + 1, 1, 1, &got);
+    if (to < 0) {
+      continue;
+    }
+    if (inode_move_block(get_inode(inum), i, to) < 0) {
+      free_block(to);
+      continue;
+    }
+    blocks_tier_set_heat(to, hot);
+    goal = to;
+    moved++;
+    if (tier == TIER_SLOW) {
+      blocks_tier_stats.demoted++;
+      (*fast_free)++;
+    } else {
+      blocks_tier_stats.promoted++;
+      (*fast_free)--;
+    }
+  }
+  return moved;
+}
+
+int tier_pass() {
+  if (FAST_BLOCKS >= BLOCK_COUNT) {
+    return 0;
+  }
+  blocks_op_begin();
+  blocks_tier_age();
+  long reserve = (long)(FAST_BLOCKS - DATA_START) * TIER_RESERVE / 100;
+  blocks_op_end();
+
+  // a file per operation, so requests wait for one file's blocks at most
+  int moved = 0;
+  for (int inum = 0; inum < INODE_COUNT; ++inum) {
+    blocks_op_begin();
+    if (blocks_bitmap_get(INODE_BITMAP_START, inum)) {
+      long fast_free = blocks_tier_free(TIER_FAST);
+      moved += tier_file(inum, reserve, &fast_free);
+    }
+    blocks_op_end();
+
+    pthread_mutex_lock(&tier_lock);
+    int stop = tier_stopping;
+    pthread_mutex_unlock(&tier_lock);
+    if (stop) {
+      break;
+    }
+  }
+
+  blocks_op_begin();
+  blocks_tier_stats.passes++;
+  blocks_op_end();
+  if (moved > 0) {
+    printf("+ tier_pass() -> %d blocks moved\n", moved);
+  }
+  return moved;
+}
+
+static void *tier_main(void *arg) {
+  pthread_mutex_lock(&tier_lock);
+  while (!tier_stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += tier_interval;
+    while (!tier_stopping &&
+           pthread_cond_timedwait(&tier_wake, &tier_lock, &until) !=
+               ETIMEDOUT) {
+    }
+    if (tier_stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&tier_lock);
+    tier_pass();
+    pthread_mutex_lock(&tier_lock);
+  }
+  pthread_mutex_unlock(&tier_lock);
+  return 0;
+}
+
+int tier_start(int interval) {
+  if (interval <= 0 || FAST_BLOCKS >= BLOCK_COUNT || tier_running) {
+    return 0;
+  }
+  tier_interval = interval;
+  tier_stopping = 0;
+  int rv = pthread_create(&tier_thread, 0, tier_main, 0);
+  if (rv != 0) {
+    return -rv;
+  }
+  tier_running = 1;
+  return 0;
+}
+
+void tier_stop() {
+  if (!tier_running) {
+    return;
+  }
+  pthread_mutex_lock(&tier_lock);
+  tier_stopping = 1;
+  pthread_cond_signal(&tier_wake);
+  pthread_mutex_unlock(&tier_lock);
+  pthread_join(tier_thread, 0);
+  tier_running = 0;
+}
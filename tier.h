@@ -0,0 +1,39 @@
+/**
+ * @file tier.h
+ *
+ * Migrator for two-tier volumes (see blocks.h): a thread that wakes up
+ * every so often and moves file blocks between the tiers by their heat.
+ *
+ * While the fast tier has less than TIER_RESERVE percent of its data
+ * blocks free, blocks nobody has used lately are demoted to the slow
+ * tier; while it has more, blocks on the slow tier that are used a lot
+ * are promoted back. Only files nobody has open are touched, so nothing
+ * is reading or writing a block through the image file while it moves.
+ */
+#ifndef TIER_H
+#define TIER_H
+
+/**
+ * Go over every file once, moving blocks as described above. Each file is
+ * its own operation, so file system requests get in between.
+ *
+ * @return Number of blocks moved.
+ */
+int tier_pass();
+
+/**
+ * Start the migrator.
+ *
+ * @param interval Seconds between passes; 0 or less, or a volume without
+ *                 a slow tier, leaves the migrator off.
+ *
+ * @return 0, or a negative errno if the thread can't be started.
+ */
+int tier_start(int interval);
+
+/**
+ * Stop the migrator and wait for it to finish the file it is on.
+ */
+void tier_stop();
+
+#endif
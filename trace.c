@@ -0,0 +1,140 @@
+/**
+ * @file trace.c
+ *
+ * Trace writer and reader. Records are collected in a buffer and written
+ * when it fills, so tracing costs a memcpy per operation.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_BUFFER (256 * 1024)
+
+static const char *op_names[TRACE_OPS] = {
+    [TRACE_ACCESS] = "access",       [TRACE_GETATTR] = "getattr",
+    [TRACE_READDIR] = "readdir",     [TRACE_MKNOD] = "mknod",
+    [TRACE_MKDIR] = "mkdir",         [TRACE_UNLINK] = "unlink",
+    [TRACE_LINK] = "link",           [TRACE_RMDIR] = "rmdir",
+    [TRACE_RENAME] = "rename",       [TRACE_CHMOD] = "chmod",
+    [TRACE_TRUNCATE] = "truncate",   [TRACE_FALLOCATE] = "fallocate",
+    [TRACE_OPEN] = "open",           [TRACE_FLUSH] = "flush",
+    [TRACE_RELEASE] = "release",     [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",         [TRACE_READ_BUF] = "read_buf",
+    [TRACE_WRITE_BUF] = "write_buf", [TRACE_UTIMENS] = "utimens",
+    [TRACE_IOCTL] = "ioctl",         [TRACE_SYMLINK] = "symlink",
+    [TRACE_READLINK] = "readlink",   [TRACE_FSYNC] = "fsync",
+};
+
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+static char trace_buf[TRACE_BUFFER];
+static int trace_len = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void trace_flush() {
+  int done = 0;
+  while (done < trace_len) {
+    ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+    if (n <= 0) {
+      break; // losing the tail of a trace beats stalling the file system
+    }
+    done += n;
+  }
+  trace_len = 0;
+}
+
+static void trace_append(const void *data, size_t size) {
+  if (trace_len + size > TRACE_BUFFER) {
+    trace_flush();
+  }
+  memcpy(trace_buf + trace_len, data, size);
+  trace_len += size;
+}
+
+uint64_t trace_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int trace_open(const char *path, int write_buffer) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd < 0) {
+    return -errno;
+  }
+  trace_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.write_buffer = write_buffer;
+  trace_epoch = trace_clock();
+  trace_append(&hdr, sizeof(hdr));
+  return 0;
+}
+
+int trace_active() { return trace_fd >= 0; }
+
+void trace_log(trace_record_t *rec, const char *path, const char *path2) {
+  uint64_t end = trace_clock();
+  uint64_t took = end - rec->start_ns;
+  rec->duration_ns = took > UINT32_MAX ? UINT32_MAX : took;
+  rec->start_ns -= trace_epoch;
+  size_t len = path ? strlen(path) : 0;
+  size_t len2 = path2 ? strlen(path2) : 0;
+  rec->path_len = len > UINT16_MAX ? UINT16_MAX : len;
+  rec->path2_len = len2 > UINT16_MAX ? UINT16_MAX : len2;
+
+  pthread_mutex_lock(&trace_lock);
+  trace_append(rec, sizeof(*rec));
+  if (path) {
+    trace_append(path, rec->path_len);
+  }
+  if (path2) {
+    trace_append(path2, rec->path2_len);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_close() {
+  if (trace_fd < 0) {
+    return;
+  }
+  pthread_mutex_lock(&trace_lock);
+  trace_flush();
+  close(trace_fd);
+  trace_fd = -1;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_read_header(FILE *in, trace_header_t *hdr) {
+  if (fread(hdr, sizeof(*hdr), 1, in) != 1 ||
+      memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int trace_read(FILE *in, trace_record_t *rec, char *path, char *path2) {
+  size_t n = fread(rec, 1, sizeof(*rec), in);
+  if (n == 0) {
+    return 0;
+  }
+  if (n != sizeof(*rec) || fread(path, 1, rec->path_len, in) != rec->path_len ||
+      fread(path2, 1, rec->path2_len, in) != rec->path2_len) {
+    return -1;
+  }
+  path[rec->path_len] = 0;
+  path2[rec->path2_len] = 0;
+  return 1;
+}
+
+const char *trace_op_name(int op) {
+  if (op <= 0 || op >= TRACE_OPS) {
+    return "unknown";
+  }
+  return op_names[op];
+}
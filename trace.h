@@ -0,0 +1,127 @@
+/**
+ * @file trace.h
+ *
+ * Binary traces of file system operations, written by `nufs -o trace=FILE`
+ * and replayed by nufs-replay.
+ *
+ * A trace is a trace_header_t followed by one trace_record_t per
+ * operation, each followed by its path and second path (without NULs).
+ * Numbers are stored in host byte order. File data isn't recorded, only
+ * where and how much was read or written.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "NUFSTRC1"
+
+// one per FUSE callback; the numbers are part of the file format
+enum trace_op {
+  TRACE_ACCESS = 1,
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_MKNOD,
+  TRACE_MKDIR,
+  TRACE_UNLINK,
+  TRACE_LINK,
+  TRACE_RMDIR,
+  TRACE_RENAME,
+  TRACE_CHMOD,
+  TRACE_TRUNCATE,
+  TRACE_FALLOCATE,
+  TRACE_OPEN,
+  TRACE_FLUSH,
+  TRACE_RELEASE,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_READ_BUF,
+  TRACE_WRITE_BUF,
+  TRACE_UTIMENS,
+  TRACE_IOCTL,
+  TRACE_SYMLINK,
+  TRACE_READLINK,
+  TRACE_FSYNC,
+  TRACE_OPS, // number of op codes
+};
+
+typedef struct trace_header {
+  char magic[8];        // TRACE_MAGIC
+  int32_t write_buffer; // the write_buffer option of the traced mount
+  int32_t reserved;
+} trace_header_t;
+
+typedef struct __attribute__((packed)) trace_record {
+  uint8_t op;
+  uint16_t path_len;  // bytes of path after the record
+  uint16_t path2_len; // bytes of the second path (link, rename, symlink)
+  int32_t result;     // what the callback returned
+  uint32_t mode;      // mode, fallocate mode or ioctl command
+  uint32_t fh;        // handle the file was opened with
+  int64_t offset;
+  uint64_t size;        // bytes, or the new length for truncate/fallocate
+  uint64_t start_ns;    // since the trace started
+  uint32_t duration_ns; // saturates at about 4 seconds
+} trace_record_t;
+
+/**
+ * Start writing a trace.
+ *
+ * @param path File to write it to (replaced if it exists).
+ * @param write_buffer Write-back buffer size in effect, for the replay.
+ *
+ * @return 0, or a negative errno.
+ */
+int trace_open(const char *path, int write_buffer);
+
+/**
+ * @return Whether a trace is being written.
+ */
+int trace_active();
+
+/**
+ * @return The current time in nanoseconds, for trace_log().
+ */
+uint64_t trace_clock();
+
+/**
+ * Append a record for an operation. Safe to call from several threads.
+ *
+ * @param rec The record; start_ns is the trace_clock() value taken
+ *            before the operation, and is made relative here.
+ *            duration_ns, path_len and path2_len are filled in too.
+ * @param path Path the operation was on, or NULL for a file that was
+ *             unlinked while open.
+ * @param path2 Second path, or NULL.
+ */
+void trace_log(trace_record_t *rec, const char *path, const char *path2);
+
+/**
+ * Write out what is buffered and close the trace.
+ */
+void trace_close();
+
+/**
+ * Read the header of a trace.
+ *
+ * @return 0, or -1 if the file isn't a trace.
+ */
+int trace_read_header(FILE *in, trace_header_t *hdr);
+
+/**
+ * Read the next record of a trace.
+ *
+ * @param path, path2 Receive the NUL-terminated paths; room for
+ *                    UINT16_MAX + 1 bytes each.
+ *
+ * @return 1, 0 at the end of the trace, or -1 if it is cut short.
+ */
+int trace_read(FILE *in, trace_record_t *rec, char *path, char *path2);
+
+/**
+ * @return The name of an op code ("getattr", ...).
+ */
+const char *trace_op_name(int op);
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file writeback.c
+ *
+ * Per-open-file write-back buffers.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "storage.h"
+#include "writeback.h"
+
+typedef struct writeback {
+  int inum;    // inode the handle writes to; -1 if the slot is free
+  char *buf;   // pending data ...
+  off_t start; // ... destined for this offset
+  int len;
+  int size;    // capacity of buf
+  int error;   // failure of a flush nobody has been told about yet
+} writeback_t;
+
+static int buffer_size = 0;
+
+static writeback_t *handles = 0;
+static int nhandles = 0;
+static int pending = 0; // handles with len > 0
+
+void writeback_set_size(int size) { buffer_size = size; }
+
+int writeback_open(int inum) {
+  int h = 0;
+  while (h < nhandles && handles[h].inum >= 0) {
+    h++;
+  }
+  if (h == nhandles) {
+    nhandles = nhandles ? 2 * nhandles : 8;
+    handles = realloc(handles, nhandles * sizeof(writeback_t));
+    for (int i = h; i < nhandles; ++i) {
+      handles[i].inum = -1;
+    }
+  }
+
+  writeback_t *wb = &handles[h];
+  wb->inum = inum;
+  wb->buf = buffer_size > 0 ? malloc(buffer_size) : 0;
+  wb->start = 0;
+  wb->len = 0;
+  wb->size = buffer_size;
+  wb->error = 0;
+  return h + 1;
+}
+
+// write the pending range out, remembering a failure for the next flush
+static void writeback_drain(writeback_t *wb) {
+  if (wb->len == 0) {
+    return;
+  }
+  int rv = storage_write_inode(wb->inum, wb->buf, wb->len, wb->start);
+  if (rv < 0 && !wb->error) {
+    wb->error = rv;
+  }
+  wb->len = 0;
+  pending--;
+}
+
+// drain every handle on the inode except `keep`
+static void writeback_drain_inode(int inum, writeback_t *keep) {
+  for (int h = 0; pending > 0 && h < nhandles; ++h) {
+    if (handles[h].inum == inum && &handles[h] != keep) {
+      writeback_drain(&handles[h]);
+    }
+  }
+}
+
+int writeback_write(int handle, const char *buf, size_t size, off_t offset) {
+  writeback_t *wb = &handles[handle - 1];
+
+  // only one handle holds pending data for an inode at a time, so writes
+  // through different handles reach the file in the order they were made
+  writeback_drain_inode(wb->inum, wb);
+
+  // only a write that continues or overlaps the pending range, and keeps
+  // it within the buffer, can be merged
+  if (wb->len > 0 &&
+      (offset < wb->start || offset > wb->start + wb->len ||
+       offset + size > wb->start + wb->size)) {
+    writeback_drain(wb);
+  }
+  if (wb->error) {
+    // report it now, rather than only at the next flush or close
+    int rv = wb->error;
+    wb->error = 0;
+    return rv;
+  }
+  if (size > wb->size || size == 0) {
+    return storage_write_inode(wb->inum, buf, size, offset);
+  }
+
+  if (wb->len == 0) {
+    wb->start = offset;
+    pending++;
+  }
+  memcpy(wb->buf + (offset - wb->start), buf, size);
+  if (offset + size > wb->start + wb->len) {
+    wb->len = offset + size - wb->start;
+  }
+  return size;
+}
+
+int writeback_flush(int handle) {
+  writeback_t *wb = &handles[handle - 1];
+  writeback_drain(wb);
+  int rv = wb->error;
+  wb->error = 0;
+  return rv;
+}
+
+int writeback_release(int handle) {
+  int rv = writeback_flush(handle);
+  writeback_t *wb = &handles[handle - 1];
+  free(wb->buf);
+  wb->buf = 0;
+  wb->inum = -1;
+  return rv;
+}
+
+int writeback_inum(int handle) { return handles[handle - 1].inum; }
+
+int writeback_is_open(int inum) {
+  for (int h = 0; h < nhandles; ++h) {
+    if (handles[h].inum == inum) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void writeback_flush_inode(int inum) { writeback_drain_inode(inum, 0); }
+
+void writeback_flush_all() {
+  for (int h = 0; pending > 0 && h < nhandles; ++h) {
+    if (handles[h].inum >= 0) {
+      writeback_drain(&handles[h]);
+    }
+  }
+}
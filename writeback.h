@@ -0,0 +1,81 @@
+/**
+ * @file writeback.h
+ *
+ * Per-open-file write-back buffers.
+ *
+ * Each handle holds one contiguous range of pending data. Small writes
+ * that land inside or right after that range are merged in memory and
+ * reach the file in one storage write when the handle is flushed, when the
+ * range would outgrow the buffer, or when another operation needs to see
+ * the file as it really is (see writeback_flush_inode()).
+ *
+ * Every open file gets a handle, a small positive number, which also
+ * tells which inodes are open (see writeback_is_open()). With the buffer
+ * size at 0, writes through it go straight to the file.
+ */
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <sys/types.h>
+
+/**
+ * Set the buffer size for handles opened from now on.
+ *
+ * @param size Buffer size in bytes; 0 turns buffering off.
+ */
+void writeback_set_size(int size);
+
+/**
+ * Open a handle on an inode.
+ *
+ * @param inum Inode the handle reads and writes.
+ *
+ * @return The handle.
+ */
+int writeback_open(int inum);
+
+/**
+ * Write through a handle, buffering the data if it fits.
+ *
+ * @return size, or a negative errno if flushing earlier data of the
+ *         handle failed (which is then cleared, and this write dropped).
+ */
+int writeback_write(int handle, const char *buf, size_t size, off_t offset);
+
+/**
+ * Write the handle's pending data to the file.
+ *
+ * @return 0, or a negative errno from this or an earlier background flush.
+ */
+int writeback_flush(int handle);
+
+/**
+ * Flush and close a handle.
+ *
+ * @return As for writeback_flush().
+ */
+int writeback_release(int handle);
+
+/**
+ * @return The inode a handle is on.
+ */
+int writeback_inum(int handle);
+
+/**
+ * @return Whether any handle is open on the inode.
+ */
+int writeback_is_open(int inum);
+
+/**
+ * Flush every handle with pending data for the given inode.
+ *
+ * @param inum Inode that is about to be read or changed.
+ */
+void writeback_flush_inode(int inum);
+
+/**
+ * Flush every handle with pending data.
+ */
+void writeback_flush_all();
+
+#endif